@@ -25,6 +25,9 @@
 #include <sys/types.h>
 #include <zlib.h>
 
+#include "fileio.h"
+#include "layout.h"
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
@@ -256,98 +259,20 @@ struct fdt_header {
 
 #define UNDEFINED 0xFFFFFFFF
 
-static void fill_zero(int ifd, int size, int offset)
+/* Plan datafile from datafile_offset up to its end at offset in the output */
+static void plan_file(layout_t *l, const char *datafile, int offset,
+		int datafile_offset, int flags)
 {
-	int fill_size;
-	uint8_t zeros[4096];
-	memset(zeros, 0, sizeof(zeros));
-
-	lseek(ifd, offset, SEEK_SET);
-
-	while (size) {
-
-		if (size > 4096)
-			fill_size = 4096;
-		else
-			fill_size = size;
-
-		if (write(ifd, (char *)&zeros, fill_size) != fill_size) {
-			fprintf(stderr, "Write error: %s\n",
-				strerror(errno));
-			exit(EXIT_FAILURE);
-		}
-
-		size -= fill_size;
-
-	};
-}
-
-static void
-copy_file (int ifd, const char *datafile, int pad, int offset, int datafile_offset)
-{
-	int dfd;
 	struct stat sbuf;
-	unsigned char *ptr;
-	int tail;
-	int zero = 0;
-	uint8_t zeros[4096];
-	int size;
-
-	memset(zeros, 0, sizeof(zeros));
-
-	if ((dfd = open(datafile, O_RDONLY|O_BINARY)) < 0) {
-		fprintf (stderr, "Can't open %s: %s\n",
-			datafile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
 
-	if (fstat(dfd, &sbuf) < 0) {
+	if (stat(datafile, &sbuf) < 0) {
 		fprintf (stderr, "Can't stat %s: %s\n",
 			datafile, strerror(errno));
 		exit (EXIT_FAILURE);
 	}
 
-	ptr = mmap(0, sbuf.st_size, PROT_READ, MAP_SHARED, dfd, 0);
-	if (ptr == MAP_FAILED) {
-		fprintf (stderr, "Can't read %s: %s\n",
-			datafile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
-
-	size = sbuf.st_size - datafile_offset;
-	lseek(ifd, offset, SEEK_SET);
-	if (write(ifd, ptr + datafile_offset, size) != size) {
-		fprintf (stderr, "Write error %s\n",
-			strerror(errno));
-		exit (EXIT_FAILURE);
-	}
-
-	tail = size % 4;
-	pad = pad - size;
-	if ((pad == 1) && (tail != 0)) {
-
-		if (write(ifd, (char *)&zero, 4-tail) != 4-tail) {
-			fprintf (stderr, "Write error on %s\n",
-				strerror(errno));
-			exit (EXIT_FAILURE);
-		}
-	} else if (pad > 1) {
-		while (pad > 0) {
-			int todo = sizeof(zeros);
-
-			if (todo > pad)
-				todo = pad;
-			if (write(ifd, (char *)&zeros, todo) != todo) {
-				fprintf(stderr, "Write error: %s\n",
-					strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-			pad -= todo;
-		}
-	}
-
-	(void) munmap((void *)ptr, sbuf.st_size);
-	(void) close (dfd);
+	layout_add_file(l, datafile, offset, datafile,
+			datafile_offset, sbuf.st_size - datafile_offset, flags);
 }
 
 enum imximage_fld_types {
@@ -398,10 +323,16 @@ static table_entry_t imximage_cmds[] = {
 	{-1,                    "",                     "",	          },
 };
 
-static uint32_t imximage_version;
-static struct dcd_v2_cmd *gd_last_cmd;
-static uint32_t imximage_ivt_offset = UNDEFINED;
-static uint32_t imximage_csf_size = UNDEFINED;
+/* State of the parse of a DCD cfg file, one per table parsed */
+typedef struct {
+	dcd_v2_t *dcd_v2;
+	struct dcd_v2_cmd *last_cmd;	/* command the next entry goes in */
+	int dcd_len;			/* entries so far */
+	uint32_t version;		/* IMAGE_VERSION */
+	uint32_t ivt_offset;		/* BOOT_OFFSET */
+	uint32_t csf_size;		/* CSF */
+	int cmd_ver_first;		/* IMAGE_VERSION came first, 0 when too late */
+} dcd_parse_t;
 
 int get_table_entry_id(const table_entry_t *table,
 		const char *table_name, const char *name)
@@ -431,15 +362,14 @@ static uint32_t get_cfg_value(char *token, char *name,  int linenr)
 	return value;
 }
 
-static void set_dcd_param_v2(dcd_v2_t *dcd_v2, uint32_t dcd_len,
-		int32_t cmd)
+static void set_dcd_param_v2(dcd_parse_t *ctx, int32_t cmd)
 {
-	struct dcd_v2_cmd *d = gd_last_cmd;
+	struct dcd_v2_cmd *d = ctx->last_cmd;
 	struct dcd_v2_cmd *d2;
 	int len;
 
 	if (!d)
-		d = &dcd_v2->dcd_cmd;
+		d = &ctx->dcd_v2->dcd_cmd;
 	d2 = d;
 	len = be16_to_cpu(d->write_dcd_command.length);
 	if (len > 4)
@@ -496,13 +426,14 @@ static void set_dcd_param_v2(dcd_v2_t *dcd_v2, uint32_t dcd_len,
 	default:
 		break;
 	}
-	gd_last_cmd = d;
+	ctx->last_cmd = d;
 }
 
-static void set_dcd_val_v2(dcd_v2_t *dcd_v2, char *name, int lineno,
-					int fld, uint32_t value, uint32_t off)
+static void set_dcd_val_v2(dcd_parse_t *ctx, char *name, int lineno,
+					int fld, uint32_t value)
 {
-	struct dcd_v2_cmd *d = gd_last_cmd;
+	struct dcd_v2_cmd *d = ctx->last_cmd;
+	uint32_t off;
 	int len;
 
 	len = be16_to_cpu(d->write_dcd_command.length);
@@ -523,10 +454,10 @@ static void set_dcd_val_v2(dcd_v2_t *dcd_v2, char *name, int lineno,
 	}
 }
 
-static uint32_t set_dcd_rst_v2(dcd_v2_t *dcd_v2, uint32_t dcd_len,
-						char *name, int lineno)
+static uint32_t set_dcd_rst_v2(dcd_parse_t *ctx, char *name, int lineno)
 {
-	struct dcd_v2_cmd *d = gd_last_cmd;
+	dcd_v2_t *dcd_v2 = ctx->dcd_v2;
+	struct dcd_v2_cmd *d = ctx->last_cmd;
 	int len;
 
 	if (!d)
@@ -544,27 +475,26 @@ static uint32_t set_dcd_rst_v2(dcd_v2_t *dcd_v2, uint32_t dcd_len,
 	return len;
 }
 
-static void parse_cfg_cmd(dcd_v2_t *dcd_v2, int32_t cmd, char *token,
-				char *name, int lineno, int fld, int dcd_len)
+static void parse_cfg_cmd(dcd_parse_t *ctx, int32_t cmd, char *token,
+				char *name, int lineno, int fld)
 {
 	int value;
-	static int cmd_ver_first = ~0;
 
 	switch (cmd) {
 	case CMD_IMAGE_VERSION:
-		imximage_version = get_cfg_value(token, name, lineno);
-		if (cmd_ver_first == 0) {
+		ctx->version = get_cfg_value(token, name, lineno);
+		if (ctx->cmd_ver_first == 0) {
 			fprintf(stderr, "Error: %s[%d] - IMAGE_VERSION "
 				"command need be the first before other "
 				"valid command in the file\n", name, lineno);
 			exit(EXIT_FAILURE);
 		}
-		cmd_ver_first = 1;
+		ctx->cmd_ver_first = 1;
 		break;
 	case CMD_BOOT_OFFSET:
-		imximage_ivt_offset = get_cfg_value(token, name, lineno);
-		if (cmd_ver_first != 1)
-			cmd_ver_first = 0;
+		ctx->ivt_offset = get_cfg_value(token, name, lineno);
+		if (ctx->cmd_ver_first != 1)
+			ctx->cmd_ver_first = 0;
 		break;
 	case CMD_WRITE_DATA:
 	case CMD_WRITE_CLR_BIT:
@@ -572,27 +502,27 @@ static void parse_cfg_cmd(dcd_v2_t *dcd_v2, int32_t cmd, char *token,
 	case CMD_CHECK_BITS_SET:
 	case CMD_CHECK_BITS_CLR:
 		value = get_cfg_value(token, name, lineno);
-		set_dcd_param_v2(dcd_v2, dcd_len, cmd);
-		set_dcd_val_v2(dcd_v2, name, lineno, fld, value, dcd_len); /*nothing to do for v2, because we are in CFG_REG_SIZE fld */
-		if (cmd_ver_first != 1)
-			cmd_ver_first = 0;
+		set_dcd_param_v2(ctx, cmd);
+		set_dcd_val_v2(ctx, name, lineno, fld, value); /*nothing to do for v2, because we are in CFG_REG_SIZE fld */
+		if (ctx->cmd_ver_first != 1)
+			ctx->cmd_ver_first = 0;
 		break;
 	case CMD_CSF:
-		if (imximage_version != 2) {
+		if (ctx->version != 2) {
 			fprintf(stderr,
 				"Error: %s[%d] - CSF only supported for VERSION 2(%s)\n",
 				name, lineno, token);
 			exit(EXIT_FAILURE);
 		}
-		imximage_csf_size = get_cfg_value(token, name, lineno);
-		if (cmd_ver_first != 1)
-			cmd_ver_first = 0;
+		ctx->csf_size = get_cfg_value(token, name, lineno);
+		if (ctx->cmd_ver_first != 1)
+			ctx->cmd_ver_first = 0;
 		break;
 	}
 }
 
-static void parse_cfg_fld(dcd_v2_t *dcd_v2, int32_t *cmd,
-		char *token, char *name, int lineno, int fld, int *dcd_len)
+static void parse_cfg_fld(dcd_parse_t *ctx, int32_t *cmd,
+		char *token, char *name, int lineno, int fld)
 {
 	int value;
 
@@ -607,7 +537,7 @@ static void parse_cfg_fld(dcd_v2_t *dcd_v2, int32_t *cmd,
 		}
 		break;
 	case CFG_REG_SIZE:
-		parse_cfg_cmd(dcd_v2, *cmd, token, name, lineno, fld, *dcd_len);
+		parse_cfg_cmd(ctx, *cmd, token, name, lineno, fld);
 		break;
 	case CFG_REG_ADDRESS:
 	case CFG_REG_VALUE:
@@ -618,13 +548,12 @@ static void parse_cfg_fld(dcd_v2_t *dcd_v2, int32_t *cmd,
 		case CMD_CHECK_BITS_SET:
 		case CMD_CHECK_BITS_CLR:
 			value = get_cfg_value(token, name, lineno);
-			set_dcd_param_v2(dcd_v2, *dcd_len, *cmd);
-			set_dcd_val_v2(dcd_v2, name, lineno, fld, value,
-					*dcd_len);
+			set_dcd_param_v2(ctx, *cmd);
+			set_dcd_val_v2(ctx, name, lineno, fld, value);
 
 			if (fld == CFG_REG_VALUE) {
-				(*dcd_len)++;
-				if (*dcd_len > MAX_HW_CFG_SIZE_V2) {
+				ctx->dcd_len++;
+				if (ctx->dcd_len > MAX_HW_CFG_SIZE_V2) {
 					fprintf(stderr, "Error: %s[%d] -"
 						"DCD table exceeds maximum size(%d)\n",
 						name, lineno, MAX_HW_CFG_SIZE_V2);
@@ -650,9 +579,15 @@ static uint32_t parse_cfg_file(dcd_v2_t *dcd_v2, char *name)
 	int lineno = 0;
 	int fld;
 	size_t len;
-	int dcd_len = 0, dcd_size = 0;
+	dcd_parse_t ctx = { 0 };
+	int dcd_size = 0;
 	int32_t cmd;
 
+	ctx.dcd_v2 = dcd_v2;
+	ctx.ivt_offset = UNDEFINED;
+	ctx.csf_size = UNDEFINED;
+	ctx.cmd_ver_first = ~0;
+
 	fd = fopen(name, "r");
 	if (fd == 0) {
 		fprintf(stderr, "Error: %s - Can't open DCD file\n", name);
@@ -681,13 +616,13 @@ static uint32_t parse_cfg_file(dcd_v2_t *dcd_v2, char *name)
 			if (token[0] == '#')
 				break;
 
-			parse_cfg_fld(dcd_v2, &cmd, token, name,
-					lineno, fld, &dcd_len);
+			parse_cfg_fld(&ctx, &cmd, token, name,
+					lineno, fld);
 		}
 
 	}
 
-	dcd_size = set_dcd_rst_v2(dcd_v2, dcd_len, name, lineno);
+	dcd_size = set_dcd_rst_v2(&ctx, name, lineno);
 	fclose(fd);
 
 	return dcd_size;
@@ -737,6 +672,8 @@ void set_uimage_header(uimage_header_t * uimage_hd_ptr, int fd, uint32_t ep)
 	time_t time;
 	struct stat sbuf;
 	void *file_ptr;
+	char *source_date, *end;
+	unsigned long long epoch;
 
 	if (fstat(fd, &sbuf) < 0) {
 		fprintf(stderr, "set_uimage_header error: %s\n",
@@ -744,7 +681,19 @@ void set_uimage_header(uimage_header_t * uimage_hd_ptr, int fd, uint32_t ep)
 		exit(EXIT_FAILURE);
 	}
 
-	time = sbuf.st_mtime;
+	/* a reproducible build sets the timestamp, the mtime moves with a checkout */
+	source_date = getenv("SOURCE_DATE_EPOCH");
+	if (source_date && *source_date) {
+		errno = 0;
+		epoch = strtoull(source_date, &end, 10);
+		if (errno || *end || epoch > UINT32_MAX) {
+			fprintf(stderr, "Invalid SOURCE_DATE_EPOCH: %s\n", source_date);
+			exit(EXIT_FAILURE);
+		}
+		time = epoch;
+	} else {
+		time = sbuf.st_mtime;
+	}
 
 	file_ptr = mmap(0, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
 	if (file_ptr == MAP_FAILED) {
@@ -782,9 +731,7 @@ void generate_sld_with_ivt(char * input_file, uint32_t ep, char *out_file)
 	void *file_ptr;
 	int ivt_fd, input_fd;
 	int aligned_size;
-
-	int i;
-	char pad = 0;
+	int pad;
 
 	input_fd = open(input_file, O_RDONLY | O_BINARY);
 	if (input_fd < 0) {
@@ -819,15 +766,14 @@ void generate_sld_with_ivt(char * input_file, uint32_t ep, char *out_file)
 	}
 
 	aligned_size = (sbuf.st_size + sizeof(uimage_header_t) + IVT_ALIGN - 1) & ~(IVT_ALIGN - 1);
-	i = sbuf.st_size + sizeof(uimage_header_t);
+	pad = aligned_size - (sbuf.st_size + sizeof(uimage_header_t));
 
-	for (; i < aligned_size; i++) {
-		if (write(ivt_fd, (char *) &pad, 1) != 1) {
-			fprintf(stderr,
-					"Pad error on sld-ivt image\n");
-			exit(EXIT_FAILURE);
-		}
+	if (write_zeros(ivt_fd, sbuf.st_size, pad, 0) < 0) {
+		fprintf(stderr,
+				"Pad error on sld-ivt image\n");
+		exit(EXIT_FAILURE);
 	}
+	lseek(ivt_fd, sbuf.st_size + pad, SEEK_SET);
 
 	flash_header_v2_t ivt_header = { { 0xd1, 0x2000, 0x40 },
 		ep, 0, 0, 0,
@@ -844,15 +790,25 @@ void generate_sld_with_ivt(char * input_file, uint32_t ep, char *out_file)
 	close(input_fd);
 }
 
-/* Return this IVT offset in the final output file */
-int generate_ivt_for_fit(int fd, int fit_offset, uint32_t ep, uint32_t *fit_load_addr)
+/*
+ * Fill the IVT placed after the FIT image, it is read from the FIT file
+ * itself. Return this IVT offset in the final output file.
+ */
+int generate_ivt_for_fit(const char *fit_file, int fit_offset, uint32_t ep,
+		uint32_t *fit_load_addr, flash_header_v2_t *ivt_header)
 {
 	uimage_header_t image_header;
 
 	uint32_t fit_size, load_addr;
 	int align_len = 64 - 1; /* 64 is cacheline size */
+	int fd;
 
-	lseek(fd, fit_offset, SEEK_SET);
+	fd = open(fit_file, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: Can't open: %s\n",
+			fit_file, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
 
 	if (read(fd, (char *)&image_header, sizeof(uimage_header_t)) != sizeof(uimage_header_t)) {
 		fprintf (stderr, "generate_ivt_for_fit read failed: %s\n",
@@ -860,6 +816,8 @@ int generate_ivt_for_fit(int fd, int fit_offset, uint32_t ep, uint32_t *fit_load
 		exit (EXIT_FAILURE);
 	}
 
+	close(fd);
+
 	if (be32_to_cpu(image_header.ih_magic) != FDT_MAGIC){
 		fprintf (stderr, "generate_ivt_for_fit error: not a FIT file\n");
 		exit (EXIT_FAILURE);
@@ -872,23 +830,17 @@ int generate_ivt_for_fit(int fd, int fit_offset, uint32_t ep, uint32_t *fit_load
 
 	fit_size = ALIGN(fit_size, ALIGN_SIZE);
 
-	lseek(fd, fit_offset + fit_size, SEEK_SET);
-
 	/* ep is the u-boot entry. SPL loads the FIT before the u-boot address. 0x2000 is for CSF_SIZE */
 	load_addr = (ep - (fit_size + CSF_SIZE) - 512 -
 			align_len) & ~align_len;
 
-	flash_header_v2_t ivt_header = { { 0xd1, 0x2000, 0x40 },
+	flash_header_v2_t ivt = { { 0xd1, 0x2000, 0x40 },
 		load_addr, 0, 0, 0,
 		(load_addr + fit_size),
 		(load_addr + fit_size + 0x20),
 		0 };
 
-	if (write(fd, &ivt_header, sizeof(flash_header_v2_t)) != sizeof(flash_header_v2_t)) {
-		fprintf(stderr, "IVT writing error on fit image\n");
-		exit(EXIT_FAILURE);
-	}
-
+	*ivt_header = ivt;
 	*fit_load_addr = load_addr;
 
 	return fit_offset + fit_size;
@@ -912,6 +864,8 @@ int main(int argc, char **argv)
 	int using_fit = 0;
 	dcd_v2_t dcd_table;
 	uimage_header_t uimage_hdr;
+	flash_header_v2_t fit_ivt;
+	layout_t layout;
 
 	static struct option long_options[] =
 	{
@@ -927,6 +881,8 @@ int main(int argc, char **argv)
 		{"dev", required_argument, NULL, 'e'},
 		{"csf", required_argument, NULL, 'c'},
 		{"second_loader", required_argument, NULL, 'u'},
+		{"dump-layout", no_argument, NULL, 'L'},
+		{"out-offset", required_argument, NULL, 'S'},
 		{NULL, 0, NULL, 0}
 	};
 
@@ -1025,6 +981,13 @@ int main(int argc, char **argv)
 					exit(1);
 				}
 				break;
+			case 'L':
+				layout_dump_enabled = 1;
+				break;
+			case 'S':
+				fprintf(stderr, "Output offset:\t%s\n", optarg);
+				output_offset = (off_t) strtoll(optarg, NULL, 0);
+				break;
 			case 'u':
 				fprintf(stderr, "SECOND LOADER IMAGE:\t%s", optarg);
 				sld_img = optarg;
@@ -1396,20 +1359,14 @@ int main(int argc, char **argv)
 	}
 
 
-	/* Open output file */
-	ofd = open (ofname, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0666);
-	if (ofd < 0) {
-		fprintf(stderr, "%s: Can't open: %s\n",
-                                ofname, strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+	/* Plan the output, nothing is written before the whole layout is known */
+	layout_init(&layout);
 
 	if(signed_hdmi) {
 		header_hdmi_off -= ivt_offset;
-		lseek(ofd, header_hdmi_off, SEEK_SET);
 
 		/* The signed HDMI FW has 0x400 IVT offset, need remove it */
-		copy_file(ofd, signed_hdmi, 0, header_hdmi_off, 0x400);
+		plan_file(&layout, signed_hdmi, header_hdmi_off, 0x400, 0);
 	}
 
 	if(!signed_hdmi && hdmi_img) {
@@ -1417,26 +1374,16 @@ int main(int argc, char **argv)
 		hdmi_off -= ivt_offset;
 		header_hdmi_2_off -= ivt_offset;
 
-		lseek(ofd, header_hdmi_off, SEEK_SET);
-
-		/* Write image header */
-		if (write(ofd, &imx_header[HDMI_IVT_ID], sizeof(imx_header_v2_t)) != sizeof(imx_header_v2_t)) {
-			fprintf(stderr, "error writing image hdr\n");
-			exit(1);
-		};
-
-		copy_file(ofd, hdmi_img, 0, hdmi_off, 0);
-
-		lseek(ofd, header_hdmi_2_off, SEEK_SET);
-
-		if (write(ofd, &imx_header[HDMI_IVT_ID], sizeof(imx_header_v2_t)) != sizeof(imx_header_v2_t)) {
-			fprintf(stderr, "error writing image hdr\n");
-			exit(1);
-		}
+		/* The HDMI image header is stored twice */
+		layout_add_mem(&layout, "hdmi header", header_hdmi_off,
+				&imx_header[HDMI_IVT_ID], sizeof(imx_header_v2_t), 0);
+		plan_file(&layout, hdmi_img, hdmi_off, 0, 0);
+		layout_add_mem(&layout, "hdmi header", header_hdmi_2_off,
+				&imx_header[HDMI_IVT_ID], sizeof(imx_header_v2_t), 0);
 
 		if (csf_hdmi_img) {
 			csf_hdmi_off -= ivt_offset;
-			copy_file(ofd, csf_hdmi_img, 0, csf_hdmi_off, 0);
+			plan_file(&layout, csf_hdmi_img, csf_hdmi_off, 0, 0);
 		}
 	}
 
@@ -1444,77 +1391,74 @@ int main(int argc, char **argv)
 		header_plugin_off -= ivt_offset;
 		plugin_off -= ivt_offset;
 
-		lseek(ofd, header_plugin_off, SEEK_SET);
-
-		/* Write image header */
-		if (write(ofd, &imx_header[PLUGIN_IVT_ID], sizeof(imx_header_v2_t)) != sizeof(imx_header_v2_t)) {
-			fprintf(stderr, "error writing image hdr\n");
-			exit(1);
-		}
-
-		copy_file(ofd, plugin_img, 0, plugin_off, 0);
+		layout_add_mem(&layout, "plugin header", header_plugin_off,
+				&imx_header[PLUGIN_IVT_ID], sizeof(imx_header_v2_t), 0);
+		plan_file(&layout, plugin_img, plugin_off, 0, 0);
 
 		if (csf_plugin_img) {
 			csf_plugin_off -= ivt_offset;
-			copy_file(ofd, csf_plugin_img, 0, csf_plugin_off, 0);
+			plan_file(&layout, csf_plugin_img, csf_plugin_off, 0, 0);
 		}
 	}
 
 	/* Main Image */
 	header_image_off -= ivt_offset;
 	image_off -= ivt_offset;
-	lseek(ofd, header_image_off, SEEK_SET);
-
-	/* Write image header */
-	if (write(ofd, &imx_header[IMAGE_IVT_ID], sizeof(imx_header_v2_t)) != sizeof(imx_header_v2_t)) {
-		fprintf(stderr, "error writing image hdr\n");
-		exit(1);
-	}
+	layout_add_mem(&layout, "image header", header_image_off,
+			&imx_header[IMAGE_IVT_ID], sizeof(imx_header_v2_t), 0);
 
 	if (dcd_size) {
 		dcd_off -= ivt_offset;
-		lseek(ofd, dcd_off, SEEK_SET);
-
-		if (write(ofd, &dcd_table, dcd_size) != dcd_size) {
-			fprintf(stderr, "error writing dcd\n");
-			exit(1);
-		}
+		layout_add_mem(&layout, "dcd", dcd_off, &dcd_table, dcd_size, 0);
 	}
 
-	copy_file(ofd, ap_img, 0, image_off, 0);
+	plan_file(&layout, ap_img, image_off, 0, 0);
 
 	if (csf_img) {
 		csf_off -= ivt_offset;
-		copy_file(ofd, csf_img, 0, csf_off, 0);
+		plan_file(&layout, csf_img, csf_off, 0, 0);
 	} else {
 		csf_off -= ivt_offset;
-		fill_zero(ofd, CSF_SIZE, csf_off);
+		layout_add_zero(&layout, "csf", csf_off, CSF_SIZE, LAYOUT_WEAK);
 	}
 
 	if (sld_img) {
 		sld_header_off -= ivt_offset;
-		lseek(ofd, sld_header_off, SEEK_SET);
 
-		/* Write image header */
 		if (!using_fit) {
-			/* Write image header */
-			if (write(ofd, &uimage_hdr, sizeof(uimage_header_t)) != sizeof(uimage_header_t)) {
-				fprintf(stderr, "error writing uimage hdr\n");
-				exit(1);
-			}
-
-			copy_file(ofd, sld_img, 0, sld_header_off + sizeof(uimage_header_t), 0);
-			fill_zero(ofd, CSF_SIZE - sizeof(flash_header_v2_t), sld_csf_off);
+			layout_add_mem(&layout, "uimage header", sld_header_off,
+					&uimage_hdr, sizeof(uimage_header_t), 0);
+			plan_file(&layout, sld_img, sld_header_off + sizeof(uimage_header_t), 0, 0);
+			layout_add_zero(&layout, "sld csf", sld_csf_off,
+					CSF_SIZE - sizeof(flash_header_v2_t), LAYOUT_WEAK);
 			sld_csf_off -= ivt_offset;
 			sld_load_addr = sld_start_addr - (uint32_t)sizeof(uimage_header_t);
 		} else {
-			copy_file(ofd, sld_img, 0, sld_header_off, 0);
-			sld_csf_off = generate_ivt_for_fit(ofd, sld_header_off, sld_start_addr, &sld_load_addr) + 0x20;
+			plan_file(&layout, sld_img, sld_header_off, 0, 0);
+			sld_csf_off = generate_ivt_for_fit(sld_img, sld_header_off, sld_start_addr,
+					&sld_load_addr, &fit_ivt);
+			/* the IVT may land in the padding at the end of the FIT file */
+			layout_add_mem(&layout, "fit ivt", sld_csf_off,
+					&fit_ivt, sizeof(flash_header_v2_t), LAYOUT_OVER);
+			sld_csf_off += 0x20;
 		}
 	}
 
+	layout_check(&layout);
+
+	/* Open output file */
+	ofd = output_open(ofname);
+	if (ofd < 0) {
+		fprintf(stderr, "%s: Can't open: %s\n",
+                                ofname, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	layout_emit(&layout, ofd);
+	layout_free(&layout);
+
 	/* Close output file */
-	close(ofd);
+	output_close(ofd, ofname, sector_size);
 
 	if (!signed_hdmi)
 		dump_header_v2(imx_header, 0);
@@ -38,10 +38,10 @@ endif
 
 FW_DIR = imx-boot/imx-boot-tools/$(PLAT)
 
-$(MKIMG): mkimage_imx8.c
+$(MKIMG): mkimage_imx8.c ../src/fileio.c ../src/fileio.h ../src/layout.c ../src/layout.h ../src/uring.c ../src/output.c ../src/fail.c
 	@echo "PLAT="$(PLAT) "HDMI="$(HDMI)
 	@echo "Compiling mkimage_imx8"
-	$(CC) $(CFLAGS) mkimage_imx8.c -o $(MKIMG) -lz
+	$(CC) $(CFLAGS) -D_FILE_OFFSET_BITS=64 mkimage_imx8.c ../src/fileio.c ../src/layout.c ../src/uring.c ../src/output.c ../src/fail.c -I ../src -o $(MKIMG) -lz -lpthread
 
 u-boot-spl-ddr.bin: u-boot-spl.bin lpddr4_pmu_train_1d_imem.bin lpddr4_pmu_train_1d_dmem.bin lpddr4_pmu_train_2d_imem.bin lpddr4_pmu_train_2d_dmem.bin
 	@objcopy -I binary -O binary --pad-to 0x8000 --gap-fill=0x0 lpddr4_pmu_train_1d_imem.bin lpddr4_pmu_train_1d_imem_pad.bin
@@ -7,6 +7,9 @@
 #
 ####################################################################
 
+# mkimage_imx8 -expand-regmap does the same, with any number of instances:
+# ../mkimage_imx8 -expand-regmap ../../imx-sc-firmware/firmware/platform/board/mx8qm_val/ddrc/ddrc_mem_map.h -out ddrc_mem_map.h
+#
 # usage:
 # cat ../../imx-sc-firmware/firmware/platform/board/mx8qm_val/ddrc/ddrc_mem_map.h | ./expand_c_define.sh  > ddrc_mem_map.h
 # cat ../../imx-sc-firmware/firmware/platform/board/mx8qm_val/ddrc/ddr_phy_mem_map.h | ./expand_c_define.sh  > ddr_phy_mem_map.h
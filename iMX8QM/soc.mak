@@ -31,17 +31,28 @@ endif
 QSPI_HEADER = ../scripts/fspi_header
 QSPI_PACKER = ../scripts/fspi_packer.sh
 
-$(DCD_CFG): FORCE
+DCD_FLAGS = -D DDR_TRAIN_IN_DCD=$(DDR_TRAIN) -I include -I $(INCLUDE)
+DCD_PREPROCESS = ./$(MKIMG) -dcd-preprocess $< $(DCD_FLAGS) -dcd-dep .$@.d -out $@
+
+# The cfg files are only preprocessed again when they, a header they
+# include or DCD_FLAGS change, mkimage_imx8 writes the dependencies.
+# The tool must be built first, a newer one does not make them again.
+.dcd_flags: FORCE
+	@echo '$(DCD_FLAGS)' | cmp -s - $@ || echo '$(DCD_FLAGS)' > $@
+
+$(DCD_CFG): $(DCD_CFG_SRC) .dcd_flags | $(MKIMG)
 	@echo "Converting iMX8 DCD 1.6GHz file"
-	$(CC) -E -Wp,-MD,.imx8qm_dcd.cfg.cfgtmp.d  -nostdinc -Iinclude -I$(INCLUDE) -DDDR_TRAIN_IN_DCD=$(DDR_TRAIN) -x c -o $(DCD_CFG) $(DCD_CFG_SRC)
+	$(DCD_PREPROCESS)
 
-$(DCD_800_CFG): FORCE
+$(DCD_800_CFG): $(DCD_800_CFG_SRC) .dcd_flags | $(MKIMG)
 	@echo "Converting iMX8 DCD 800MHz file"
-	$(CC) -E -Wp,-MD,.imx8qm_dcd_800.cfg.cfgtmp.d  -nostdinc -Iinclude -I$(INCLUDE) -DDDR_TRAIN_IN_DCD=$(DDR_TRAIN) -x c -o $(DCD_800_CFG) $(DCD_800_CFG_SRC)
+	$(DCD_PREPROCESS)
 
-$(DCD_1200_CFG): FORCE
+$(DCD_1200_CFG): $(DCD_1200_CFG_SRC) .dcd_flags | $(MKIMG)
 	@echo "Converting iMX8 DCD 1200MHz file"
-	$(CC) -E -Wp,-MD,.imx8qm_dcd_1200.cfg.cfgtmp.d  -nostdinc -Iinclude -I$(INCLUDE) -DDDR_TRAIN_IN_DCD=$(DDR_TRAIN) -x c -o $(DCD_1200_CFG) $(DCD_1200_CFG_SRC)
+	$(DCD_PREPROCESS)
+
+-include $(wildcard .*.cfg.tmp.d)
 
 FORCE:
 
@@ -59,7 +70,7 @@ u-boot-atf.bin: u-boot.bin bl31.bin
 
 .PHONY: clean
 clean:
-	@rm -f $(DCD_CFG) .imx8_dcd.cfg.cfgtmp.d $(DCD_800_CFG) $(DCD_1200_CFG) .imx8qm_dcd_800.cfg.cfgtmp.d .imx8qm_dcd.cfg.cfgtmp.d .imx8qm_dcd_1200.cfg.cfgtmp.d head.hash u-boot-hash.bin u-boot-atf-hdmi.bin hdmitxfw-pad.bin hdmirxfw-pad.bin
+	@rm -f $(DCD_CFG) $(DCD_800_CFG) $(DCD_1200_CFG) .*.cfg.tmp.d .dcd_flags head.hash u-boot-hash.bin u-boot-atf-hdmi.bin hdmitxfw-pad.bin hdmirxfw-pad.bin
 
 flash_scfw: $(MKIMG) scfw_tcm.bin
 	./$(MKIMG) -soc QM -c -scfw scfw_tcm.bin -out flash.bin
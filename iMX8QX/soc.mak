@@ -44,12 +44,33 @@ else
     RENAME = rename
 endif
 
-$(DCD_CFG): FORCE
+DCD_FLAGS = -D DDR_TRAIN_IN_DCD=$(DDR_TRAIN) -I include -I $(INCLUDE)
+DCD_PREPROCESS = ./$(MKIMG) -dcd-preprocess $< $(DCD_FLAGS) -dcd-dep .$@.d -out $@
+
+# The cfg files are only preprocessed again when they, a header they
+# include or DCD_FLAGS change, mkimage_imx8 writes the dependencies.
+# The tool must be built first, a newer one does not make them again.
+.dcd_flags: FORCE
+	@echo '$(DCD_FLAGS)' | cmp -s - $@ || echo '$(DCD_FLAGS)' > $@
+
+$(DCD_CFG): $(DCD_CFG_SRC) .dcd_flags | $(MKIMG)
 	@echo "Converting iMX8 DCD file"
-	$(CC) -E -Wp,-MD,.imx8qx_dcd.cfg.cfgtmp.d  -nostdinc -Iinclude -I$(INCLUDE) -DDDR_TRAIN_IN_DCD=$(DDR_TRAIN) -x c -o $(DCD_CFG) $(DCD_CFG_SRC)
-	$(CC) -E -Wp,-MD,.imx8qx_dcd.cfg.cfgtmp.d  -nostdinc -Iinclude -I$(INCLUDE) -DDDR_TRAIN_IN_DCD=$(DDR_TRAIN) -x c -o $(DCD_16BIT_CFG) $(DCD_CFG_16BIT_SRC)
-	$(CC) -E -Wp,-MD,.imx8qx_dcd.cfg.cfgtmp.d  -nostdinc -Iinclude -I$(INCLUDE) -DDDR_TRAIN_IN_DCD=$(DDR_TRAIN) -x c -o $(DCD_DDR3_CFG) $(DCD_CFG_DDR3_SRC)
-	$(CC) -E -Wp,-MD,.imx8dx_dcd.cfg.cfgtmp.d  -nostdinc -Iinclude -I$(INCLUDE) -DDDR_TRAIN_IN_DCD=$(DDR_TRAIN) -x c -o $(DCD_DX_DDR3_CFG) $(DCD_CFG_DX_DDR3_SRC)
+	$(DCD_PREPROCESS)
+
+$(DCD_16BIT_CFG): $(DCD_CFG_16BIT_SRC) .dcd_flags | $(MKIMG)
+	@echo "Converting iMX8 DCD 16bit file"
+	$(DCD_PREPROCESS)
+
+$(DCD_DDR3_CFG): $(DCD_CFG_DDR3_SRC) .dcd_flags | $(MKIMG)
+	@echo "Converting iMX8 DCD DDR3 file"
+	$(DCD_PREPROCESS)
+
+$(DCD_DX_DDR3_CFG): $(DCD_CFG_DX_DDR3_SRC) .dcd_flags | $(MKIMG)
+	@echo "Converting iMX8DX DCD DDR3 file"
+	$(DCD_PREPROCESS)
+
+-include $(wildcard .*.cfg.tmp.d)
+
 FORCE:
 
 u-boot-atf.bin: u-boot.bin bl31.bin
@@ -65,7 +86,7 @@ Image1: Image
 
 .PHONY: clean nightly
 clean:
-	@rm -f $(MKIMG) $(DCD_CFG) .imx8qx_dcd.cfg.cfgtmp.d Image0 Image1
+	@rm -f $(MKIMG) $(DCD_CFG) $(DCD_16BIT_CFG) $(DCD_DDR3_CFG) $(DCD_DX_DDR3_CFG) .*.cfg.tmp.d .dcd_flags Image0 Image1
 
 flash_cm4 flash_b0_cm4: $(MKIMG) mx8qx-ahab-container.img scfw_tcm.bin m4_image.bin
 	./$(MKIMG) -soc QX -rev B0 -append mx8qx-ahab-container.img -c -scfw scfw_tcm.bin -m4 m4_image.bin 0 0x34FE0000 -out flash.bin
@@ -85,13 +106,13 @@ flash_scfw_a0: $(MKIMG) scfw_tcm.bin
 flash_dcd_a0: $(MKIMG) $(DCD_CFG) scfw_tcm.bin u-boot-atf.bin
 	./$(MKIMG) -soc QX -c -dcd $(DCD_CFG) -scfw scfw_tcm.bin -c -ap u-boot-atf.bin a35 0x80000000 -out flash.bin
 
-flash_16bit_dcd_a0: $(MKIMG) $(DCD_CFG) scfw_tcm.bin u-boot-atf.bin
+flash_16bit_dcd_a0: $(MKIMG) $(DCD_16BIT_CFG) scfw_tcm.bin u-boot-atf.bin
 	./$(MKIMG) -soc QX -c -dcd $(DCD_16BIT_CFG) -scfw scfw_tcm.bin -c -ap u-boot-atf.bin a35 0x80000000 -out flash.bin
 
-flash_ddr3_dcd_a0: $(MKIMG) $(DCD_CFG) scfw_tcm.bin u-boot-atf.bin
+flash_ddr3_dcd_a0: $(MKIMG) $(DCD_DDR3_CFG) scfw_tcm.bin u-boot-atf.bin
 	./$(MKIMG) -soc QX -c -dcd $(DCD_DDR3_CFG) -scfw scfw_tcm.bin -c -ap u-boot-atf.bin a35 0x80000000 -out flash.bin
 
-flash_dx_ddr3_dcd_a0: $(MKIMG) $(DCD_CFG) scfw_tcm.bin u-boot-atf.bin
+flash_dx_ddr3_dcd_a0: $(MKIMG) $(DCD_DX_DDR3_CFG) scfw_tcm.bin u-boot-atf.bin
 	./$(MKIMG) -soc QX -c -dcd $(DCD_DX_DDR3_CFG) -scfw scfw_tcm.bin -c -ap u-boot-atf.bin a35 0x80000000 -out flash.bin
 
 flash_a0: $(MKIMG) scfw_tcm.bin u-boot-atf.bin
@@ -297,10 +297,16 @@ static table_entry_t imximage_cmds[] = {
 	{-1,                    "",                     "",	          },
 };
 
-static uint32_t imximage_version;
-static struct dcd_v2_cmd *gd_last_cmd;
-static uint32_t imximage_ivt_offset = UNDEFINED;
-static uint32_t imximage_csf_size = UNDEFINED;
+/* State of the parse of a DCD cfg file, one per table parsed */
+typedef struct {
+	dcd_v2_t *dcd_v2;
+	struct dcd_v2_cmd *last_cmd;	/* command the next entry goes in */
+	int dcd_len;			/* entries so far */
+	uint32_t version;		/* IMAGE_VERSION */
+	uint32_t ivt_offset;		/* BOOT_OFFSET */
+	uint32_t csf_size;		/* CSF */
+	int cmd_ver_first;		/* IMAGE_VERSION came first, 0 when too late */
+} dcd_parse_t;
 
 int get_table_entry_id(const table_entry_t *table,
 		const char *table_name, const char *name)
@@ -355,16 +361,14 @@ static void set_imx_hdr_v3(imx_header_v3_t *imxhdr, uint32_t dcd_len,
 	fhdr_v3->csf = 0;
 }
 
-static void set_dcd_param_v2(imx_header_v3_t *imxhdr, uint32_t dcd_len,
-		int32_t cmd)
+static void set_dcd_param_v2(dcd_parse_t *ctx, int32_t cmd)
 {
-	dcd_v2_t *dcd_v2 = &imxhdr->dcd_table;
-	struct dcd_v2_cmd *d = gd_last_cmd;
+	struct dcd_v2_cmd *d = ctx->last_cmd;
 	struct dcd_v2_cmd *d2;
 	int len;
 
 	if (!d)
-		d = &dcd_v2->dcd_cmd;
+		d = &ctx->dcd_v2->dcd_cmd;
 	d2 = d;
 	len = be16_to_cpu(d->write_dcd_command.length);
 	if (len > 4)
@@ -407,13 +411,14 @@ static void set_dcd_param_v2(imx_header_v3_t *imxhdr, uint32_t dcd_len,
 	default:
 		break;
 	}
-	gd_last_cmd = d;
+	ctx->last_cmd = d;
 }
 
-static void set_dcd_val_v2(imx_header_v3_t *imxhdr, char *name, int lineno,
-					int fld, uint32_t value, uint32_t off)
+static void set_dcd_val_v2(dcd_parse_t *ctx, char *name, int lineno,
+					int fld, uint32_t value)
 {
-	struct dcd_v2_cmd *d = gd_last_cmd;
+	struct dcd_v2_cmd *d = ctx->last_cmd;
+	uint32_t off;
 	int len;
 
 	len = be16_to_cpu(d->write_dcd_command.length);
@@ -434,11 +439,10 @@ static void set_dcd_val_v2(imx_header_v3_t *imxhdr, char *name, int lineno,
 	}
 }
 
-static void set_dcd_rst_v2(imx_header_v3_t *imxhdr, uint32_t dcd_len,
-						char *name, int lineno)
+static void set_dcd_rst_v2(dcd_parse_t *ctx, char *name, int lineno)
 {
-	dcd_v2_t *dcd_v2 = &imxhdr->dcd_table;
-	struct dcd_v2_cmd *d = gd_last_cmd;
+	dcd_v2_t *dcd_v2 = ctx->dcd_v2;
+	struct dcd_v2_cmd *d = ctx->last_cmd;
 	int len;
 
 	if (!d)
@@ -454,54 +458,53 @@ static void set_dcd_rst_v2(imx_header_v3_t *imxhdr, uint32_t dcd_len,
 	dcd_v2->header.version = DCD_VERSION;
 }
 
-static void parse_cfg_cmd(imx_header_v3_t *imxhdr, int32_t cmd, char *token,
-				char *name, int lineno, int fld, int dcd_len)
+static void parse_cfg_cmd(dcd_parse_t *ctx, int32_t cmd, char *token,
+				char *name, int lineno, int fld)
 {
 	int value;
-	static int cmd_ver_first = ~0;
 
 	switch (cmd) {
 	case CMD_IMAGE_VERSION:
-		imximage_version = get_cfg_value(token, name, lineno);
-		if (cmd_ver_first == 0) {
+		ctx->version = get_cfg_value(token, name, lineno);
+		if (ctx->cmd_ver_first == 0) {
 			fprintf(stderr, "Error: %s[%d] - IMAGE_VERSION "
 				"command need be the first before other "
 				"valid command in the file\n", name, lineno);
 			exit(EXIT_FAILURE);
 		}
-		cmd_ver_first = 1;
+		ctx->cmd_ver_first = 1;
 		break;
 	case CMD_BOOT_OFFSET:
-		imximage_ivt_offset = get_cfg_value(token, name, lineno);
-		if (cmd_ver_first != 1)
-			cmd_ver_first = 0;
+		ctx->ivt_offset = get_cfg_value(token, name, lineno);
+		if (ctx->cmd_ver_first != 1)
+			ctx->cmd_ver_first = 0;
 		break;
 	case CMD_WRITE_DATA:
 	case CMD_WRITE_CLR_BIT:
 	case CMD_CHECK_BITS_SET:
 	case CMD_CHECK_BITS_CLR:
 		value = get_cfg_value(token, name, lineno);
-		set_dcd_param_v2(imxhdr, dcd_len, cmd);
-		set_dcd_val_v2(imxhdr, name, lineno, fld, value, dcd_len);
-		if (cmd_ver_first != 1)
-			cmd_ver_first = 0;
+		set_dcd_param_v2(ctx, cmd);
+		set_dcd_val_v2(ctx, name, lineno, fld, value);
+		if (ctx->cmd_ver_first != 1)
+			ctx->cmd_ver_first = 0;
 		break;
 	case CMD_CSF:
-		if (imximage_version != 2) {
+		if (ctx->version != 2) {
 			fprintf(stderr,
 				"Error: %s[%d] - CSF only supported for VERSION 2(%s)\n",
 				name, lineno, token);
 			exit(EXIT_FAILURE);
 		}
-		imximage_csf_size = get_cfg_value(token, name, lineno);
-		if (cmd_ver_first != 1)
-			cmd_ver_first = 0;
+		ctx->csf_size = get_cfg_value(token, name, lineno);
+		if (ctx->cmd_ver_first != 1)
+			ctx->cmd_ver_first = 0;
 		break;
 	}
 }
 
-static void parse_cfg_fld(imx_header_v3_t *imxhdr, int32_t *cmd,
-		char *token, char *name, int lineno, int fld, int *dcd_len)
+static void parse_cfg_fld(dcd_parse_t *ctx, int32_t *cmd,
+		char *token, char *name, int lineno, int fld)
 {
 	int value;
 
@@ -516,7 +519,7 @@ static void parse_cfg_fld(imx_header_v3_t *imxhdr, int32_t *cmd,
 		}
 		break;
 	case CFG_REG_SIZE:
-		parse_cfg_cmd(imxhdr, *cmd, token, name, lineno, fld, *dcd_len);
+		parse_cfg_cmd(ctx, *cmd, token, name, lineno, fld);
 		break;
 	case CFG_REG_ADDRESS:
 	case CFG_REG_VALUE:
@@ -527,13 +530,12 @@ static void parse_cfg_fld(imx_header_v3_t *imxhdr, int32_t *cmd,
 		case CMD_CHECK_BITS_CLR:
 
 			value = get_cfg_value(token, name, lineno);
-			set_dcd_param_v2(imxhdr, *dcd_len, *cmd);
-			set_dcd_val_v2(imxhdr, name, lineno, fld, value,
-					*dcd_len);
+			set_dcd_param_v2(ctx, *cmd);
+			set_dcd_val_v2(ctx, name, lineno, fld, value);
 
 			if (fld == CFG_REG_VALUE) {
-				(*dcd_len)++;
-				if (*dcd_len > MAX_HW_CFG_SIZE_V2) {
+				ctx->dcd_len++;
+				if (ctx->dcd_len > MAX_HW_CFG_SIZE_V2) {
 					fprintf(stderr, "Error: %s[%d] -"
 						"DCD table exceeds maximum size(%d)\n",
 						name, lineno, MAX_HW_CFG_SIZE_V2);
@@ -558,9 +560,14 @@ static uint32_t parse_cfg_file(imx_header_v3_t *imxhdr, char *name)
 	int lineno = 0;
 	int fld;
 	size_t len;
-	int dcd_len = 0;
+	dcd_parse_t ctx = { 0 };
 	int32_t cmd;
 
+	ctx.dcd_v2 = &imxhdr->dcd_table;
+	ctx.ivt_offset = UNDEFINED;
+	ctx.csf_size = UNDEFINED;
+	ctx.cmd_ver_first = ~0;
+
 	fd = fopen(name, "r");
 	if (fd == 0) {
 		fprintf(stderr, "Error: %s - Can't open DCD file\n", name);
@@ -589,21 +596,21 @@ static uint32_t parse_cfg_file(imx_header_v3_t *imxhdr, char *name)
 			if (token[0] == '#')
 				break;
 
-			parse_cfg_fld(imxhdr, &cmd, token, name,
-					lineno, fld, &dcd_len);
+			parse_cfg_fld(&ctx, &cmd, token, name,
+					lineno, fld);
 		}
 
 	}
 
-	set_dcd_rst_v2(imxhdr, dcd_len, name, lineno);
+	set_dcd_rst_v2(&ctx, name, lineno);
 	fclose(fd);
 
 	/* Exit if there is no BOOT_FROM field specifying the flash_offset */
-	if (imximage_ivt_offset == UNDEFINED) {
+	if (ctx.ivt_offset == UNDEFINED) {
 		fprintf(stderr, "Error: No BOOT_FROM tag in %s\n", name);
 		exit(EXIT_FAILURE);
 	}
-	return dcd_len;
+	return ctx.dcd_len;
 }
 
 int main(int argc, char **argv)
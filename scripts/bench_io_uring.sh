@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Compare the synchronous copies with the io_uring backend of mkimage_imx8
+# when building a B0 container with a large data image.
+#
+# usage: bench_io_uring.sh <mkimage_imx8> <dir>...
+#   each dir (e.g. a tmpfs and an NVMe mount) holds the input and output
+#   SIZE_MB   size of the data image (default 2048)
+#   DEPTHS    io_uring queue depths to try (default "4 16 64")
+#   RUNS      runs of each case, the best one is printed (default 3)
+#
+# The page cache is dropped before every run when the script runs as root.
+
+MKIMG=$1
+shift
+
+SIZE_MB=${SIZE_MB:-2048}
+DEPTHS=${DEPTHS:-"4 16 64"}
+RUNS=${RUNS:-3}
+
+if [ ! -x "$MKIMG" ] || [ $# -eq 0 ]; then
+	echo "usage: $0 <mkimage_imx8> <dir>..."
+	exit 1
+fi
+
+now() {
+	date +%s.%N
+}
+
+report() {
+	awk -v n="$1" -v t=$2 -v s=$SIZE_MB \
+		'BEGIN { printf "%-12s %8.3f s %8.0f MB/s\n", n ":", t, s / t }'
+}
+
+run() {
+	dir=$1
+	shift
+	best=""
+	i=0
+	while [ $i -lt $RUNS ]; do
+		rm -f "$dir/bench-out.bin"
+		sync
+		[ "$(id -u)" = 0 ] && echo 3 > /proc/sys/vm/drop_caches
+		start=$(now)
+		"$MKIMG" -soc QX -rev B0 -c -data "$dir/bench-data.bin" 0x80000000 \
+			-hash-cache "$@" -out "$dir/bench-out.bin" > /dev/null || exit 1
+		sync
+		best=$(awk -v s=$start -v e=$(now) -v b="$best" \
+			'BEGIN { t = e - s; if (b != "" && b < t) t = b; printf "%.3f", t }')
+		i=$((i + 1))
+	done
+	echo "$best"
+}
+
+for dir in "$@"; do
+	echo "== $dir ($(stat -f -c %T "$dir"), ${SIZE_MB} MB data image)"
+	dd if=/dev/urandom of="$dir/bench-data.bin" bs=1M count=$SIZE_MB 2> /dev/null
+
+	# warm the digest cache, only the copies are timed (files modified in
+	# the last seconds are not cached)
+	touch -t 200001010000 "$dir/bench-data.bin"
+	"$MKIMG" -soc QX -rev B0 -c -data "$dir/bench-data.bin" 0x80000000 \
+		-hash-cache -out "$dir/bench-out.bin" > /dev/null || exit 1
+
+	report "sync" $(run "$dir")
+	for d in $DEPTHS; do
+		report "io_uring $d" $(run "$dir" -io-uring $d)
+	done
+
+	rm -f "$dir/bench-data.bin" "$dir/bench-out.bin"
+done
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Regression check of -batch with the same large data image listed twice
+# in a build: the second hash of it must not wait on the first one, which
+# is only done once the image is copied to the output.
+#
+# usage: check_batch_dup.sh <mkimage_imx8>
+#   TIMEOUT   seconds before the batch is taken as hung (default 300)
+
+MKIMG=$1
+TIMEOUT=${TIMEOUT:-300}
+
+if [ ! -x "$MKIMG" ]; then
+	echo "usage: $0 <mkimage_imx8>"
+	exit 1
+fi
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+# above STREAM_NOCACHE_SIZE, the image is hashed while it is copied
+dd if=/dev/urandom of="$dir/big.bin" bs=1M count=4 2> /dev/null
+truncate -s 300M "$dir/big.bin"
+
+args="-soc QX -rev B0 -c -data $dir/big.bin 0x90000000 -data $dir/big.bin 0xc0000000"
+echo "$args -out $dir/batch.bin" > "$dir/batch.txt"
+
+"$MKIMG" $args -out "$dir/ref.bin" > /dev/null || exit 1
+
+if ! timeout $TIMEOUT "$MKIMG" -batch "$dir/batch.txt" > "$dir/batch.log" 2>&1; then
+	cat "$dir/batch.log"
+	echo "FAIL: -batch with a duplicate large image (timeout $TIMEOUT s)"
+	exit 1
+fi
+if ! cmp -s "$dir/ref.bin" "$dir/batch.bin"; then
+	echo "FAIL: -batch output differs from the single build"
+	exit 1
+fi
+
+echo "ok: -batch with a duplicate large image"
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Regression check of the DCD cfg preprocessor of mkimage_imx8: every
+# shipped cfg file, preprocessed by the tool, must give the same DCD table
+# as the file preprocessed by gcc -E, as the soc.mak files did before.
+# Compared through the images built with both, for each DDR_TRAIN value.
+#
+# usage: check_cfgpp.sh <mkimage_imx8> [cc]
+
+MKIMG=$1
+CC=${2:-${CC:-gcc}}
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+
+if [ ! -x "$MKIMG" ]; then
+	echo "usage: $0 <mkimage_imx8> [cc]"
+	exit 1
+fi
+if ! command -v "$CC" > /dev/null; then
+	echo "skipped: no $CC to compare the DCD cfg preprocessor with"
+	exit 0
+fi
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+dd if=/dev/urandom of="$dir/scfw.bin" bs=1k count=64 2> /dev/null
+status=0
+
+for soc in QX QM; do
+	for cfg in "$TOP"/iMX8$soc/*.cfg; do
+		inc="-I $TOP/iMX8$soc/include -I $TOP/iMX8$soc/lib"
+		for train in 0 1; do
+			name="$(basename "$cfg") DDR_TRAIN_IN_DCD=$train"
+			if ! "$CC" -E -nostdinc $inc -DDDR_TRAIN_IN_DCD=$train -x c \
+				-o "$dir/gcc.cfg" "$cfg"; then
+				echo "FAIL: $name, $CC -E"
+				status=1
+				continue
+			fi
+			"$MKIMG" -soc $soc -rev A0 -c -dcd "$dir/gcc.cfg" \
+				-scfw "$dir/scfw.bin" -out "$dir/gcc.bin" > /dev/null 2>&1
+			gcc_rc=$?
+			"$MKIMG" -soc $soc -rev A0 $inc -D DDR_TRAIN_IN_DCD=$train \
+				-c -dcd "$cfg" -scfw "$dir/scfw.bin" \
+				-out "$dir/native.bin" > /dev/null 2>&1
+			if [ $? -ne $gcc_rc ] ||
+			   { [ $gcc_rc -eq 0 ] && ! cmp -s "$dir/gcc.bin" "$dir/native.bin"; }; then
+				echo "FAIL: $name, the DCD differs from $CC -E"
+				status=1
+			else
+				echo "ok: $name"
+			fi
+		done
+	done
+done
+
+exit $status
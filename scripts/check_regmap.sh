@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Regression check of mkimage_imx8 -expand-regmap against the script it
+# replaces, iMX8QM/expand_c_define.sh. The SCFW register maps are not in
+# this tree: they are made again from the shipped iMX8QM/lib and
+# iMX8QX/lib headers, without the REG_0 and REG_1 lines added to them.
+#
+# usage: check_regmap.sh <mkimage_imx8>
+
+MKIMG=$1
+TOP=$(cd "$(dirname "$0")/.." && pwd)
+
+if [ ! -x "$MKIMG" ]; then
+	echo "usage: $0 <mkimage_imx8>"
+	exit 1
+fi
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+status=0
+
+for h in "$TOP"/iMX8QM/lib/*.h "$TOP"/iMX8QX/lib/*.h; do
+	name=${h#$TOP/}
+	awk 'drop && /^#define [A-Za-z0-9_]+_[0-9]+ +0x[0-9a-f]+$/ { next }
+	     { print; drop = /REG32\(.*\)$/ }' "$h" > "$dir/map.h"
+	sh "$TOP/iMX8QM/expand_c_define.sh" < "$dir/map.h" > "$dir/script.h"
+	if ! "$MKIMG" -expand-regmap "$dir/map.h" -out "$dir/tool.h" > /dev/null; then
+		echo "FAIL: $name, -expand-regmap failed"
+		status=1
+	elif ! cmp -s "$dir/script.h" "$dir/tool.h"; then
+		echo "FAIL: $name, -expand-regmap differs from expand_c_define.sh"
+		diff "$dir/script.h" "$dir/tool.h" | head -10
+		status=1
+	else
+		echo "ok: $name"
+	fi
+done
+
+exit $status
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# Regression check of -update when the output shrinks: an existing output
+# with more containers, or longer than the new image, must end up the same
+# as a clean build.
+#
+# usage: check_update_shrink.sh <mkimage_imx8>
+
+MKIMG=$1
+
+if [ ! -x "$MKIMG" ]; then
+	echo "usage: $0 <mkimage_imx8>"
+	exit 1
+fi
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+dd if=/dev/urandom of="$dir/a.bin" bs=1k count=200 2> /dev/null
+dd if=/dev/urandom of="$dir/b.bin" bs=1k count=600 2> /dev/null
+
+one="-soc QX -rev B0 -c -data $dir/a.bin 0x80000000"
+two="$one -c -data $dir/b.bin 0x90000000"
+status=0
+
+check() {
+	if cmp -s "$dir/clean.bin" "$dir/update.bin"; then
+		echo "ok: -update $1"
+	else
+		echo "FAIL: -update $1, $(stat -c %s "$dir/update.bin") bytes" \
+			"instead of $(stat -c %s "$dir/clean.bin")"
+		status=1
+	fi
+}
+
+"$MKIMG" $one -out "$dir/clean.bin" > /dev/null || exit 1
+
+"$MKIMG" $two -out "$dir/update.bin" > /dev/null || exit 1
+"$MKIMG" $one -update -out "$dir/update.bin" > /dev/null || exit 1
+check "from two containers to one"
+
+cp "$dir/clean.bin" "$dir/update.bin"
+truncate -s +1M "$dir/update.bin"
+"$MKIMG" $one -update -out "$dir/update.bin" > /dev/null || exit 1
+check "of a longer output"
+
+exit $status
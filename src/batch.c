@@ -0,0 +1,464 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Batch builds, for -batch. Every line of the manifest holds the arguments
+ * of one build, as on the command line, and the builds run in forked
+ * workers, jobs of them at once. The workers share a memo in memory for
+ * the work the builds would each do again: the digests of the images,
+ * keyed as the hash cache is, and the tables parsed from the DCD cfg
+ * files. The first worker that needs an entry makes it while the others
+ * wait for it. The output of a build is printed once the build is done,
+ * so the lines of the builds do not mix.
+ */
+
+#include "mkimage_common.h"
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define BATCH_MAX_ARGS		256
+#define BATCH_MAX_JOBS		256
+
+/* states of a memo slot */
+#define SLOT_FREE		0
+#define SLOT_CLAIMED		1	/* the key is being written */
+#define SLOT_BUSY		2	/* the owner makes the value */
+#define SLOT_DONE		3
+#define SLOT_FAILED		4	/* no value, the next one to need it makes it */
+
+/* slots tried for a key, the least recently used one gives way when full */
+#define BATCH_PROBE		16
+
+typedef struct {
+	uint32_t state;
+	uint32_t seq;		/* bumped whenever the slot changes hands */
+	uint32_t used;		/* tick of the last hit */
+	int32_t owner;		/* pid of the process making the value */
+	uint32_t len;		/* bytes of the value */
+	uint8_t key[HASH_TYPE_SHA_256 / 8];	/* SHA-256 of the key */
+} batch_slot_t;
+
+typedef struct {
+	int count;		/* slots */
+	size_t size;		/* room for the value after each slot */
+	uint8_t *base;
+	uint32_t *tick;		/* shared, counts the hits */
+} batch_table_t;
+
+#define BATCH_TABLE_HEADER	64
+
+static batch_table_t batch_tables[BATCH_MEMO_KINDS] = {
+	[BATCH_MEMO_HASH] = { 1024, SHA2_MAX_DIGEST_LEN, NULL, NULL },
+	[BATCH_MEMO_DCD] = { 64, BATCH_DCD_MAX_SIZE, NULL, NULL },
+};
+
+/* set in the workers, a build of the batch can not start another batch */
+int batch_worker;
+
+/*
+ * The memo outlives the inputs (-serve): only what was made from files
+ * that settled is kept, see hash_cache_settled()
+ */
+int batch_memo_lasting;
+
+static batch_slot_t *batch_slot(const batch_table_t *t, int i)
+{
+	return (batch_slot_t *) (t->base + BATCH_TABLE_HEADER +
+			(size_t) i * (sizeof(batch_slot_t) + t->size));
+}
+
+/* Map the memo, shared with the workers forked after */
+void batch_memo_init(void)
+{
+	batch_table_t *t;
+	size_t len;
+	int k;
+
+	for (k = 0; k < BATCH_MEMO_KINDS; k++) {
+		t = &batch_tables[k];
+		len = BATCH_TABLE_HEADER + (size_t) t->count * (sizeof(batch_slot_t) + t->size);
+		t->base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (t->base == MAP_FAILED) {
+			fprintf(stderr, "Warning: no memory for the batch memo, not used\n");
+			t->base = NULL;
+			continue;
+		}
+		t->tick = (uint32_t *) t->base;
+	}
+}
+
+/* Take the slot in state from for key, for the caller to make its value */
+static bool batch_claim(batch_slot_t *s, uint32_t from, const uint8_t *digest)
+{
+	if (!__atomic_compare_exchange_n(&s->state, &from, SLOT_CLAIMED, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return false;
+
+	__atomic_add_fetch(&s->seq, 1, __ATOMIC_ACQ_REL);
+	memcpy(s->key, digest, sizeof(s->key));
+	s->owner = getpid();
+	__atomic_store_n(&s->state, SLOT_BUSY, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/*
+ * Find the slot of key, or claim one for it: a free one, the one of the
+ * key when its value could not be made, or the least recently used one.
+ * Returns NULL when every slot tried is busy.
+ */
+static batch_slot_t *batch_find(const batch_table_t *t, const uint8_t *digest,
+				bool *claimed)
+{
+	batch_slot_t *s, *victim = NULL;
+	uint32_t state;
+	int i, n;
+
+	*claimed = false;
+	i = (digest[0] | digest[1] << 8 | digest[2] << 16) % t->count;
+	for (n = 0; n < BATCH_PROBE && n < t->count; n++, i = (i + 1) % t->count) {
+		s = batch_slot(t, i);
+		if (batch_claim(s, SLOT_FREE, digest)) {
+			*claimed = true;
+			return s;
+		}
+		while ((state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE)) == SLOT_CLAIMED)
+			sched_yield();
+		if (!memcmp(s->key, digest, sizeof(s->key))) {
+			if (state == SLOT_FAILED && batch_claim(s, SLOT_FAILED, digest))
+				*claimed = true;
+			return s;
+		}
+		if ((state == SLOT_DONE || state == SLOT_FAILED) &&
+		    (victim == NULL || (int32_t) (s->used - victim->used) < 0))
+			victim = s;
+	}
+
+	if (victim) {
+		state = __atomic_load_n(&victim->state, __ATOMIC_ACQUIRE);
+		if ((state == SLOT_DONE || state == SLOT_FAILED) &&
+		    batch_claim(victim, state, digest)) {
+			*claimed = true;
+			return victim;
+		}
+	}
+
+	return NULL;
+}
+
+static void batch_key(const void *key, size_t keylen, uint8_t *digest)
+{
+	sha2_ctx_t ctx;
+
+	sha2_init(&ctx, HASH_TYPE_SHA_256);
+	sha2_update(&ctx, key, keylen);
+	sha2_final(&ctx, digest);
+}
+
+/*
+ * Get the value of key from the memo of kind, waiting while another
+ * worker makes it. Returns its length, or -1 when the caller has to make
+ * it and then give it to batch_memo_put(). Always -1 out of a batch.
+ */
+int batch_memo_get(int kind, const void *key, size_t keylen, void *value, size_t size)
+{
+	const batch_table_t *t = &batch_tables[kind];
+	uint8_t digest[HASH_TYPE_SHA_256 / 8];
+	batch_slot_t *s;
+	uint32_t state, seq, len;
+	bool claimed;
+
+	if (t->base == NULL)
+		return -1;
+
+	batch_key(key, keylen, digest);
+	s = batch_find(t, digest, &claimed);
+	if (s == NULL || claimed)
+		return -1;
+
+	while (1) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+		if (state != SLOT_BUSY)
+			break;
+		/* an owner that failed leaves the slot to the next one */
+		if (kill(s->owner, 0) < 0 && errno == ESRCH) {
+			__atomic_compare_exchange_n(&s->state, &state, SLOT_FAILED, false,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+			return -1;
+		}
+		usleep(1000);
+	}
+
+	if (state != SLOT_DONE || memcmp(s->key, digest, sizeof(s->key)) || s->len > size)
+		return -1;
+	len = s->len;
+	memcpy(value, (uint8_t *) (s + 1), len);
+
+	/* the slot must not have changed hands while it was read */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != seq ||
+	    __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != SLOT_DONE)
+		return -1;
+	s->used = __atomic_add_fetch(t->tick, 1, __ATOMIC_RELAXED);
+
+	return len;
+}
+
+/*
+ * Give the value made for key after batch_memo_get() returned -1, or
+ * NULL when it could not be made. Nothing is done when the slot is not
+ * the one of the caller.
+ */
+void batch_memo_put(int kind, const void *key, size_t keylen, const void *value, size_t len)
+{
+	const batch_table_t *t = &batch_tables[kind];
+	uint8_t digest[HASH_TYPE_SHA_256 / 8];
+	batch_slot_t *s;
+	bool claimed;
+
+	if (t->base == NULL)
+		return;
+
+	batch_key(key, keylen, digest);
+	s = batch_find(t, digest, &claimed);
+	if (s == NULL || s->owner != getpid() ||
+	    __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != SLOT_BUSY ||
+	    memcmp(s->key, digest, sizeof(s->key)))
+		return;
+
+	if (value == NULL || len > t->size) {
+		__atomic_store_n(&s->state, SLOT_FAILED, __ATOMIC_RELEASE);
+		return;
+	}
+	memcpy((uint8_t *) (s + 1), value, len);
+	s->len = len;
+	s->used = __atomic_add_fetch(t->tick, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->state, SLOT_DONE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Forget the value of key, found out of date by the caller. The next
+ * batch_memo_get() of it has to make it again.
+ */
+void batch_memo_drop(int kind, const void *key, size_t keylen)
+{
+	const batch_table_t *t = &batch_tables[kind];
+	uint8_t digest[HASH_TYPE_SHA_256 / 8];
+	uint32_t state = SLOT_DONE;
+	batch_slot_t *s;
+	bool claimed;
+
+	if (t->base == NULL)
+		return;
+
+	batch_key(key, keylen, digest);
+	s = batch_find(t, digest, &claimed);
+	if (s == NULL)
+		return;
+	if (claimed)
+		__atomic_store_n(&s->state, SLOT_FAILED, __ATOMIC_RELEASE);
+	else
+		__atomic_compare_exchange_n(&s->state, &state, SLOT_FAILED, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+typedef struct {
+	pid_t pid;
+	int lineno;
+	FILE *log;		/* stdout and stderr of the build */
+} batch_job_t;
+
+/* Split line in words, returns their count */
+static int batch_split(char *line, char **args, int max, const char *name, int lineno)
+{
+	char *p, *save;
+	int n = 0;
+
+	for (p = strtok_r(line, " \t\r\n", &save); p; p = strtok_r(NULL, " \t\r\n", &save)) {
+		if (*p == '#')
+			break;
+		if (n == max) {
+			fprintf(stderr, "Error: %s[%d] - More than %d arguments\n",
+				name, lineno, max - 1);
+			fail_exit();
+		}
+		args[n++] = p;
+	}
+
+	return n;
+}
+
+/*
+ * Read the next line of the manifest into *line, with the lines following
+ * a \ at the end of a line. *lineno is updated, returns -1 at the end.
+ */
+static ssize_t batch_getline(FILE *fp, char **line, size_t *size, int *lineno)
+{
+	char *next = NULL;
+	size_t next_size = 0;
+	ssize_t len, n;
+
+	len = getline(line, size, fp);
+	if (len <= 0)
+		return -1;
+	(*lineno)++;
+
+	while (len && ((*line)[len - 1] == '\n' || (*line)[len - 1] == '\r'))
+		(*line)[--len] = 0;
+	while (len && (*line)[len - 1] == '\\') {
+		(*line)[--len] = 0;
+		n = getline(&next, &next_size, fp);
+		if (n <= 0)
+			break;
+		(*lineno)++;
+		while (n && (next[n - 1] == '\n' || next[n - 1] == '\r'))
+			next[--n] = 0;
+		if ((size_t) (len + n + 2) > *size) {
+			*size = len + n + 2;
+			*line = realloc(*line, *size);
+			if (*line == NULL) {
+				fprintf(stderr, "Failed to allocate memory\n");
+				fail_exit_with(FAIL_NOMEM);
+			}
+		}
+		(*line)[len++] = ' ';
+		memcpy(*line + len, next, n + 1);
+		len += n;
+	}
+	free(next);
+
+	return len;
+}
+
+/* Print the output of a finished build, returns 0 when it succeeded */
+static int batch_done(batch_job_t *job, int status, const char *name)
+{
+	char buf[4096];
+	size_t n;
+
+	fflush(stdout);
+	rewind(job->log);
+	while ((n = fread(buf, 1, sizeof(buf), job->log)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fclose(job->log);
+	fflush(stdout);
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		return 0;
+
+	fprintf(stderr, "Error: %s[%d] - Build failed\n", name, job->lineno);
+	return -1;
+}
+
+/* Wait for one of the builds running, returns -1 when it failed */
+static int batch_wait(batch_job_t *jobs, int *running, const char *name)
+{
+	int status, i, ret;
+	pid_t pid;
+
+	do {
+		pid = wait(&status);
+	} while (pid < 0 && errno == EINTR);
+	if (pid < 0) {
+		fprintf(stderr, "Error: wait: %s\n", strerror(errno));
+		fail_exit();
+	}
+
+	for (i = 0; i < *running; i++)
+		if (jobs[i].pid == pid)
+			break;
+	if (i == *running)
+		return 0;
+
+	ret = batch_done(&jobs[i], status, name);
+	jobs[i] = jobs[--*running];
+
+	return ret;
+}
+
+/*
+ * Run the builds of the manifest name, jobs at once, every one through
+ * build(), mkimage_main(). Returns the number of builds that failed.
+ */
+int batch_run(const char *name, int jobs, const char *prog,
+		int (*build)(int argc, char **argv))
+{
+	batch_job_t running[BATCH_MAX_JOBS];
+	char *args[BATCH_MAX_ARGS + 1];
+	char *line = NULL;
+	size_t size = 0;
+	int nrunning = 0, lineno = 0, first, builds = 0, failed = 0, n;
+	FILE *fp;
+	pid_t pid;
+
+	fp = fopen(name, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: Can't open: %s\n", name, strerror(errno));
+		fail_exit_with(FAIL_INPUT);
+	}
+
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > BATCH_MAX_JOBS)
+		jobs = BATCH_MAX_JOBS;
+
+	batch_memo_init();
+
+	for (;;) {
+		first = lineno + 1;
+		if (batch_getline(fp, &line, &size, &lineno) < 0)
+			break;
+		args[0] = (char *) prog;
+		n = batch_split(line, args + 1, BATCH_MAX_ARGS - 1, name, first) + 1;
+		if (n == 1)
+			continue;
+		args[n] = NULL;
+
+		if (nrunning == jobs && batch_wait(running, &nrunning, name) < 0)
+			failed++;
+
+		running[nrunning].lineno = first;
+		running[nrunning].log = tmpfile();
+		if (running[nrunning].log == NULL) {
+			fprintf(stderr, "Error: no temporary file for the output: %s\n",
+				strerror(errno));
+			fail_exit();
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+		pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "Error: fork: %s\n", strerror(errno));
+			fail_exit();
+		}
+		if (pid == 0) {
+			dup2(fileno(running[nrunning].log), STDOUT_FILENO);
+			dup2(fileno(running[nrunning].log), STDERR_FILENO);
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			fclose(fp);
+			batch_worker = 1;
+			optind = 0;
+			/* a failed build ends its worker, even in libmkimage */
+			fail_set_target(NULL);
+			exit(build(n, args));
+		}
+		running[nrunning++].pid = pid;
+		builds++;
+	}
+	fclose(fp);
+	free(line);
+
+	while (nrunning)
+		if (batch_wait(running, &nrunning, name) < 0)
+			failed++;
+
+	fprintf(stdout, "BATCH:\t%d builds, %d failed\n", builds, failed);
+
+	return failed;
+}
@@ -0,0 +1,2 @@
+#define MKIMAGE_COMMIT 0x9f7589de
+
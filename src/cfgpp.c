@@ -0,0 +1,987 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Preprocessor of the DCD cfg files. It does the part of the C
+ * preprocessor the cfg files use: comments, #include, #define and #undef
+ * (object and function like macros), #if, #ifdef, #ifndef, #elif, #else
+ * and #endif, so the files no longer need a pass through $(CC) -E. The
+ * files read are kept to write a make depfile.
+ *
+ * A cfgpp_t holds what a run changes, the macros and the files read, so
+ * several cfg files can be preprocessed at once from different threads.
+ * The -D and -I options are set before, while the options are parsed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "cfgpp.h"
+#include "fail.h"
+
+#define PP_HASH_SIZE		4096
+#define PP_MAX_DIRS		16
+#define PP_MAX_INCLUDE		32	/* nested #include */
+#define PP_MAX_COND		64	/* nested #if */
+
+typedef struct macro {
+	struct macro *next;
+	char *name;
+	char *body;
+	int nparams;		/* -1 for an object like macro */
+	char **params;
+	int busy;		/* being expanded, not expanded again inside */
+} macro_t;
+
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t size;
+} strbuf_t;
+
+/* position for the error messages */
+typedef struct {
+	const char *file;
+	int lineno;
+} pp_pos_t;
+
+struct cfgpp {
+	macro_t *macros[PP_HASH_SIZE];
+	char **deps;		/* files read */
+	int dep_count;
+};
+
+/*
+ * The -D macros every run starts from, and the files read by all the runs.
+ * They are the options of a build, kept per thread.
+ */
+static __thread cfgpp_t *global;
+
+static __thread const char *include_dirs[PP_MAX_DIRS];
+static __thread int include_dir_count;
+static __thread strbuf_t options;	/* -D and -I, in order */
+
+static void pp_error(const pp_pos_t *pos, const char *msg, const char *arg)
+{
+	fprintf(stderr, "Error: %s[%d] - %s%s\n", pos->file, pos->lineno, msg, arg);
+	fail_exit();
+}
+
+static void *pp_alloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (ptr == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+
+	return ptr;
+}
+
+/* The macros and files of all the runs, allocated with the first one */
+static cfgpp_t *pp_global(void)
+{
+	if (global == NULL) {
+		global = pp_alloc(NULL, sizeof(*global));
+		memset(global, 0, sizeof(*global));
+	}
+
+	return global;
+}
+
+static char *pp_strndup(const char *s, size_t len)
+{
+	char *d = pp_alloc(NULL, len + 1);
+
+	memcpy(d, s, len);
+	d[len] = 0;
+
+	return d;
+}
+
+static void sb_add(strbuf_t *sb, const char *s, size_t len)
+{
+	if (sb->len + len + 1 > sb->size) {
+		sb->size = 2 * (sb->len + len + 1);
+		sb->buf = pp_alloc(sb->buf, sb->size);
+	}
+	memcpy(sb->buf + sb->len, s, len);
+	sb->len += len;
+	sb->buf[sb->len] = 0;
+}
+
+static int is_digit(char c)
+{
+	return isdigit((unsigned char)c);
+}
+
+static int is_ident(char c)
+{
+	return isalnum((unsigned char)c) || c == '_';
+}
+
+static const char *skip_space(const char *p)
+{
+	while (*p == ' ' || *p == '\t')
+		p++;
+
+	return p;
+}
+
+static unsigned int macro_hash(const char *name, size_t len)
+{
+	unsigned int h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+
+	return h % PP_HASH_SIZE;
+}
+
+static macro_t **macro_find(cfgpp_t *pp, const char *name, size_t len)
+{
+	macro_t **m = &pp->macros[macro_hash(name, len)];
+
+	for (; *m; m = &(*m)->next)
+		if (!strncmp((*m)->name, name, len) && (*m)->name[len] == 0)
+			break;
+
+	return m;
+}
+
+static void macro_free(macro_t *m)
+{
+	int i;
+
+	for (i = 0; i < m->nparams; i++)
+		free(m->params[i]);
+	free(m->params);
+	free(m->name);
+	free(m->body);
+	free(m);
+}
+
+static void macro_undef(cfgpp_t *pp, const char *name, size_t len)
+{
+	macro_t **m = macro_find(pp, name, len);
+	macro_t *old = *m;
+
+	if (old == NULL)
+		return;
+
+	*m = old->next;
+	macro_free(old);
+}
+
+/* Parse "NAME body" or "NAME(a, b) body", what follows #define */
+static void macro_define(cfgpp_t *pp, const char *p, const pp_pos_t *pos)
+{
+	const char *name = p, *end;
+	macro_t *m;
+
+	while (is_ident(*p))
+		p++;
+	if (p == name || is_digit(*name))
+		pp_error(pos, "Invalid macro name", "");
+
+	macro_undef(pp, name, p - name);
+
+	/* in pp from the start, freed with it if the definition fails */
+	m = pp_alloc(NULL, sizeof(*m));
+	memset(m, 0, sizeof(*m));
+	m->next = pp->macros[macro_hash(name, p - name)];
+	pp->macros[macro_hash(name, p - name)] = m;
+	m->name = pp_strndup(name, p - name);
+	m->nparams = -1;
+
+	/* a parameter list only when the parenthesis follows the name */
+	if (*p == '(') {
+		m->nparams = 0;
+		p = skip_space(p + 1);
+		while (*p != ')') {
+			name = p;
+			while (is_ident(*p))
+				p++;
+			if (p == name)
+				pp_error(pos, "Invalid macro parameters for ", m->name);
+			m->params = pp_alloc(m->params, (m->nparams + 1) * sizeof(char *));
+			m->params[m->nparams] = pp_strndup(name, p - name);
+			m->nparams++;
+			p = skip_space(p);
+			if (*p == ',')
+				p = skip_space(p + 1);
+			else if (*p != ')')
+				pp_error(pos, "Invalid macro parameters for ", m->name);
+		}
+		p++;
+	}
+
+	p = skip_space(p);
+	end = p + strlen(p);
+	while (end > p && isspace((unsigned char)end[-1]))
+		end--;
+	m->body = pp_strndup(p, end - p);
+}
+
+static void expand(cfgpp_t *pp, const char *p, strbuf_t *out, int in_if,
+			const pp_pos_t *pos);
+
+/* Replace the parameters of m in its body by the arguments */
+static void macro_subst(const macro_t *m, char **args, strbuf_t *out)
+{
+	const char *p = m->body, *s;
+	int i;
+
+	while (*p) {
+		if (is_digit(*p)) {
+			for (s = p; is_ident(*p) || *p == '.'; p++)
+				;
+			sb_add(out, s, p - s);
+			continue;
+		}
+		if (!is_ident(*p)) {
+			sb_add(out, p++, 1);
+			continue;
+		}
+		for (s = p; is_ident(*p); p++)
+			;
+		for (i = 0; i < m->nparams; i++)
+			if (!strncmp(m->params[i], s, p - s) && m->params[i][p - s] == 0)
+				break;
+		if (i < m->nparams)
+			sb_add(out, args[i], strlen(args[i]));
+		else
+			sb_add(out, s, p - s);
+	}
+}
+
+/* What a macro call holds while it is expanded */
+typedef struct {
+	char **args;
+	int nargs;
+	strbuf_t arg, body;
+	char *text;
+} pp_call_t;
+
+static void pp_call_free(void *arg)
+{
+	pp_call_t *c = arg;
+	int i;
+
+	for (i = 0; i < c->nargs; i++)
+		free(c->args[i]);
+	free(c->args);
+	free(c->arg.buf);
+	free(c->body.buf);
+	free(c->text);
+}
+
+/*
+ * Expand the call of the function like macro m, p points after its name.
+ * Returns the end of the call, or NULL when the name is not followed by
+ * an argument list (it is not a call then).
+ */
+static const char *expand_call(cfgpp_t *pp, macro_t *m, const char *p,
+				strbuf_t *out, int in_if, const pp_pos_t *pos)
+{
+	pp_call_t c = { 0 };
+	const char *start;
+	int level = 0, call_args;
+
+	p = skip_space(p);
+	if (*p != '(')
+		return NULL;
+
+	fail_push(pp_call_free, &c);
+
+	for (start = ++p; ; p++) {
+		if (*p == 0)
+			pp_error(pos, "Unterminated call of macro ", m->name);
+		if (*p == '(') {
+			level++;
+		} else if ((*p == ',' && level == 0) || (*p == ')' && level-- == 0)) {
+			/* the arguments are expanded before they replace the parameters */
+			c.arg.len = 0;
+			sb_add(&c.arg, "", 0);
+			c.text = pp_strndup(start, p - start);
+			expand(pp, c.text, &c.arg, in_if, pos);
+			free(c.text);
+			c.text = NULL;
+			c.args = pp_alloc(c.args, (c.nargs + 1) * sizeof(char *));
+			c.args[c.nargs] = pp_strndup(c.arg.buf, c.arg.len);
+			c.nargs++;
+			start = p + 1;
+			if (*p == ')')
+				break;
+		}
+	}
+
+	/* M() is a call without arguments */
+	call_args = c.nargs;
+	if (m->nparams == 0 && c.nargs == 1 && *skip_space(c.args[0]) == 0)
+		call_args = 0;
+	if (call_args != m->nparams)
+		pp_error(pos, "Wrong number of arguments for macro ", m->name);
+
+	macro_subst(m, c.args, &c.body);
+	m->busy = 1;
+	expand(pp, c.body.buf ? c.body.buf : "", out, in_if, pos);
+	m->busy = 0;
+
+	fail_pop(&c, 1);
+
+	return p + 1;
+}
+
+/*
+ * Copy p to out with the macros expanded. In an #if expression the
+ * defined operator is replaced by 0 or 1 first.
+ */
+static void expand(cfgpp_t *pp, const char *p, strbuf_t *out, int in_if,
+			const pp_pos_t *pos)
+{
+	const char *s, *end;
+	macro_t *m;
+	int paren;
+
+	while (*p) {
+		/* numbers, 0x5c000000 is not an identifier */
+		if (is_digit(*p)) {
+			for (s = p; is_ident(*p) || *p == '.'; p++)
+				;
+			sb_add(out, s, p - s);
+			continue;
+		}
+
+		if (!is_ident(*p)) {
+			sb_add(out, p++, 1);
+			continue;
+		}
+
+		for (s = p; is_ident(*p); p++)
+			;
+
+		if (in_if && p - s == 7 && !strncmp(s, "defined", 7)) {
+			p = skip_space(p);
+			paren = *p == '(';
+			if (paren)
+				p = skip_space(p + 1);
+			for (s = p; is_ident(*p); p++)
+				;
+			if (p == s)
+				pp_error(pos, "Missing macro name after defined", "");
+			sb_add(out, *macro_find(pp, s, p - s) ? "1" : "0", 1);
+			p = skip_space(p);
+			if (paren && *p++ != ')')
+				pp_error(pos, "Missing ) after defined", "");
+			continue;
+		}
+
+		m = *macro_find(pp, s, p - s);
+		if (m == NULL || m->busy) {
+			sb_add(out, s, p - s);
+			continue;
+		}
+
+		if (m->nparams >= 0) {
+			end = expand_call(pp, m, p, out, in_if, pos);
+			if (end == NULL)
+				sb_add(out, s, p - s);
+			else
+				p = end;
+			continue;
+		}
+
+		m->busy = 1;
+		expand(pp, m->body, out, in_if, pos);
+		m->busy = 0;
+	}
+}
+
+/* Evaluation of the #if expressions, once the macros are expanded */
+typedef struct {
+	const char *p;
+	const pp_pos_t *pos;
+} pp_expr_t;
+
+static intmax_t eval_cond(pp_expr_t *e);
+
+static int eval_op(pp_expr_t *e, const char *op)
+{
+	size_t len = strlen(op);
+
+	e->p = skip_space(e->p);
+	if (strncmp(e->p, op, len))
+		return 0;
+	/* & is not &&, < is not << or <= */
+	if (len == 1 && strchr("&|<>", *op) && (e->p[1] == *op || e->p[1] == '='))
+		return 0;
+	if (len == 1 && strchr("!=", *op) && e->p[1] == '=')
+		return 0;
+	e->p += len;
+
+	return 1;
+}
+
+static intmax_t eval_primary(pp_expr_t *e)
+{
+	intmax_t v;
+	char *end;
+
+	e->p = skip_space(e->p);
+
+	if (eval_op(e, "(")) {
+		v = eval_cond(e);
+		if (!eval_op(e, ")"))
+			pp_error(e->pos, "Missing ) in expression", "");
+		return v;
+	}
+	if (eval_op(e, "!"))
+		return !eval_primary(e);
+	if (eval_op(e, "~"))
+		return ~eval_primary(e);
+	if (eval_op(e, "-"))
+		return -eval_primary(e);
+	if (eval_op(e, "+"))
+		return eval_primary(e);
+
+	if (is_digit(*e->p)) {
+		v = strtoumax(e->p, &end, 0);
+		while (*end == 'u' || *end == 'U' || *end == 'l' || *end == 'L')
+			end++;
+		e->p = end;
+		return v;
+	}
+
+	/* identifiers left once everything is expanded are 0 */
+	if (is_ident(*e->p)) {
+		while (is_ident(*e->p))
+			e->p++;
+		return 0;
+	}
+
+	pp_error(e->pos, "Invalid expression at ", *e->p ? e->p : "end of line");
+	return 0;
+}
+
+static intmax_t eval_binary(pp_expr_t *e, int level)
+{
+	static const char *ops[][4] = {
+		{ "||" }, { "&&" }, { "|" }, { "^" }, { "&" },
+		{ "==", "!=" }, { "<=", ">=", "<", ">" }, { "<<", ">>" },
+		{ "+", "-" }, { "*", "/", "%" },
+	};
+	intmax_t a, b;
+	int i, found;
+
+	if (level == sizeof(ops) / sizeof(ops[0]))
+		return eval_primary(e);
+
+	a = eval_binary(e, level + 1);
+	do {
+		found = 0;
+		for (i = 0; i < 4 && ops[level][i]; i++) {
+			if (!eval_op(e, ops[level][i]))
+				continue;
+			found = 1;
+			b = eval_binary(e, level + 1);
+			switch (ops[level][i][0] | ops[level][i][1] << 8) {
+			case '|' | '|' << 8: a = a || b; break;
+			case '&' | '&' << 8: a = a && b; break;
+			case '|': a |= b; break;
+			case '^': a ^= b; break;
+			case '&': a &= b; break;
+			case '=' | '=' << 8: a = a == b; break;
+			case '!' | '=' << 8: a = a != b; break;
+			case '<' | '=' << 8: a = a <= b; break;
+			case '>' | '=' << 8: a = a >= b; break;
+			case '<': a = a < b; break;
+			case '>': a = a > b; break;
+			case '<' | '<' << 8: a <<= b; break;
+			case '>' | '>' << 8: a >>= b; break;
+			case '+': a += b; break;
+			case '-': a -= b; break;
+			case '*': a *= b; break;
+			case '/':
+			case '%':
+				if (b == 0)
+					pp_error(e->pos, "Division by zero in expression", "");
+				a = ops[level][i][0] == '/' ? a / b : a % b;
+				break;
+			}
+			break;
+		}
+	} while (found);
+
+	return a;
+}
+
+static intmax_t eval_cond(pp_expr_t *e)
+{
+	intmax_t c = eval_binary(e, 0), a, b;
+
+	if (!eval_op(e, "?"))
+		return c;
+	a = eval_cond(e);
+	if (!eval_op(e, ":"))
+		pp_error(e->pos, "Missing : in expression", "");
+	b = eval_cond(e);
+
+	return c ? a : b;
+}
+
+static int eval_if(cfgpp_t *pp, const char *p, const pp_pos_t *pos)
+{
+	strbuf_t sb = { 0 };
+	pp_expr_t e;
+	intmax_t v;
+
+	fail_push(fail_free, &sb.buf);
+	expand(pp, p, &sb, 1, pos);
+	e.p = sb.buf ? sb.buf : "";
+	e.pos = pos;
+	if (*skip_space(e.p) == 0)
+		pp_error(pos, "#if with no expression", "");
+	v = eval_cond(&e);
+	if (*skip_space(e.p))
+		pp_error(pos, "Invalid expression at ", e.p);
+	fail_pop(&sb.buf, 1);
+
+	return v != 0;
+}
+
+/*
+ * Evaluate an expression as #if does but without expanding any macro, the
+ * identifiers in it are 0. file and lineno are for the error messages.
+ */
+intmax_t cfgpp_eval(const char *expr, const char *file, int lineno)
+{
+	pp_pos_t pos = { file, lineno };
+	pp_expr_t e = { expr, &pos };
+	intmax_t v;
+
+	if (*skip_space(e.p) == 0)
+		pp_error(&pos, "Empty expression", "");
+	v = eval_cond(&e);
+	if (*skip_space(e.p))
+		pp_error(&pos, "Invalid expression at ", e.p);
+
+	return v;
+}
+
+/*
+ * Drop the comments of line, a block comment is replaced by a space.
+ * *in_comment tells whether the line starts in a block comment and is
+ * updated for the next one.
+ */
+static void strip_comments(char *line, int *in_comment)
+{
+	char *r = line, *w = line;
+
+	while (*r) {
+		if (*in_comment) {
+			if (r[0] == '*' && r[1] == '/') {
+				*in_comment = 0;
+				*w++ = ' ';
+				r += 2;
+			} else {
+				r++;
+			}
+		} else if (r[0] == '/' && r[1] == '*') {
+			*in_comment = 1;
+			r += 2;
+		} else if (r[0] == '/' && r[1] == '/') {
+			break;
+		} else {
+			*w++ = *r++;
+		}
+	}
+	*w = 0;
+}
+
+static void dep_add(cfgpp_t *pp, const char *path)
+{
+	int i;
+
+	for (i = 0; i < pp->dep_count; i++)
+		if (!strcmp(pp->deps[i], path))
+			return;
+
+	pp->deps = pp_alloc(pp->deps, (pp->dep_count + 1) * sizeof(char *));
+	pp->deps[pp->dep_count++] = pp_strndup(path, strlen(path));
+}
+
+/*
+ * Add a file to the files read by pp, when not NULL, and to the depfile.
+ * For the files read, and when a compiled table stands for them.
+ */
+void cfgpp_add_dep(cfgpp_t *pp, const char *path)
+{
+	if (pp)
+		dep_add(pp, path);
+
+	dep_add(pp_global(), path);
+}
+
+/* Open an #include: next to the file including it for "", then the -I dirs */
+static FILE *open_include(const char *name, int quoted, const char *from, char **path)
+{
+	const char *slash = strrchr(from, '/');
+	FILE *fp;
+	int i;
+
+	*path = NULL;
+	for (i = quoted ? -1 : 0; i < include_dir_count; i++) {
+		if (i < 0 && slash)
+			asprintf(path, "%.*s/%s", (int)(slash - from), from, name);
+		else if (i < 0)
+			*path = strdup(name);
+		else
+			asprintf(path, "%s/%s", include_dirs[i], name);
+		if (*path == NULL) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			fail_exit_with(FAIL_NOMEM);
+		}
+		fp = fopen(*path, "r");
+		if (fp)
+			return fp;
+		free(*path);
+		*path = NULL;
+	}
+
+	return NULL;
+}
+
+static void pp_file(cfgpp_t *pp, FILE *fp, const char *name, int depth,
+			cfgpp_line_fn fn, void *arg);
+
+static void do_include(cfgpp_t *pp, const char *p, const pp_pos_t *pos, int depth,
+			cfgpp_line_fn fn, void *arg)
+{
+	char close, *file, *path;
+	const char *end;
+	FILE *fp;
+
+	if (*p != '"' && *p != '<')
+		pp_error(pos, "Invalid #include ", p);
+	close = *p == '"' ? '"' : '>';
+	end = strchr(p + 1, close);
+	if (end == NULL)
+		pp_error(pos, "Invalid #include ", p);
+	if (depth >= PP_MAX_INCLUDE)
+		pp_error(pos, "#include nested too deeply ", p);
+
+	file = pp_strndup(p + 1, end - p - 1);
+	fail_push(fail_free, &file);
+	fp = open_include(file, close == '"', pos->file, &path);
+	if (fp == NULL)
+		pp_error(pos, "Can't find include file ", file);
+	fail_push(fail_free, &path);
+
+	pp_file(pp, fp, path, depth + 1, fn, arg);
+
+	fail_pop(&path, 1);
+	fail_pop(&file, 1);
+}
+
+/* State of a nested #if */
+typedef struct {
+	int active;		/* the lines are kept */
+	int taken;		/* a branch was kept already */
+	int in_else;
+} pp_cond_t;
+
+/* What a file holds while it is preprocessed */
+typedef struct {
+	FILE *fp;
+	char *line, *next;
+	strbuf_t out;
+} pp_open_t;
+
+static void pp_open_free(void *arg)
+{
+	pp_open_t *o = arg;
+
+	fclose(o->fp);
+	free(o->out.buf);
+	free(o->next);
+	free(o->line);
+}
+
+/* Preprocess the file open on fp, closed once read */
+static void pp_file(cfgpp_t *pp, FILE *fp, const char *name, int depth,
+			cfgpp_line_fn fn, void *arg)
+{
+	pp_cond_t cond[PP_MAX_COND];
+	int ncond = 0, active = 1, in_comment = 0;
+	pp_open_t f = { fp, NULL, NULL, { 0 } };
+	size_t size = 0, next_size = 0, len;
+	pp_pos_t pos = { name, 0 };
+	const char *p, *s, *dir;
+	int lineno = 0, dlen;
+
+	fail_push(pp_open_free, &f);
+	cfgpp_add_dep(pp, name);
+
+	while (getline(&f.line, &size, f.fp) > 0) {
+		pos.lineno = ++lineno;
+
+		/* join the lines ending with a backslash */
+		for (;;) {
+			len = strcspn(f.line, "\r\n");
+			f.line[len] = 0;
+			if (len == 0 || f.line[len - 1] != '\\')
+				break;
+			f.line[len - 1] = 0;
+			if (getline(&f.next, &next_size, f.fp) <= 0)
+				break;
+			lineno++;
+			f.line = pp_alloc(f.line, len + strlen(f.next) + 1);
+			size = len + strlen(f.next) + 1;
+			strcat(f.line, f.next);
+		}
+
+		strip_comments(f.line, &in_comment);
+		p = skip_space(f.line);
+
+		if (*p != '#') {
+			if (active) {
+				f.out.len = 0;
+				sb_add(&f.out, "", 0);
+				expand(pp, f.line, &f.out, 0, &pos);
+				fn(arg, f.out.buf, name, pos.lineno);
+			}
+			continue;
+		}
+
+		p = skip_space(p + 1);
+		for (dir = p; is_ident(*p); p++)
+			;
+		dlen = p - dir;
+		p = skip_space(p);
+
+#define IS_DIR(s) (dlen == (int)strlen(s) && !strncmp(dir, s, dlen))
+		if (IS_DIR("if") || IS_DIR("ifdef") || IS_DIR("ifndef")) {
+			if (ncond == PP_MAX_COND)
+				pp_error(&pos, "#if nested too deeply", "");
+			cond[ncond].active = active;
+			cond[ncond].in_else = 0;
+			if (!active) {
+				cond[ncond].taken = 1;
+			} else if (IS_DIR("if")) {
+				active = eval_if(pp, p, &pos);
+				cond[ncond].taken = active;
+			} else {
+				for (s = p; is_ident(*p); p++)
+					;
+				if (p == s)
+					pp_error(&pos, "Missing macro name", "");
+				active = (*macro_find(pp, s, p - s) != NULL) == IS_DIR("ifdef");
+				cond[ncond].taken = active;
+			}
+			ncond++;
+		} else if (IS_DIR("elif")) {
+			if (ncond == 0 || cond[ncond - 1].in_else)
+				pp_error(&pos, "#elif without #if", "");
+			if (cond[ncond - 1].taken) {
+				active = 0;
+			} else {
+				active = eval_if(pp, p, &pos);
+				cond[ncond - 1].taken = active;
+			}
+		} else if (IS_DIR("else")) {
+			if (ncond == 0 || cond[ncond - 1].in_else)
+				pp_error(&pos, "#else without #if", "");
+			cond[ncond - 1].in_else = 1;
+			active = !cond[ncond - 1].taken;
+			cond[ncond - 1].taken = 1;
+		} else if (IS_DIR("endif")) {
+			if (ncond == 0)
+				pp_error(&pos, "#endif without #if", "");
+			active = cond[--ncond].active;
+		} else if (!active) {
+			continue;
+		} else if (IS_DIR("define")) {
+			macro_define(pp, p, &pos);
+		} else if (IS_DIR("undef")) {
+			for (s = p; is_ident(*p); p++)
+				;
+			macro_undef(pp, s, p - s);
+		} else if (IS_DIR("include")) {
+			do_include(pp, p, &pos, depth, fn, arg);
+		} else if (IS_DIR("error")) {
+			pp_error(&pos, "#error ", p);
+		}
+		/* anything else (#pragma, # comments) is ignored */
+#undef IS_DIR
+	}
+
+	if (ncond)
+		pp_error(&pos, "Missing #endif", "");
+
+	fail_pop(&f, 1);
+}
+
+/* -D NAME or -D NAME=VALUE, NAME is 1 when there is no value */
+void cfgpp_define(const char *def)
+{
+	pp_pos_t pos = { "-D", 0 };
+	const char *eq = strchr(def, '=');
+	char *d;
+
+	if (eq == NULL) {
+		asprintf(&d, "%s 1", def);
+	} else {
+		asprintf(&d, "%.*s %s", (int)(eq - def), def, eq + 1);
+	}
+	if (d == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+	fail_push(fail_free, &d);
+	macro_define(pp_global(), d, &pos);
+	fail_pop(&d, 1);
+
+	sb_add(&options, "-D ", 3);
+	sb_add(&options, def, strlen(def));
+	sb_add(&options, "\n", 1);
+}
+
+/* -I dir, searched in order for the #include files */
+void cfgpp_include_dir(const char *dir)
+{
+	if (include_dir_count == PP_MAX_DIRS) {
+		fprintf(stderr, "Too many include directories, at most %d\n", PP_MAX_DIRS);
+		fail_exit_with(FAIL_USAGE);
+	}
+	include_dirs[include_dir_count++] = dir;
+
+	sb_add(&options, "-I ", 3);
+	sb_add(&options, dir, strlen(dir));
+	sb_add(&options, "\n", 1);
+}
+
+/* The -D and -I options given so far, one per line */
+const char *cfgpp_options(void)
+{
+	return options.buf ? options.buf : "";
+}
+
+/* The i-th file read by pp, NULL past the last one */
+const char *cfgpp_dep(const cfgpp_t *pp, int i)
+{
+	return i < pp->dep_count ? pp->deps[i] : NULL;
+}
+
+/* A new run, with the -D macros defined */
+cfgpp_t *cfgpp_new(void)
+{
+	cfgpp_t *pp = pp_alloc(NULL, sizeof(*pp));
+	const macro_t *m;
+	macro_t *c;
+	int i, j;
+
+	memset(pp, 0, sizeof(*pp));
+	for (i = 0; global && i < PP_HASH_SIZE; i++) {
+		for (m = global->macros[i]; m; m = m->next) {
+			c = pp_alloc(NULL, sizeof(*c));
+			*c = *m;
+			c->name = pp_strndup(m->name, strlen(m->name));
+			c->body = pp_strndup(m->body, strlen(m->body));
+			c->params = NULL;
+			if (m->nparams > 0)
+				c->params = pp_alloc(NULL, m->nparams * sizeof(char *));
+			for (j = 0; j < m->nparams; j++)
+				c->params[j] = pp_strndup(m->params[j], strlen(m->params[j]));
+			c->next = pp->macros[i];
+			pp->macros[i] = c;
+		}
+	}
+
+	return pp;
+}
+
+void cfgpp_free(cfgpp_t *pp)
+{
+	macro_t *m;
+	int i;
+
+	if (pp == NULL)
+		return;
+
+	for (i = 0; i < PP_HASH_SIZE; i++) {
+		while ((m = pp->macros[i]) != NULL) {
+			pp->macros[i] = m->next;
+			macro_free(m);
+		}
+	}
+	for (i = 0; i < pp->dep_count; i++)
+		free(pp->deps[i]);
+	free(pp->deps);
+	free(pp);
+}
+
+/*
+ * Preprocess the cfg file name in the run pp, fn gets every line left.
+ * The macros the file defines stay in pp.
+ */
+void cfgpp_run(cfgpp_t *pp, const char *name, cfgpp_line_fn fn, void *arg)
+{
+	FILE *fp;
+
+	fp = fopen(name, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: %s - Can't open DCD file\n", name);
+		fail_exit_with(FAIL_INPUT);
+	}
+
+	pp_file(pp, fp, name, 0, fn, arg);
+}
+
+/* Write the files read by all the runs as the dependencies of target, as gcc -MD -MP */
+void cfgpp_write_deps(const char *depfile, const char *target)
+{
+	cfgpp_t *g = pp_global();
+	FILE *fp;
+	int i;
+
+	fp = fopen(depfile, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: Can't open: %s\n", depfile, strerror(errno));
+		fail_exit_with(FAIL_OUTPUT);
+	}
+
+	fprintf(fp, "%s:", target);
+	for (i = 0; i < g->dep_count; i++)
+		fprintf(fp, " \\\n  %s", g->deps[i]);
+	fprintf(fp, "\n");
+
+	/* a header that goes away does not break the build */
+	for (i = 1; i < g->dep_count; i++)
+		fprintf(fp, "\n%s:\n", g->deps[i]);
+
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "%s: Write error: %s\n", depfile, strerror(errno));
+		fail_exit_with(FAIL_OUTPUT);
+	}
+}
+
+/* Forget the -D and -I options and the files read, for the next build */
+void cfgpp_reset(void)
+{
+	if (global) {
+		cfgpp_free(global);
+		global = NULL;
+	}
+
+	include_dir_count = 0;
+	free(options.buf);
+	memset(&options, 0, sizeof(options));
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Preprocessor of the DCD cfg files.
+ */
+
+#ifndef CFGPP_H
+#define CFGPP_H
+
+#include <stdint.h>
+
+/* called for every line of text left once the cfg file is preprocessed */
+typedef void (*cfgpp_line_fn)(void *arg, char *line, const char *file, int lineno);
+
+/* one run of the preprocessor: the macros defined and the files read */
+typedef struct cfgpp cfgpp_t;
+
+void cfgpp_define(const char *def);
+void cfgpp_include_dir(const char *dir);
+cfgpp_t *cfgpp_new(void);
+void cfgpp_free(cfgpp_t *pp);
+void cfgpp_run(cfgpp_t *pp, const char *name, cfgpp_line_fn fn, void *arg);
+void cfgpp_write_deps(const char *depfile, const char *target);
+void cfgpp_reset(void);
+void cfgpp_add_dep(cfgpp_t *pp, const char *path);
+const char *cfgpp_dep(const cfgpp_t *pp, int i);
+const char *cfgpp_options(void);
+intmax_t cfgpp_eval(const char *expr, const char *file, int lineno);
+
+#endif /* CFGPP_H */
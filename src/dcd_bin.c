@@ -0,0 +1,275 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Compiled DCD tables. The dcd_v2_t table parsed from a cfg file is saved
+ * with the name and SHA-256 of every file the preprocessor read for it,
+ * and of the -D and -I options. It is used again in place of the cfg file
+ * only while all of these are unchanged: from the cache directory when the
+ * cache is enabled, or from a file given to -dcd_bin (see -dcd-compile).
+ */
+
+#include "mkimage_common.h"
+
+#include <limits.h>
+#include <pthread.h>
+
+#define DCD_BIN_MAGIC		0x42444b4d /* "MKDB" */
+#define DCD_BIN_VERSION		1
+#define DCD_BIN_DIGEST_LEN	(HASH_TYPE_SHA_256 / 8)
+#define DCD_BIN_MAX_SRCS	256
+#define DCD_BIN_MAX_SIZE	(1 << 20)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t dcd_len;	/* table entries, as parse_cfg_file() returns */
+	uint32_t size;		/* bytes of the table, at the end of the file */
+	uint32_t src_count;	/* source files that follow */
+	uint32_t reserved;
+	uint8_t options[DCD_BIN_DIGEST_LEN];
+} dcd_bin_header_t;
+
+/* a source file, followed by its name and a terminating zero */
+typedef struct {
+	uint32_t name_len;
+	uint8_t digest[DCD_BIN_DIGEST_LEN];
+} dcd_bin_src_t;
+
+static void digest_str(const char *s, uint8_t *digest)
+{
+	sha2_ctx_t ctx;
+
+	sha2_init(&ctx, HASH_TYPE_SHA_256);
+	sha2_update(&ctx, s, strlen(s));
+	sha2_final(&ctx, digest);
+}
+
+/* SHA-256 of the content of a file, -1 when it can not be read */
+static int digest_file(const char *name, uint8_t *digest)
+{
+	sha2_ctx_t ctx;
+	uint8_t buf[4096];
+	ssize_t n;
+	int fd;
+
+	fd = open(name, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return -1;
+
+	sha2_init(&ctx, HASH_TYPE_SHA_256);
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		sha2_update(&ctx, buf, n);
+	close(fd);
+	if (n < 0)
+		return -1;
+
+	sha2_final(&ctx, digest);
+
+	return 0;
+}
+
+/*
+ * Load the compiled table in filename. options, when not NULL, must be the
+ * -D and -I options it was compiled with. Returns -1 when it can not be
+ * used, or exits with the reason when strict is set. The source files are
+ * added to the files read by pp and to the dependencies of the output.
+ */
+int dcd_bin_read(const char *filename, cfgpp_t *pp, dcd_v2_t *dcd_v2,
+			uint32_t *dcd_len, const char *options, bool strict)
+{
+	const char *srcs[DCD_BIN_MAX_SRCS];
+	uint8_t digest[DCD_BIN_DIGEST_LEN];
+	dcd_bin_header_t h;
+	dcd_bin_src_t src;
+	const ivt_header_t *ivt;
+	struct stat sbuf;
+	char *buf = NULL, *p, *end;
+	const char *err = NULL, *arg = "";
+	uint32_t i;
+	int fd, ret = -1;
+
+	fd = open(filename, O_RDONLY | O_BINARY);
+	if (fd < 0) {
+		err = "Can't open: ";
+		arg = strerror(errno);
+		goto out;
+	}
+	if (fstat(fd, &sbuf) < 0 || sbuf.st_size > DCD_BIN_MAX_SIZE ||
+	    (buf = malloc(sbuf.st_size)) == NULL ||
+	    read(fd, buf, sbuf.st_size) != sbuf.st_size) {
+		close(fd);
+		err = "Can't read the compiled DCD table";
+		goto out;
+	}
+	close(fd);
+	end = buf + sbuf.st_size;
+
+	err = "Not a compiled DCD table";
+	if (end - buf < (ssize_t) sizeof(h))
+		goto out;
+	memcpy(&h, buf, sizeof(h));
+	p = buf + sizeof(h);
+	if (h.magic != DCD_BIN_MAGIC || h.version != DCD_BIN_VERSION ||
+	    h.size < sizeof(ivt_header_t) || h.size > sizeof(dcd_v2_t) ||
+	    h.src_count > DCD_BIN_MAX_SRCS)
+		goto out;
+
+	if (options) {
+		digest_str(options, digest);
+		if (memcmp(digest, h.options, sizeof(digest))) {
+			err = "Compiled with other -D or -I options";
+			goto out;
+		}
+	}
+
+	for (i = 0; i < h.src_count; i++) {
+		if (end - p < (ssize_t) sizeof(src))
+			goto out;
+		memcpy(&src, p, sizeof(src));
+		p += sizeof(src);
+		if (src.name_len < 2 || src.name_len > PATH_MAX ||
+		    end - p < (ssize_t) src.name_len || p[src.name_len - 1])
+			goto out;
+		srcs[i] = p;
+		p += src.name_len;
+
+		if (digest_file(srcs[i], digest) < 0 ||
+		    memcmp(digest, src.digest, sizeof(digest))) {
+			err = "Stale compiled DCD table, changed since: ";
+			arg = srcs[i];
+			goto out;
+		}
+	}
+
+	ivt = (const ivt_header_t *) p;
+	if (end - p != h.size || ivt->tag != DCD_HEADER_TAG ||
+	    be16_to_cpu(ivt->length) != h.size)
+		goto out;
+
+	memset(dcd_v2, 0, sizeof(*dcd_v2));
+	memcpy(dcd_v2, p, h.size);
+	*dcd_len = h.dcd_len;
+
+	for (i = 0; i < h.src_count; i++)
+		cfgpp_add_dep(pp, srcs[i]);
+
+	err = NULL;
+	ret = 0;
+
+out:
+	/* arg may point into buf */
+	if (err && strict)
+		fprintf(stderr, "Error: %s - %s%s\n", filename, err, arg);
+	free(buf);
+	if (err && strict)
+		fail_exit();
+
+	return ret;
+}
+
+/*
+ * Save the table parsed in the run pp, with the files it was read from.
+ * Written to a temporary name and renamed, so a reader never sees half a
+ * table. Returns -1 on error.
+ */
+int dcd_bin_write(const char *filename, const cfgpp_t *pp,
+			const dcd_v2_t *dcd_v2, uint32_t dcd_len)
+{
+	dcd_bin_header_t h;
+	dcd_bin_src_t src;
+	char tmp[PATH_MAX + 32];
+	const char *name;
+	FILE *fp;
+	int i, ret = 0;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = DCD_BIN_MAGIC;
+	h.version = DCD_BIN_VERSION;
+	h.dcd_len = dcd_len;
+	h.size = be16_to_cpu(dcd_v2->header.length);
+	digest_str(cfgpp_options(), h.options);
+	for (i = 0; cfgpp_dep(pp, i); i++)
+		h.src_count++;
+
+	if (h.src_count > DCD_BIN_MAX_SRCS) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.%lx", filename, getpid(),
+		(unsigned long)pthread_self());
+	fp = fopen(tmp, "wb");
+	if (fp == NULL)
+		return -1;
+
+	if (fwrite(&h, sizeof(h), 1, fp) != 1)
+		ret = -1;
+	for (i = 0; ret == 0 && (name = cfgpp_dep(pp, i)) != NULL; i++) {
+		src.name_len = strlen(name) + 1;
+		if (digest_file(name, src.digest) < 0 ||
+		    fwrite(&src, sizeof(src), 1, fp) != 1 ||
+		    fwrite(name, src.name_len, 1, fp) != 1)
+			ret = -1;
+	}
+	if (ret == 0 && fwrite(dcd_v2, h.size, 1, fp) != 1)
+		ret = -1;
+
+	if (fclose(fp) != 0 || ret < 0 || rename(tmp, filename) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The cache entry of a cfg file, keyed by its path and the options */
+static int dcd_cache_path(char *path, size_t len, const char *cfg)
+{
+	const char *dir = hash_cache_dir();
+	char real[PATH_MAX];
+	uint8_t key[DCD_BIN_DIGEST_LEN];
+	sha2_ctx_t ctx;
+	int i, n;
+
+	if (dir == NULL || realpath(cfg, real) == NULL)
+		return -1;
+
+	sha2_init(&ctx, HASH_TYPE_SHA_256);
+	sha2_update(&ctx, real, strlen(real) + 1);
+	sha2_update(&ctx, cfgpp_options(), strlen(cfgpp_options()));
+	sha2_final(&ctx, key);
+
+	n = snprintf(path, len, "%s/dcd-", dir);
+	for (i = 0; i < 16; i++)
+		n += snprintf(path + n, len - n, "%02x", key[i]);
+
+	return 0;
+}
+
+/* Look up the table of a cfg file in the cache, returns -1 on a miss */
+int dcd_cache_lookup(const char *cfg, cfgpp_t *pp, dcd_v2_t *dcd_v2,
+			uint32_t *dcd_len)
+{
+	char path[PATH_MAX];
+
+	if (dcd_cache_path(path, sizeof(path), cfg) < 0 ||
+	    dcd_bin_read(path, pp, dcd_v2, dcd_len, cfgpp_options(), false) < 0)
+		return -1;
+
+	/* used, the least recently used entries go first (cache_prune()) */
+	utimensat(AT_FDCWD, path, NULL, 0);
+
+	return 0;
+}
+
+/* Record the table just parsed from a cfg file in the run pp */
+void dcd_cache_store(const char *cfg, const cfgpp_t *pp, const dcd_v2_t *dcd_v2,
+			uint32_t dcd_len)
+{
+	char path[PATH_MAX];
+
+	if (dcd_cache_path(path, sizeof(path), cfg) == 0)
+		dcd_bin_write(path, pp, dcd_v2, dcd_len);
+}
@@ -0,0 +1,286 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * DCD folding, for -dcd-fold. A write is only dropped when its register is
+ * given to -dcd-fold: the cfg files select a rank through DDR_PHY_RANKIDR
+ * before writing the registers of that rank, and write DDR_PHY_PIR twice
+ * in a row, the steps then the same value with INIT set, to start each
+ * PHY init step. Even a write to the same register as the one before it
+ * does something. The parser already puts the writes of a kind that are
+ * next to each other in one command, nothing else can be saved safely.
+ *
+ * The registers given to -dcd-fold are plain storage, that read back what
+ * was written with no side effect. Back to back writes to one of them are
+ * folded, and every write dropped is printed:
+ * - a DATA drops the write before it, it is overwritten,
+ * - a SET_BIT or CLR_BIT after a DATA becomes a DATA of the result,
+ * - two SET_BIT, or two CLR_BIT, become one with both masks.
+ *
+ * Check commands, and any command that is not a write, are kept as they
+ * are and nothing is folded across them: the bits they poll are changed
+ * by the hardware.
+ */
+
+#include "mkimage_common.h"
+
+typedef struct {
+	const struct dcd_v2_cmd *barrier;	/* command kept as it is */
+	uint8_t param;		/* DCD_WRITE_*_PARAM of a write */
+	uint32_t addr;
+	uint32_t value;
+} dcd_entry_t;
+
+typedef struct {
+	int count;
+	int size;
+	dcd_entry_t *e;
+} dcd_list_t;
+
+#define DCD_FOLD_MAX_REGS	64
+
+/* -dcd-fold: the registers whose back to back writes may be folded */
+static __thread uint32_t dcd_fold_regs[DCD_FOLD_MAX_REGS];
+static __thread int dcd_fold_count;
+
+/* -dcd-fold addr[,addr...], the registers are added to the ones given before */
+void dcd_fold_add(const char *list)
+{
+	char *s, *tok, *save, *end;
+	unsigned long v;
+
+	s = strdup(list);
+	if (s == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+	fail_push(fail_free, &s);
+
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		v = strtoul(tok, &end, 0);
+		if (*end || end == tok || v > UINT32_MAX) {
+			fprintf(stderr, "-dcd-fold: invalid register address %s\n", tok);
+			fail_exit_with(FAIL_USAGE);
+		}
+		if (dcd_fold_count == DCD_FOLD_MAX_REGS) {
+			fprintf(stderr, "-dcd-fold: too many registers, at most %d\n",
+				DCD_FOLD_MAX_REGS);
+			fail_exit_with(FAIL_USAGE);
+		}
+		dcd_fold_regs[dcd_fold_count++] = v;
+	}
+
+	fail_pop(&s, 1);
+}
+
+/* The registers given to -dcd-fold, their number is returned */
+int dcd_fold_list(const uint32_t **regs)
+{
+	*regs = dcd_fold_regs;
+
+	return dcd_fold_count;
+}
+
+/* No register is folded, for the next build */
+void dcd_fold_reset(void)
+{
+	dcd_fold_count = 0;
+}
+
+static int dcd_foldable(uint32_t addr)
+{
+	int i;
+
+	for (i = 0; i < dcd_fold_count; i++)
+		if (dcd_fold_regs[i] == addr)
+			return 1;
+
+	return 0;
+}
+
+static const char *dcd_write_name(uint8_t param)
+{
+	if (param == DCD_WRITE_SET_BIT_PARAM)
+		return "SET_BIT";
+	if (param == DCD_WRITE_CLR_BIT_PARAM)
+		return "CLR_BIT";
+
+	return "DATA";
+}
+
+static void dcd_list_add(dcd_list_t *l, const dcd_entry_t *e)
+{
+	if (l->count == l->size) {
+		l->size = l->size ? 2 * l->size : 64;
+		l->e = realloc(l->e, l->size * sizeof(*l->e));
+		if (l->e == NULL) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			fail_exit_with(FAIL_NOMEM);
+		}
+	}
+	l->e[l->count++] = *e;
+}
+
+/* Split the table in single writes and barriers, returns the commands */
+static int dcd_decode(const dcd_v2_t *dcd_v2, dcd_list_t *l)
+{
+	const uint8_t *p = (const uint8_t *) &dcd_v2->dcd_cmd;
+	const uint8_t *end = (const uint8_t *) dcd_v2 + be16_to_cpu(dcd_v2->header.length);
+	const struct dcd_v2_cmd *d;
+	dcd_entry_t e;
+	int i, n, len, cmds = 0;
+
+	for (; p < end; p += len, cmds++) {
+		d = (const struct dcd_v2_cmd *) p;
+		len = be16_to_cpu(d->write_dcd_command.length);
+		if (len < 4 || len > end - p) {
+			fprintf(stderr, "Error: DCD table is corrupted at offset 0x%x\n",
+				(unsigned int) (p - (const uint8_t *) dcd_v2));
+			fail_exit();
+		}
+
+		memset(&e, 0, sizeof(e));
+		if (d->write_dcd_command.tag != DCD_WRITE_DATA_COMMAND_TAG ||
+		    (d->write_dcd_command.param != DCD_WRITE_DATA_PARAM &&
+		     d->write_dcd_command.param != DCD_WRITE_CLR_BIT_PARAM &&
+		     d->write_dcd_command.param != DCD_WRITE_SET_BIT_PARAM)) {
+			e.barrier = d;
+			dcd_list_add(l, &e);
+			continue;
+		}
+
+		n = (len - 4) / 8;
+		e.param = d->write_dcd_command.param;
+		for (i = 0; i < n; i++) {
+			e.addr = be32_to_cpu(d->addr_data[i].addr);
+			e.value = be32_to_cpu(d->addr_data[i].value);
+			dcd_list_add(l, &e);
+		}
+	}
+
+	return cmds;
+}
+
+/*
+ * Combine w with the write just before it, prev, when both go to the same
+ * register of -dcd-fold. Returns 1 when w took the place of prev.
+ */
+static int dcd_combine(dcd_entry_t *prev, dcd_entry_t *w)
+{
+	dcd_entry_t was;
+
+	if (prev->barrier || prev->addr != w->addr || !dcd_foldable(w->addr))
+		return 0;
+	was = *w;
+
+	if (w->param == DCD_WRITE_DATA_PARAM) {
+		/* prev is overwritten */
+	} else if (prev->param == DCD_WRITE_DATA_PARAM) {
+		/* the value is known, a DATA of the result */
+		if (w->param == DCD_WRITE_SET_BIT_PARAM)
+			w->value = prev->value | w->value;
+		else
+			w->value = prev->value & ~w->value;
+		w->param = DCD_WRITE_DATA_PARAM;
+	} else if (prev->param == w->param) {
+		/* two SET_BIT or two CLR_BIT */
+		w->value |= prev->value;
+	} else {
+		return 0;
+	}
+
+	printf("DCD fold: %s 0x%08x 0x%08x and %s 0x%08x -> %s 0x%08x\n",
+		dcd_write_name(prev->param), prev->addr, prev->value,
+		dcd_write_name(was.param), was.value,
+		dcd_write_name(w->param), w->value);
+	*prev = *w;
+
+	return 1;
+}
+
+/* Write the table of the entries, the runs of writes of a kind in one command */
+static uint8_t *dcd_encode(uint8_t *p, const dcd_list_t *l, int *cmds)
+{
+	struct dcd_v2_cmd *d = NULL;
+	const dcd_entry_t *e;
+	int i, len, n = 0;
+
+	for (i = 0; i < l->count; i++) {
+		e = &l->e[i];
+		if (e->barrier) {
+			len = be16_to_cpu(e->barrier->write_dcd_command.length);
+			memcpy(p, e->barrier, len);
+			p += len;
+			d = NULL;
+			(*cmds)++;
+			continue;
+		}
+
+		if (d == NULL || d->write_dcd_command.param != e->param) {
+			d = (struct dcd_v2_cmd *) p;
+			d->write_dcd_command.tag = DCD_WRITE_DATA_COMMAND_TAG;
+			d->write_dcd_command.param = e->param;
+			d->write_dcd_command.length = cpu_to_be16(4);
+			p += 4;
+			n = 0;
+			(*cmds)++;
+		}
+		d->addr_data[n].addr = cpu_to_be32(e->addr);
+		d->addr_data[n++].value = cpu_to_be32(e->value);
+		d->write_dcd_command.length = cpu_to_be16(4 + 8 * n);
+		p += 8;
+	}
+
+	return p;
+}
+
+/*
+ * Fold the DCD table in place, as described above. dcd_len is the number
+ * of entries of the table, the new one is returned.
+ */
+uint32_t dcd_fold(dcd_v2_t *dcd_v2, uint32_t dcd_len)
+{
+	dcd_list_t l = { 0, 0, NULL };
+	ivt_header_t *hdr;
+	uint8_t *out, *p;
+	int i, n, old_cmds, new_cmds = 0;
+	uint32_t old_size, new_size, new_len = 0;
+
+	old_size = be16_to_cpu(dcd_v2->header.length);
+	fail_push(fail_free, &l.e);
+	old_cmds = dcd_decode(dcd_v2, &l);
+
+	/* fold the writes of the -dcd-fold registers into the one before */
+	for (i = 0, n = 0; i < l.count; i++)
+		if (n == 0 || l.e[i].barrier || !dcd_combine(&l.e[n - 1], &l.e[i]))
+			l.e[n++] = l.e[i];
+	l.count = n;
+
+	for (i = 0; i < l.count; i++)
+		new_len += l.e[i].barrier ?
+			(be16_to_cpu(l.e[i].barrier->write_dcd_command.length) - 4) / 8 : 1;
+
+	/* at worst every write gets a command of its own */
+	out = calloc(1, old_size + 4 * l.count);
+	if (out == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+	hdr = (ivt_header_t *) out;
+	*hdr = dcd_v2->header;
+	p = dcd_encode(out + sizeof(*hdr), &l, &new_cmds);
+	new_size = p - out;
+	hdr->length = cpu_to_be16(new_size);
+
+	memset(dcd_v2, 0, sizeof(*dcd_v2));
+	memcpy(dcd_v2, out, new_size);
+
+	printf("DCD fold: %d -> %d bytes, %d -> %d entries, %d -> %d commands\n",
+		old_size, new_size, dcd_len, new_len, old_cmds, new_cmds);
+
+	free(out);
+	fail_pop(&l.e, 1);
+
+	return new_len;
+}
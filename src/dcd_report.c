@@ -0,0 +1,256 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * DCD report, for -dcd-report: what the boot ROM will run from a DCD table
+ * and a rough estimate of the time it takes, to compare variants of a cfg
+ * file without flashing a board. The ROM time comes from a single cost
+ * model (time of a command header, of a write, of a read-modify-write for
+ * SET_BIT/CLR_BIT and of a poll of a check), which -dcd-cost overrides.
+ */
+
+#include "mkimage_common.h"
+
+#include <inttypes.h>
+
+typedef struct {
+	uint32_t header_ns;	/* decode one command */
+	uint32_t write_ns;	/* one DATA write */
+	uint32_t bit_ns;	/* one SET_BIT/CLR_BIT, a read then a write */
+	uint32_t poll_ns;	/* one read of a check */
+	uint32_t polls;		/* reads of a check without a count, assumed */
+} dcd_cost_t;
+
+/*
+ * The SCU ROM runs the DCD on both QX and QM, there are no figures of
+ * either. These are rough ones for an uncached ROM loop doing register
+ * accesses over the SCU bus, not measurements: good for comparing tables,
+ * set your own with -dcd-cost.
+ */
+static const dcd_cost_t dcd_cost_default = { 100, 60, 120, 80, 100 };
+
+static const struct {
+	const char *key;
+	size_t off;
+} dcd_cost_keys[] = {
+	{ "header", offsetof(dcd_cost_t, header_ns) },
+	{ "write", offsetof(dcd_cost_t, write_ns) },
+	{ "bit", offsetof(dcd_cost_t, bit_ns) },
+	{ "poll", offsetof(dcd_cost_t, poll_ns) },
+	{ "polls", offsetof(dcd_cost_t, polls) },
+};
+
+#define DCD_COST_KEYS		(sizeof(dcd_cost_keys) / sizeof(dcd_cost_keys[0]))
+#define COST_FIELD(c, i)	(*(uint32_t *) ((char *) (c) + dcd_cost_keys[i].off))
+
+/* the costs given to -dcd-cost, bit i of dcd_cost_set for dcd_cost_keys[i] */
+static __thread dcd_cost_t dcd_cost_override;
+static __thread int dcd_cost_set;
+
+/* Back to the default costs, for the next build */
+void dcd_report_reset(void)
+{
+	memset(&dcd_cost_override, 0, sizeof(dcd_cost_override));
+	dcd_cost_set = 0;
+}
+
+/* -dcd-cost header=ns,write=ns,bit=ns,poll=ns,polls=n, any of them */
+void dcd_report_cost(const char *spec)
+{
+	char *s, *tok, *save, *eq, *end;
+	unsigned long v;
+	size_t i;
+
+	s = strdup(spec);
+	if (s == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+	fail_push(fail_free, &s);
+
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		eq = strchr(tok, '=');
+		if (eq == NULL) {
+			fprintf(stderr, "-dcd-cost: %s is not key=value\n", tok);
+			fail_exit_with(FAIL_USAGE);
+		}
+		*eq = 0;
+		v = strtoul(eq + 1, &end, 0);
+		if (*end || eq[1] == 0 || v > UINT32_MAX) {
+			fprintf(stderr, "-dcd-cost: invalid %s value %s\n", tok, eq + 1);
+			fail_exit_with(FAIL_USAGE);
+		}
+		for (i = 0; i < DCD_COST_KEYS; i++)
+			if (!strcmp(tok, dcd_cost_keys[i].key))
+				break;
+		if (i == DCD_COST_KEYS) {
+			fprintf(stderr, "-dcd-cost: unknown cost %s, one of header, write, bit, poll, polls\n", tok);
+			fail_exit_with(FAIL_USAGE);
+		}
+		COST_FIELD(&dcd_cost_override, i) = v;
+		dcd_cost_set |= 1 << i;
+	}
+
+	fail_pop(&s, 1);
+}
+
+static const char *dcd_cmd_name(uint8_t tag, uint8_t param)
+{
+	if (tag == DCD_WRITE_DATA_COMMAND_TAG) {
+		switch (param) {
+		case DCD_WRITE_DATA_PARAM:
+			return "DATA";
+		case DCD_WRITE_CLR_BIT_PARAM:
+			return "CLR_BIT";
+		case DCD_WRITE_SET_BIT_PARAM:
+			return "SET_BIT";
+		}
+	} else if (tag == DCD_CHECK_DATA_COMMAND_TAG) {
+		switch (param) {
+		case DCD_CHECK_BITS_SET_PARAM:
+			return "CHECK_BITS_SET";
+		case DCD_CHECK_BITS_CLR_PARAM:
+			return "CHECK_BITS_CLR";
+		case DCD_CHECK_ANY_BIT_SET_PARAM:
+			return "CHECK_ANY_BIT_SET";
+		case DCD_CHECK_ANY_BIT_CLR_PARAM:
+			return "CHECK_ANY_BIT_CLR";
+		}
+	}
+
+	return NULL;
+}
+
+/* The command at *p, *p moves to the next one. NULL at the end */
+static const struct dcd_v2_cmd *dcd_next(const dcd_v2_t *dcd_v2, const uint8_t **p)
+{
+	const uint8_t *end = (const uint8_t *) dcd_v2 + be16_to_cpu(dcd_v2->header.length);
+	const struct dcd_v2_cmd *d = (const struct dcd_v2_cmd *) *p;
+	int len;
+
+	if (*p >= end)
+		return NULL;
+
+	len = be16_to_cpu(d->write_dcd_command.length);
+	if (len < 4 || len > end - *p) {
+		fprintf(stderr, "Error: DCD table is corrupted at offset 0x%x\n",
+			(unsigned int) (*p - (const uint8_t *) dcd_v2));
+		fail_exit();
+	}
+	*p += len;
+
+	return d;
+}
+
+/* The polls a check is limited to, 0 when it polls until it passes */
+static uint32_t dcd_check_count(const struct dcd_v2_cmd *d)
+{
+	if (be16_to_cpu(d->write_dcd_command.length) < 16)
+		return 0;
+
+	return be32_to_cpu(*(const uint32_t *) ((const uint8_t *) d + 12));
+}
+
+#define DCD_REPORT_KINDS	8
+
+/* Print the report of the DCD table parsed from name */
+void dcd_report(const dcd_v2_t *dcd_v2, uint32_t dcd_len, const char *name)
+{
+	const struct dcd_v2_cmd *d;
+	const uint8_t *p;
+	struct {
+		const char *name;
+		uint32_t cmds;
+		uint32_t entries;
+	} kinds[DCD_REPORT_KINDS];
+	dcd_cost_t cost = dcd_cost_default;
+	uint64_t header_ns, write_ns = 0, bit_ns = 0, poll_ns = 0, total_ns;
+	uint64_t worst_polls = 0;
+	uint32_t cmds = 0, checks = 0, unbounded = 0, count, n;
+	const char *kind;
+	int i, k, nkinds = 0;
+
+	for (i = 0; i < (int) DCD_COST_KEYS; i++)
+		if (dcd_cost_set & (1 << i))
+			COST_FIELD(&cost, i) = COST_FIELD(&dcd_cost_override, i);
+
+	p = (const uint8_t *) &dcd_v2->dcd_cmd;
+	while ((d = dcd_next(dcd_v2, &p)) != NULL) {
+		cmds++;
+		n = (be16_to_cpu(d->write_dcd_command.length) - 4) / 8;
+
+		kind = dcd_cmd_name(d->write_dcd_command.tag, d->write_dcd_command.param);
+		if (kind == NULL)
+			kind = "other";
+		for (k = 0; k < nkinds; k++)
+			if (!strcmp(kinds[k].name, kind))
+				break;
+		if (k == nkinds && nkinds < DCD_REPORT_KINDS) {
+			kinds[k].name = kind;
+			kinds[k].cmds = kinds[k].entries = 0;
+			nkinds++;
+		}
+		if (k < nkinds) {
+			kinds[k].cmds++;
+			kinds[k].entries += n;
+		}
+
+		if (d->write_dcd_command.tag == DCD_WRITE_DATA_COMMAND_TAG) {
+			if (d->write_dcd_command.param == DCD_WRITE_DATA_PARAM)
+				write_ns += (uint64_t) n * cost.write_ns;
+			else
+				bit_ns += (uint64_t) n * cost.bit_ns;
+		} else if (d->write_dcd_command.tag == DCD_CHECK_DATA_COMMAND_TAG && n) {
+			checks++;
+			count = dcd_check_count(d);
+			if (count == 0)
+				unbounded++;
+			worst_polls += count;
+			/* a check that is limited may give up before the assumed polls */
+			if (count == 0 || count > cost.polls)
+				count = cost.polls;
+			poll_ns += (uint64_t) count * cost.poll_ns;
+		}
+	}
+	header_ns = (uint64_t) cmds * cost.header_ns;
+	total_ns = header_ns + write_ns + bit_ns + poll_ns;
+
+	fprintf(stdout, "DCD report:\t%s\n", name);
+	fprintf(stdout, "  size:\t\t%d bytes, %u entries, %u commands\n",
+		be16_to_cpu(dcd_v2->header.length), dcd_len, cmds);
+	fprintf(stdout, "  commands:\n");
+	for (k = 0; k < nkinds; k++)
+		fprintf(stdout, "    %-18s %4u commands %4u entries\n",
+			kinds[k].name, kinds[k].cmds, kinds[k].entries);
+
+	fprintf(stdout, "  checks:\t%u\n", checks);
+	p = (const uint8_t *) &dcd_v2->dcd_cmd;
+	while ((d = dcd_next(dcd_v2, &p)) != NULL) {
+		if (d->write_dcd_command.tag != DCD_CHECK_DATA_COMMAND_TAG ||
+		    be16_to_cpu(d->write_dcd_command.length) < 12)
+			continue;
+		kind = dcd_cmd_name(d->write_dcd_command.tag, d->write_dcd_command.param);
+		fprintf(stdout, "    %-18s 0x%08x 0x%08x", kind ? kind : "other",
+			be32_to_cpu(d->addr_data[0].addr),
+			be32_to_cpu(d->addr_data[0].value));
+		count = dcd_check_count(d);
+		if (count)
+			fprintf(stdout, " at most %u polls\n", count);
+		else
+			fprintf(stdout, " no limit, polls until it passes\n");
+	}
+
+	if (unbounded)
+		fprintf(stdout, "  worst case:\t%u of %u checks poll without a limit\n",
+			unbounded, checks);
+	else
+		fprintf(stdout, "  worst case:\t%" PRIu64 " polls\n", worst_polls);
+
+	fprintf(stdout, "  cost model:\theader %u ns, write %u ns, bit write %u ns, poll %u ns, %u polls per check\n",
+		cost.header_ns, cost.write_ns, cost.bit_ns, cost.poll_ns, cost.polls);
+	fprintf(stdout, "  ROM time:\t%" PRIu64 ".%" PRIu64 " us (headers %" PRIu64
+		", writes %" PRIu64 ", bit writes %" PRIu64 ", polls %" PRIu64 " ns)\n",
+		total_ns / 1000, total_ns / 100 % 10,
+		header_ns, write_ns, bit_ns, poll_ns);
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Errors of a build. Every thread has its own target, set around the code
+ * that can fail: fail_exit() jumps back to it, or exits when none is set.
+ * What is allocated or opened between the two is pushed with fail_push()
+ * and popped once released, fail_exit() releases what is left before it
+ * jumps: a failed build of libmkimage leaves nothing behind.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fail.h"
+
+#define FAIL_CLEANUP_STEP	32
+
+struct fail_cleanup {
+	fail_cleanup_t fn;
+	void *arg;
+	jmp_buf *target;	/* the target it was pushed for */
+};
+
+static __thread jmp_buf *target;
+static __thread struct fail_cleanup *cleanups;
+static __thread int cleanup_count, cleanup_size;
+
+/* The stack goes away once empty, a thread that ends leaves nothing */
+static void fail_trim(void)
+{
+	if (cleanup_count == 0) {
+		free(cleanups);
+		cleanups = NULL;
+		cleanup_size = 0;
+	}
+}
+
+void fail_exit_with(int err)
+{
+	struct fail_cleanup *c;
+
+	if (target == NULL)
+		exit(EXIT_FAILURE);
+
+	/* the ones of an outer target are for it to run */
+	while (cleanup_count && cleanups[cleanup_count - 1].target == target) {
+		c = &cleanups[--cleanup_count];
+		c->fn(c->arg);
+	}
+	fail_trim();
+
+	longjmp(*target, err);
+}
+
+void fail_exit(void)
+{
+	fail_exit_with(FAIL_BUILD);
+}
+
+/* The target of this thread, to put back once the code it is set for is done */
+jmp_buf *fail_target(void)
+{
+	return target;
+}
+
+/* Jump to env on an error of this thread, exit when NULL */
+void fail_set_target(jmp_buf *env)
+{
+	target = env;
+}
+
+/*
+ * Call fn(arg) if the build fails before the matching fail_pop(), when
+ * fail_exit() jumps to the target set now. Nothing runs when it exits.
+ */
+void fail_push(fail_cleanup_t fn, void *arg)
+{
+	struct fail_cleanup *c;
+
+	if (cleanup_count == cleanup_size) {
+		c = realloc(cleanups, (cleanup_size + FAIL_CLEANUP_STEP) * sizeof(*c));
+		if (c == NULL) {
+			/* what it is for is released now, the build can not go on */
+			fn(arg);
+			fail_exit_with(FAIL_NOMEM);
+		}
+		cleanups = c;
+		cleanup_size += FAIL_CLEANUP_STEP;
+	}
+
+	cleanups[cleanup_count].fn = fn;
+	cleanups[cleanup_count].arg = arg;
+	cleanups[cleanup_count++].target = target;
+}
+
+/*
+ * Drop the last cleanup pushed for arg, once what it releases is released
+ * or handed over, after calling it when run is set.
+ */
+void fail_pop(void *arg, int run)
+{
+	struct fail_cleanup c;
+	int i;
+
+	for (i = cleanup_count - 1; i >= 0; i--)
+		if (cleanups[i].arg == arg)
+			break;
+	/* a bug, not an error of the build */
+	if (i < 0)
+		abort();
+
+	c = cleanups[i];
+	memmove(&cleanups[i], &cleanups[i + 1],
+		(cleanup_count - i - 1) * sizeof(*cleanups));
+	cleanup_count--;
+	fail_trim();
+
+	if (run)
+		c.fn(c.arg);
+}
+
+/* Cleanup of a pointer variable, pptr is its address: frees what it points to */
+void fail_free(void *pptr)
+{
+	void **p = pptr;
+
+	free(*p);
+	*p = NULL;
+}
+
+/* Cleanup of an fd variable, pfd is its address: closes it when open */
+void fail_close(void *pfd)
+{
+	int *fd = pfd;
+
+	if (*fd >= 0)
+		close(*fd);
+	*fd = -1;
+}
+
+/* Cleanup of a FILE * variable, pfp is its address: closes it when open */
+void fail_fclose(void *pfp)
+{
+	FILE **fp = pfp;
+
+	if (*fp)
+		fclose(*fp);
+	*fp = NULL;
+}
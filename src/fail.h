@@ -0,0 +1,36 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Leave a build on an error, once the message is printed. The tool exits,
+ * a build of libmkimage returns to the caller of mkimage_build().
+ */
+
+#ifndef FAIL_H
+#define FAIL_H
+
+#include <setjmp.h>
+
+/* what went wrong, mkimage_build() returns it negated (MKIMAGE_E*) */
+#define FAIL_BUILD	1	/* the build failed */
+#define FAIL_USAGE	2	/* invalid options */
+#define FAIL_NOMEM	3	/* out of memory */
+#define FAIL_INPUT	4	/* an input can not be read */
+#define FAIL_OUTPUT	5	/* an output can not be written */
+#define FAIL_NOTSUP	6	/* an option not available in libmkimage */
+
+/* undoes what was done before an error, see fail_push() */
+typedef void (*fail_cleanup_t)(void *arg);
+
+void fail_exit(void) __attribute__((noreturn));
+void fail_exit_with(int err) __attribute__((noreturn));
+jmp_buf *fail_target(void);
+void fail_set_target(jmp_buf *env);
+void fail_push(fail_cleanup_t fn, void *arg);
+void fail_pop(void *arg, int run);
+void fail_free(void *pptr);
+void fail_close(void *pfd);
+void fail_fclose(void *pfp);
+
+#endif /* FAIL_H */
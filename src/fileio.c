@@ -0,0 +1,365 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Copy file ranges without moving the data through user space when the
+ * host allows it: the extents are shared on file systems with reflinks
+ * (btrfs, XFS), else the kernel copies the data, and only as a last
+ * resort it goes through a buffer. Holes in the input and zero padding
+ * are left as holes in the output.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+#include "fileio.h"
+
+#define COPY_CHUNK_SIZE		(1 << 20)
+#define ZERO_CHUNK_SIZE		0x10000
+
+static const char zero_chunk[ZERO_CHUNK_SIZE];
+
+/* The reasons for the kernel to refuse a copy that another method may do */
+static int copy_unsupported(int err)
+{
+	return err == ENOSYS || err == EOPNOTSUPP || err == EXDEV ||
+		err == EINVAL || err == EBADF || err == ETXTBSY ||
+		err == EPERM;
+}
+
+static int copy_reflink(int ofd, off_t ooff, int ifd, off_t ioff, off_t len)
+{
+#ifdef FICLONERANGE
+	struct file_clone_range range;
+
+	range.src_fd = ifd;
+	range.src_offset = ioff;
+	range.src_length = len;
+	range.dest_offset = ooff;
+
+	/* offsets and length must be block aligned, the kernel checks it */
+	return ioctl(ofd, FICLONERANGE, &range);
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+static int pwrite_zeros(int fd, off_t off, off_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, zero_chunk, len < ZERO_CHUNK_SIZE ? len : ZERO_CHUNK_SIZE, off);
+		if (n <= 0)
+			return -1;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Make len bytes at off in fd read as zeros. The whole blocks become a
+ * hole, only the partial blocks at both ends are written. The file is
+ * extended to off + len when it is shorter, it is never truncated (the
+ * file size is not changed with ftruncate() when COPY_FD_SHARED is set).
+ * Returns 0 on success, -1 with errno set.
+ */
+int write_zeros(int fd, off_t off, off_t len, int flags)
+{
+	struct stat st;
+	off_t bs, start, end;
+
+	if (len <= 0)
+		return 0;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+
+	bs = st.st_blksize > 0 ? st.st_blksize : 4096;
+	start = (off + bs - 1) / bs * bs;
+	end = (off + len) / bs * bs;
+
+	if (end - start < bs || !S_ISREG(st.st_mode))
+		return pwrite_zeros(fd, off, len);
+
+	if (pwrite_zeros(fd, off, start - off) < 0 ||
+	    pwrite_zeros(fd, end, off + len - end) < 0)
+		return -1;
+
+	/* the file must still end with the zeros */
+	if (st.st_size < end && end == off + len) {
+		if (flags & COPY_FD_SHARED) {
+			/* another thread may have written further, no ftruncate() */
+			if (pwrite_zeros(fd, end - 1, 1) < 0)
+				return -1;
+			end -= bs;
+		} else if (ftruncate(fd, end) < 0) {
+			return -1;
+		}
+	}
+
+	/* past the former end of file it is a hole already */
+	if (start >= st.st_size || end <= start)
+		return 0;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      start, end - start) == 0)
+		return 0;
+#endif
+
+	return pwrite_zeros(fd, start, end - start);
+}
+
+/* Pass len zeros to feed, for the holes and padding of a copy */
+static void feed_zeros(copy_feed_t feed, void *arg, off_t len)
+{
+	off_t n;
+
+	for (; len > 0; len -= n) {
+		n = len < ZERO_CHUNK_SIZE ? len : ZERO_CHUNK_SIZE;
+		feed(arg, zero_chunk, n);
+	}
+}
+
+/*
+ * Pass the len bytes at ioff in ifd to feed() in order, for the ranges
+ * the kernel copied without them going through user space. A large range
+ * is dropped from the page cache behind the reads. Returns 0 on success,
+ * -1 with errno set.
+ */
+int feed_fd_range(int ifd, off_t ioff, off_t len, copy_feed_t feed, void *arg)
+{
+	int nocache = len >= STREAM_NOCACHE_SIZE;
+	char *buf;
+	ssize_t n;
+
+	if (len <= 0)
+		return 0;
+
+	buf = malloc(COPY_CHUNK_SIZE);
+	if (buf == NULL)
+		return -1;
+
+	while (len > 0) {
+		n = pread(ifd, buf, len < COPY_CHUNK_SIZE ? len : COPY_CHUNK_SIZE, ioff);
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO; /* input shorter than expected */
+			break;
+		}
+		feed(arg, buf, n);
+		if (nocache)
+			posix_fadvise(ifd, ioff, n, POSIX_FADV_DONTNEED);
+		ioff += n;
+		len -= n;
+	}
+
+	free(buf);
+
+	return len ? -1 : 0;
+}
+
+/*
+ * Copy a piece of data, the fastest way the host allows. With a feed, the
+ * bytes the kernel copied are read again for it, only the buffer copy
+ * passes them on its own reads.
+ */
+static int copy_fd_chunk(int ofd, off_t ooff, int ifd, off_t ioff, off_t len, int flags,
+		copy_feed_t feed, void *arg)
+{
+	off_t start = ioff;
+	char *buf;
+	ssize_t n;
+
+	if (len <= 0)
+		return 0;
+
+	if (copy_reflink(ofd, ooff, ifd, ioff, len) == 0) {
+		ioff += len;
+		len = 0;
+		goto fed;
+	}
+
+#ifdef __linux__
+	while (len > 0) {
+		n = copy_file_range(ifd, &ioff, ofd, &ooff, len, 0);
+		if (n <= 0)
+			break;
+		len -= n;
+	}
+	if (len == 0)
+		goto fed;
+	if (n < 0 && !copy_unsupported(errno))
+		return -1;
+
+	/* sendfile() writes at the file position of ofd */
+	if (!(flags & COPY_FD_SHARED) && lseek(ofd, ooff, SEEK_SET) == ooff) {
+		while (len > 0) {
+			n = sendfile(ofd, ifd, &ioff, len);
+			if (n <= 0)
+				break;
+			ooff += n;
+			len -= n;
+		}
+		if (len == 0)
+			goto fed;
+		if (n < 0 && !copy_unsupported(errno))
+			return -1;
+	}
+#endif
+
+fed:
+	/* what the kernel copied before it was done or gave up */
+	if (feed && feed_fd_range(ifd, start, ioff - start, feed, arg) < 0)
+		return -1;
+	if (len == 0)
+		return 0;
+
+	buf = malloc(COPY_CHUNK_SIZE);
+	if (buf == NULL)
+		return -1;
+
+	while (len > 0) {
+		n = pread(ifd, buf, len < COPY_CHUNK_SIZE ? len : COPY_CHUNK_SIZE, ioff);
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO; /* input shorter than expected */
+			break;
+		}
+		if (feed)
+			feed(arg, buf, n);
+		if (pwrite(ofd, buf, n, ooff) != n)
+			break;
+		ioff += n;
+		ooff += n;
+		len -= n;
+	}
+
+	free(buf);
+
+	return len ? -1 : 0;
+}
+
+/*
+ * Copy a data segment. A large one goes in STREAM_CHUNK_SIZE pieces: the
+ * input pages are dropped once copied and the output ones once written
+ * back, so a multi-GB image does not push everything else out of the
+ * page cache, and the write back of a piece runs while the next is read.
+ */
+static int copy_fd_data(int ofd, off_t ooff, int ifd, off_t ioff, off_t len, int flags,
+		copy_feed_t feed, void *arg)
+{
+	off_t n, prev = -1;
+
+	if (len < STREAM_NOCACHE_SIZE)
+		return copy_fd_chunk(ofd, ooff, ifd, ioff, len, flags, feed, arg);
+
+	posix_fadvise(ifd, ioff, len, POSIX_FADV_SEQUENTIAL);
+
+	while (len > 0) {
+		n = len < STREAM_CHUNK_SIZE ? len : STREAM_CHUNK_SIZE;
+		if (copy_fd_chunk(ofd, ooff, ifd, ioff, n, flags, feed, arg) < 0)
+			return -1;
+		posix_fadvise(ifd, ioff, n, POSIX_FADV_DONTNEED);
+#ifdef SYNC_FILE_RANGE_WRITE
+		/* start the write back of this piece, wait for the previous one */
+		sync_file_range(ofd, ooff, n, SYNC_FILE_RANGE_WRITE);
+		if (prev >= 0) {
+			sync_file_range(ofd, prev, STREAM_CHUNK_SIZE,
+					SYNC_FILE_RANGE_WAIT_BEFORE |
+					SYNC_FILE_RANGE_WRITE |
+					SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(ofd, prev, STREAM_CHUNK_SIZE, POSIX_FADV_DONTNEED);
+		}
+#endif
+		prev = ooff;
+		ioff += n;
+		ooff += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Copy the range keeping the holes of ifd, passed to feed as zeros */
+static int copy_fd_holes(int ofd, off_t ooff, int ifd, off_t ioff, off_t len, int flags,
+		copy_feed_t feed, void *arg)
+{
+	off_t end = ioff + len;
+	off_t data, hole;
+
+	if (len <= 0)
+		return 0;
+
+#ifdef SEEK_HOLE
+	hole = lseek(ifd, ioff, SEEK_HOLE);
+	if (hole >= 0 && hole < end) {
+		while (ioff < end) {
+			data = lseek(ifd, ioff, SEEK_DATA);
+			if (data < 0 || data > end)
+				data = end; /* ENXIO: only a hole up to the end of file */
+			if (data > ioff) {
+				if (write_zeros(ofd, ooff, data - ioff, flags) < 0)
+					return -1;
+				if (feed)
+					feed_zeros(feed, arg, data - ioff);
+				ooff += data - ioff;
+				ioff = data;
+			}
+			if (ioff == end)
+				break;
+
+			hole = lseek(ifd, ioff, SEEK_HOLE);
+			if (hole < 0 || hole > end)
+				hole = end;
+			if (copy_fd_data(ofd, ooff, ifd, ioff, hole - ioff, flags,
+					 feed, arg) < 0)
+				return -1;
+			ooff += hole - ioff;
+			ioff = hole;
+		}
+		return 0;
+	}
+#endif
+
+	return copy_fd_data(ofd, ooff, ifd, ioff, len, flags, feed, arg);
+}
+
+/*
+ * Copy len bytes at ioff in ifd to ooff in ofd, the holes of ifd are
+ * kept. Returns 0 on success, -1 with errno set when the data could not
+ * be read or written.
+ */
+int copy_fd_range(int ofd, off_t ooff, int ifd, off_t ioff, off_t len, int flags)
+{
+	return copy_fd_holes(ofd, ooff, ifd, ioff, len, flags, NULL, NULL);
+}
+
+/*
+ * Copy as copy_fd_range(), every byte of the range being passed to feed()
+ * in order, the holes as zeros. The bytes are passed as they are copied
+ * when the copy goes through a buffer, else they are read again once the
+ * kernel copied them (still in the page cache, unless the extents were
+ * shared). A NULL feed is a plain copy_fd_range().
+ */
+int copy_fd_range_feed(int ofd, off_t ooff, int ifd, off_t ioff, off_t len,
+		copy_feed_t feed, void *arg)
+{
+	return copy_fd_holes(ofd, ooff, ifd, ioff, len, 0, feed, arg);
+}
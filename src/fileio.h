@@ -0,0 +1,59 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * File copy helpers shared by the mkimage_imx8 tools.
+ */
+
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <sys/types.h>
+
+/* inputs from this size on are streamed without filling the page cache */
+#define STREAM_NOCACHE_SIZE	((off_t)256 << 20)
+#define STREAM_CHUNK_SIZE	((off_t)64 << 20)
+
+/* ofd is written by several threads, its file position can not be used */
+#define COPY_FD_SHARED		0x1
+
+/* receives the bytes of a copy_fd_range_feed() as they are copied */
+typedef void (*copy_feed_t)(void *arg, const void *buf, size_t len);
+
+typedef struct {
+	int ifd;
+	off_t ioff;
+	off_t ooff;
+	off_t len;
+	copy_feed_t feed;	/* NULL, or gets the bytes once they are copied */
+	void *feed_arg;
+} copy_range_t;
+
+/* queue depth of the io_uring copies, set by -io-uring, 0 to not use it */
+extern __thread unsigned int uring_depth;
+
+int copy_fd_range(int ofd, off_t ooff, int ifd, off_t ioff, off_t len, int flags);
+int copy_fd_range_feed(int ofd, off_t ooff, int ifd, off_t ioff, off_t len,
+		copy_feed_t feed, void *arg);
+int feed_fd_range(int ifd, off_t ioff, off_t len, copy_feed_t feed, void *arg);
+int write_zeros(int fd, off_t off, off_t len, int flags);
+int uring_copy_ranges(int ofd, const copy_range_t *r, int count, unsigned int depth);
+
+/* offset of the image in the output device, set by -out-offset, -1 if none */
+extern __thread off_t output_offset;
+
+/* set by -update, the output is patched in place instead of truncated */
+extern __thread int output_update;
+
+/* set to keep the image open after output_close(), see output_kept() */
+extern __thread int output_keep;
+
+int output_open(const char *name);
+int output_open_old(const char *name);
+void output_add_target(const char *name);
+void output_close(int fd, const char *name, unsigned int block);
+void output_reset(void);
+int output_kept(void);
+
+#endif /* FILEIO_H */
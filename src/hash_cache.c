@@ -0,0 +1,340 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * On-disk cache of image digests. An entry is keyed by the device,
+ * inode, size and mtime of the input file plus the padded length and
+ * the hash algorithm, so an input that was not touched since the last
+ * build is not hashed again. There is one file per entry, written to a
+ * temporary name and renamed, so concurrent builds can share a cache.
+ * When a build opens the cache, the least recently used entries are
+ * removed until the cache fits in -hash-cache-max.
+ */
+
+#include "mkimage_common.h"
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#define HASH_CACHE_MAGIC	0x43484b4d /* "MKHC" */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t hash_type;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t padded_len;
+	uint8_t digest[SHA2_MAX_DIGEST_LEN];
+} hash_cache_entry_t;
+
+/* per thread, as every setting of a build */
+static __thread char *cache_dir;
+static __thread int verify_percent;
+static __thread uint64_t verify_seed;
+
+/* Make path and its parents, the ones that exist are left as they are */
+void cache_mkdir(char *path)
+{
+	char *p;
+
+	for (p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		mkdir(path, 0755);
+		*p = '/';
+	}
+	mkdir(path, 0755);
+}
+
+/* A size in bytes, with an optional K, M or G suffix. Returns -1 when invalid */
+int cache_parse_size(const char *s, uint64_t *size)
+{
+	unsigned long long v;
+	char *end;
+
+	errno = 0;
+	v = strtoull(s, &end, 0);
+	if (errno || end == s || *s == '-')
+		return -1;
+	switch (*end) {
+	case 'G': case 'g':
+		v <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		v <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		v <<= 10;
+		end++;
+		break;
+	}
+	if (*end)
+		return -1;
+	*size = v;
+
+	return 0;
+}
+
+typedef struct {
+	char *name;
+	struct timespec used;
+	uint64_t size;
+} cache_file_t;
+
+static int cache_file_cmp(const void *a, const void *b)
+{
+	const cache_file_t *x = a, *y = b;
+
+	if (x->used.tv_sec != y->used.tv_sec)
+		return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+	if (x->used.tv_nsec != y->used.tv_nsec)
+		return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Remove the least recently used files of dir until the ones left take
+ * max bytes of disk at most. A file is used when it is written or found,
+ * its mtime is set then (cache_touch()). The sub-directories are left.
+ */
+void cache_prune(const char *dir, uint64_t max)
+{
+	cache_file_t *files = NULL, *f;
+	size_t count = 0, size = 0, i;
+	uint64_t total = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(dir);
+	if (d == NULL)
+		return;
+
+	while ((de = readdir(d)) != NULL) {
+		if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+		    !S_ISREG(st.st_mode))
+			continue;
+		if (count == size) {
+			size = size ? 2 * size : 256;
+			f = realloc(files, size * sizeof(*f));
+			if (f == NULL)
+				break;
+			files = f;
+		}
+		f = &files[count];
+		f->name = strdup(de->d_name);
+		if (f->name == NULL)
+			break;
+		f->used = st.st_mtim;
+		f->size = (uint64_t) st.st_blocks * 512;
+		total += f->size;
+		count++;
+	}
+
+	if (total > max) {
+		qsort(files, count, sizeof(*files), cache_file_cmp);
+		for (i = 0; i < count && total > max; i++)
+			if (unlinkat(dirfd(d), files[i].name, 0) == 0)
+				total -= files[i].size;
+	}
+
+	for (i = 0; i < count; i++)
+		free(files[i].name);
+	free(files);
+	closedir(d);
+}
+
+/* Mark the cache file open on fd as just used, for cache_prune() */
+void cache_touch(int fd)
+{
+	futimens(fd, NULL);
+}
+
+/*
+ * $XDG_CACHE_HOME/mkimage_imx8 (or ~/.cache/mkimage_imx8) followed by
+ * sub, allocated. NULL when there is no home.
+ */
+char *cache_default_dir(const char *sub)
+{
+	const char *base;
+	char *dir = NULL;
+
+	base = getenv("XDG_CACHE_HOME");
+	if (base && *base) {
+		if (asprintf(&dir, "%s/mkimage_imx8%s", base, sub) < 0)
+			dir = NULL;
+	} else if ((base = getenv("HOME")) != NULL) {
+		if (asprintf(&dir, "%s/.cache/mkimage_imx8%s", base, sub) < 0)
+			dir = NULL;
+	}
+
+	return dir;
+}
+
+/*
+ * Enable the cache in dir, or in $XDG_CACHE_HOME/mkimage_imx8 when dir
+ * is NULL, its entries taking max bytes at most. verify is the percentage
+ * of cache hits that are hashed again and compared with the cached digest.
+ */
+void hash_cache_init(const char *dir, int verify, uint64_t max)
+{
+	free(cache_dir);
+	cache_dir = dir ? strdup(dir) : cache_default_dir("");
+
+	if (cache_dir == NULL) {
+		fprintf(stderr, "Warning: no directory for the hash cache, not used\n");
+		return;
+	}
+
+	cache_mkdir(cache_dir);
+	cache_prune(cache_dir, max);
+
+	verify_percent = verify < 0 ? 0 : (verify > 100 ? 100 : verify);
+	verify_seed = (uint64_t)time(NULL) << 20 ^ getpid();
+}
+
+/* Disable the cache, for the next build */
+void hash_cache_reset(void)
+{
+	free(cache_dir);
+	cache_dir = NULL;
+	verify_percent = 0;
+}
+
+/* The settings of this thread's build, for the threads it starts */
+void hash_cache_share(hash_cache_conf_t *c)
+{
+	c->dir = cache_dir;
+	c->verify_percent = verify_percent;
+	c->verify_seed = verify_seed;
+}
+
+/* Use the settings of the build that started this thread, not to be reset */
+void hash_cache_adopt(const hash_cache_conf_t *c)
+{
+	cache_dir = (char *) c->dir;
+	verify_percent = c->verify_percent;
+	verify_seed = c->verify_seed;
+}
+
+/* The cache directory, NULL when the cache is not enabled */
+const char *hash_cache_dir(void)
+{
+	return cache_dir;
+}
+
+static void hash_cache_key(hash_cache_entry_t *e, const struct stat *st,
+			uint32_t padded_len, uint32_t hash_type)
+{
+	memset(e, 0, sizeof(*e));
+	e->magic = HASH_CACHE_MAGIC;
+	e->hash_type = hash_type;
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime_sec = st->st_mtim.tv_sec;
+	e->mtime_nsec = st->st_mtim.tv_nsec;
+	e->padded_len = padded_len;
+}
+
+static void hash_cache_path(char *path, size_t len, const hash_cache_entry_t *e)
+{
+	snprintf(path, len, "%s/%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRIx64 ".%09" PRId64 "-%" PRIx64 "-%u",
+		cache_dir, e->dev, e->ino, e->size, (uint64_t)e->mtime_sec,
+		e->mtime_nsec, e->padded_len, e->hash_type);
+}
+
+/*
+ * Look up the digest of the file described by st, padded with zeros to
+ * padded_len. Returns HASH_CACHE_HIT with the digest filled in,
+ * HASH_CACHE_VERIFY when the entry was picked to be checked (the digest
+ * is filled in too) or HASH_CACHE_MISS.
+ */
+int hash_cache_lookup(const struct stat *st, uint32_t padded_len,
+			uint32_t hash_type, uint8_t *digest)
+{
+	hash_cache_entry_t key, e;
+	char path[PATH_MAX];
+	uint64_t pick;
+	int fd, n;
+
+	if (cache_dir == NULL)
+		return HASH_CACHE_MISS;
+
+	hash_cache_key(&key, st, padded_len, hash_type);
+	hash_cache_path(path, sizeof(path), &key);
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return HASH_CACHE_MISS;
+	n = read(fd, &e, sizeof(e));
+
+	if (n != sizeof(e) ||
+	    memcmp(&e, &key, offsetof(hash_cache_entry_t, digest))) {
+		close(fd);
+		return HASH_CACHE_MISS;
+	}
+	cache_touch(fd);
+	close(fd);
+
+	memcpy(digest, e.digest, hash_type / 8);
+
+	/* splitmix64 of the key, a fresh sample of entries on every run */
+	pick = verify_seed ^ e.ino ^ ((uint64_t)e.mtime_nsec << 32) ^ e.size;
+	pick = (pick ^ (pick >> 30)) * 0xbf58476d1ce4e5b9ull;
+	pick = (pick ^ (pick >> 27)) * 0x94d049bb133111ebull;
+	pick ^= pick >> 31;
+	if ((int)(pick % 100) < verify_percent)
+		return HASH_CACHE_VERIFY;
+
+	return HASH_CACHE_HIT;
+}
+
+/*
+ * A file written in the last couple of seconds may still be changed
+ * without its mtime moving, its digest is not remembered yet.
+ */
+bool hash_cache_settled(const struct stat *st)
+{
+	return st->st_mtim.tv_sec + 2 < time(NULL);
+}
+
+/* Record the digest of the file described by st */
+void hash_cache_store(const struct stat *st, uint32_t padded_len,
+			uint32_t hash_type, const uint8_t *digest)
+{
+	hash_cache_entry_t e;
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 32];
+	int fd, n;
+
+	if (cache_dir == NULL)
+		return;
+
+	if (!hash_cache_settled(st))
+		return;
+
+	hash_cache_key(&e, st, padded_len, hash_type);
+	memcpy(e.digest, digest, hash_type / 8);
+	hash_cache_path(path, sizeof(path), &e);
+	snprintf(tmp, sizeof(tmp), "%s.%d.%lx", path, getpid(),
+		(unsigned long)pthread_self());
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (fd < 0)
+		return;
+	n = write(fd, &e, sizeof(e));
+	close(fd);
+
+	if (n != sizeof(e) || rename(tmp, path) < 0)
+		unlink(tmp);
+}
@@ -82,8 +82,9 @@ int build_container_qm(uint32_t sector_size, uint32_t ivt_offset, char* out_file
 	int file_off, ofd;
 
 	unsigned int dcd_len = 0;
-	static imx_header_v3_t imx_header;
+	static __thread imx_header_v3_t imx_header;
 	struct stat sbuf;
+	layout_t layout;
 	uint64_t tmp_to = 0; /*used for offset of memory to find images */
         uint32_t custom_partition = 0;/* 0 denotes defaults */
 
@@ -98,7 +99,7 @@ int build_container_qm(uint32_t sector_size, uint32_t ivt_offset, char* out_file
 
         if(image_stack == NULL) {
           fprintf(stderr, "Empty image stack ");
-          exit(EXIT_FAILURE);
+          fail_exit();
         }
 
 	fprintf(stdout, "Platform:\ti.MX8QM\n");
@@ -176,7 +177,7 @@ int build_container_qm(uint32_t sector_size, uint32_t ivt_offset, char* out_file
                         }
                         else{
                             fprintf(stderr, "Error: invalid m4 core id: %" PRIi64 "\n", img_sp->ext);
-                            exit(EXIT_FAILURE);
+                            fail_exit();
                         }
 
                         if(custom_partition != 0)
@@ -213,7 +214,7 @@ int build_container_qm(uint32_t sector_size, uint32_t ivt_offset, char* out_file
                         }
                         else {
                           fprintf(stderr, "Error: invalid AP core id: %" PRIi64 "\n", img_sp->ext);
-                          exit(EXIT_FAILURE);
+                          fail_exit();
                         }
                         imx_header.boot_data[container].img[cont_img_count].flags |= (SC_R_MU_0A << BOOT_IMG_FLAGS_MU_RID_SHIFT);
 
@@ -247,7 +248,7 @@ int build_container_qm(uint32_t sector_size, uint32_t ivt_offset, char* out_file
                         if (sbuf.st_size > CSF_DATA_SIZE) {
                              fprintf(stderr, "%s: file size %" PRIi64 " is larger than CSF_DATA_SIZE %d\n",
                                               img_sp->filename, sbuf.st_size, CSF_DATA_SIZE);
-                             exit(EXIT_FAILURE);
+                             fail_exit();
                         }
 
                         imx_header.boot_data[container].csf.src = file_off;
@@ -272,9 +273,11 @@ int build_container_qm(uint32_t sector_size, uint32_t ivt_offset, char* out_file
                 case PARTITION: /* keep custom partition until next executable image */
                         custom_partition = img_sp->entry;
                         break;
+                case HASH:
+                        break; /* image hashes are only in B0 containers */
                 default:
                         fprintf(stderr, "unrecognized option in input stack");
-                        exit(EXIT_FAILURE);
+                        fail_exit();
               }
               img_sp++;
         }
@@ -283,21 +286,11 @@ int build_container_qm(uint32_t sector_size, uint32_t ivt_offset, char* out_file
         container = -1;
         cont_img_count = 0;
 
-        /* Open output file */
-        ofd = open (out_file, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0666);
-        if (ofd < 0) {
-            fprintf(stderr, "%s: Can't open: %s\n",
-                                out_file, strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-
         /* Note: Image offset are not contained in the image */
 
-        /* Write image header */
-        if (write(ofd, &imx_header, sizeof(imx_header_v3_t)) != sizeof(imx_header_v3_t)) {
-            fprintf(stderr, "error writing image hdr\n");
-            exit(1);
-        }
+        /* Plan the output: image header first, then every image */
+        layout_init(&layout);
+        layout_add_mem(&layout, "image header", 0, &imx_header, sizeof(imx_header_v3_t), 0);
 
         if(emmc_fastboot)
           ivt_offset = 0;/*set ivt offset to 0 if emmc */
@@ -310,23 +303,37 @@ int build_container_qm(uint32_t sector_size, uint32_t ivt_offset, char* out_file
               img_sp->option == FLAG          ||
               img_sp->option == DEVICE        ||
               img_sp->option == NEW_CONTAINER ||
-              img_sp->option == PARTITION) {
+              img_sp->option == PARTITION     ||
+              img_sp->option == HASH) {
             img_sp++;
             continue;/* skip writing to the output file if not an image option */
           }
           if (img_sp->option == CSF){ /* only pad if its a CSF image */
-              copy_file(ofd, img_sp->filename, CSF_DATA_SIZE, img_sp->src - ivt_offset);
+              layout_add_file_padded(&layout, img_sp->filename, img_sp->src - ivt_offset, CSF_DATA_SIZE);
               cont_img_count++;
 
           }
           else {
-              copy_file(ofd, img_sp->filename, 0, img_sp->src - ivt_offset);
+              layout_add_file_padded(&layout, img_sp->filename, img_sp->src - ivt_offset, 0);
           }
           img_sp++;
         }
 
+        layout_check(&layout);
+
+        /* Open output file */
+        ofd = output_open(out_file);
+        if (ofd < 0) {
+            fprintf(stderr, "%s: Can't open: %s\n",
+                                out_file, strerror(errno));
+            fail_exit_with(FAIL_OUTPUT);
+        }
+
+        layout_emit(&layout, ofd);
+        layout_free(&layout);
+
         /* Close output file */
-        close(ofd);
+        output_close(ofd, out_file, sector_size);
 
         return 0;
 }
@@ -83,9 +83,10 @@ int build_container_qx(uint32_t sector_size, uint32_t ivt_offset, char* out_file
         int file_off,  ofd = -1;
         unsigned int dcd_len = 0;
 
-        static imx_header_v3_t imx_header;
+        static __thread imx_header_v3_t imx_header;
         image_t* img_sp = image_stack;
         struct stat sbuf;
+        layout_t layout;
         uint64_t tmp_to = 0; /* used for offset of memory to find images */
         uint32_t custom_partition = 0; /* 0 denotes default partition */
 
@@ -96,7 +97,7 @@ int build_container_qx(uint32_t sector_size, uint32_t ivt_offset, char* out_file
 
         if(image_stack == NULL) {
           fprintf(stderr, "Empty image stack ");
-          exit(EXIT_FAILURE);
+          fail_exit();
         }
 
         fprintf(stdout, "Platform:\ti.MX8QXP\n");
@@ -175,7 +176,7 @@ int build_container_qx(uint32_t sector_size, uint32_t ivt_offset, char* out_file
                         }
                         else{
                             fprintf(stderr, "Error: invalid m4 core id: %" PRIi64 "\n", img_sp->ext);
-                            exit(EXIT_FAILURE);
+                            fail_exit();
                         }
                         if(custom_partition != 0)
                         {
@@ -206,7 +207,7 @@ int build_container_qx(uint32_t sector_size, uint32_t ivt_offset, char* out_file
                         imx_header.boot_data[container].img[cont_img_count].flags1 = (img_sp->ext & BOOT_IMG_FLAGS_CORE_MASK);
                         if (img_sp->ext != CORE_CA35) {
                           fprintf(stderr, "Error: invalid AP core id: %" PRIi64 "\n", img_sp->ext);
-                          exit(EXIT_FAILURE);
+                          fail_exit();
                         }
                         imx_header.boot_data[container].img[cont_img_count].flags1 |= (SC_R_A35_0 << BOOT_IMG_FLAGS_CPU_RID_SHIFT);
                         imx_header.boot_data[container].img[cont_img_count].flags1 |= (SC_R_MU_0A << BOOT_IMG_FLAGS_MU_RID_SHIFT);
@@ -244,7 +245,7 @@ int build_container_qx(uint32_t sector_size, uint32_t ivt_offset, char* out_file
                         if (sbuf.st_size > CSF_DATA_SIZE) {
                              fprintf(stderr, "%s: file size %" PRIi64 " is larger than CSF_DATA_SIZE %d\n",
                                               img_sp->filename, sbuf.st_size, CSF_DATA_SIZE);
-                             exit(EXIT_FAILURE);
+                             fail_exit();
                         }
                         imx_header.boot_data[container].img[cont_img_count].src = file_off;
                         img_sp->src = file_off;
@@ -272,9 +273,11 @@ int build_container_qx(uint32_t sector_size, uint32_t ivt_offset, char* out_file
                         break;
                 case DCD:
                         break; /* skip DCD here because we already processed it */
+                case HASH:
+                        break; /* image hashes are only in B0 containers */
                 default:
                         fprintf(stderr, "unrecognized option in input stack");
-                        exit(EXIT_FAILURE);
+                        fail_exit();
               }
               img_sp++;/* advance index */
         }
@@ -282,21 +285,11 @@ int build_container_qx(uint32_t sector_size, uint32_t ivt_offset, char* out_file
         /* reset counters to write output file */
         container = 0;
         cont_img_count = 0;
-        /* Open output file */
-        ofd = open (out_file, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0666);
-        if (ofd < 0) {
-            fprintf(stderr, "%s: Can't open: %s\n",
-                                out_file, strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-
         /* Note: Image offset are not contained in the image */
 
-        /* Write image header */
-        if (write(ofd, &imx_header, sizeof(imx_header_v3_t)) != sizeof(imx_header_v3_t)) {
-            fprintf(stderr, "error writing image hdr\n");
-            exit(1);
-        }
+        /* Plan the output: image header first, then every image */
+        layout_init(&layout);
+        layout_add_mem(&layout, "image header", 0, &imx_header, sizeof(imx_header_v3_t), 0);
 
         if(emmc_fastboot)
           ivt_offset = 0;/*set ivt offset to 0 if emmc */
@@ -309,22 +302,36 @@ int build_container_qx(uint32_t sector_size, uint32_t ivt_offset, char* out_file
               img_sp->option == FLAG          ||
               img_sp->option == DEVICE        ||
               img_sp->option == NEW_CONTAINER ||
-              img_sp->option == PARTITION) {
+              img_sp->option == PARTITION     ||
+              img_sp->option == HASH) {
             img_sp++;
             continue;/* skip writing to the output file if not an image option */
           }
           if (img_sp->option == CSF){ /* only pad if its a CSF image */
-              copy_file(ofd, img_sp->filename, CSF_DATA_SIZE, img_sp->src - ivt_offset);
+              layout_add_file_padded(&layout, img_sp->filename, img_sp->src - ivt_offset, CSF_DATA_SIZE);
 
           }
           else {
-              copy_file(ofd, img_sp->filename, 0, img_sp->src - ivt_offset);
+              layout_add_file_padded(&layout, img_sp->filename, img_sp->src - ivt_offset, 0);
           }
           img_sp++;
         }
 
+        layout_check(&layout);
+
+        /* Open output file */
+        ofd = output_open(out_file);
+        if (ofd < 0) {
+            fprintf(stderr, "%s: Can't open: %s\n",
+                                out_file, strerror(errno));
+            fail_exit_with(FAIL_OUTPUT);
+        }
+
+        layout_emit(&layout, ofd);
+        layout_free(&layout);
+
 /* Close output file */
-        close(ofd);
+        output_close(ofd, out_file, sector_size);
         return 0;
 }
 
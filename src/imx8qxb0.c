@@ -9,7 +9,10 @@
 #include "mkimage_common.h"
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
 
 #define OCRAM_START						0x00100000
 #define OCRAM_END						0x00400000
@@ -17,6 +20,7 @@
 #define IV_MAX_LEN			32
 #define HASH_MAX_LEN			64
 #define MAX_NUM_IMGS			6
+#define HASH_CHUNK_SIZE			(1 << 20)
 #define MAX_NUM_SRK_RECORDS		4
 
 #define IVT_HEADER_TAG_B0		0x87
@@ -25,6 +29,8 @@
 #define IMG_FLAG_HASH_SHA256		0x000
 #define IMG_FLAG_HASH_SHA384		0x100
 #define IMG_FLAG_HASH_SHA512		0x200
+/* bits 8-9, bit 10 is the encrypted flag */
+#define IMG_FLAG_HASH_MASK		0x300
 
 #define IMG_FLAG_ENCRYPTED_MASK		0x400
 #define IMG_FLAG_ENCRYPTED_SHIFT	0x0A
@@ -35,10 +41,6 @@
 #define IMG_ARRAY_ENTRY_SIZE		128
 #define HEADER_IMG_ARRAY_OFFSET		0x10
 
-#define HASH_TYPE_SHA_256		256
-#define HASH_TYPE_SHA_384		384
-#define HASH_TYPE_SHA_512		512
-
 #define IMAGE_HASH_ALGO_DEFAULT		384
 #define IMAGE_PADDING_DEFAULT		0x1000
 
@@ -79,7 +81,7 @@
 
 #define CONTAINER_IMAGE_ARRAY_START_OFFSET	0x2000
 
-uint32_t scfw_flags = 0;
+__thread uint32_t scfw_flags = 0;
 
 typedef struct {
 	uint8_t version;
@@ -124,66 +126,57 @@ typedef struct {
 	dcd_v2_t dcd_table;
 }  __attribute__((packed)) imx_header_v3_t;
 
-uint32_t custom_partition = 0;
-
-static void copy_file_aligned (int ifd, const char *datafile, int offset, int align)
-{
-	int dfd;
-	struct stat sbuf;
-	unsigned char *ptr;
-	uint8_t zeros[0x4000];
-	int size;
-
-	if (align > 0x4000) {
-		fprintf (stderr, "Wrong alignment requested %d\n",
-			align);
-		exit (EXIT_FAILURE);
-	}
+__thread uint32_t custom_partition = 0;
 
-	memset(zeros, 0, sizeof(zeros));
-
-	if ((dfd = open(datafile, O_RDONLY|O_BINARY)) < 0) {
-		fprintf (stderr, "Can't open %s: %s\n",
-			datafile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
-
-	if (fstat(dfd, &sbuf) < 0) {
-		fprintf (stderr, "Can't stat %s: %s\n",
-			datafile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
+/* time spent hashing per algorithm, reported once the containers are built */
+typedef struct {
+	uint32_t images;
+	uint32_t cached;
+	uint64_t bytes;
+	uint64_t ns;
+} hash_stat_t;
 
-	if(sbuf.st_size == 0)
-		goto close;
+/* the ones of the build this thread hashes for */
+static __thread hash_stat_t *hash_stats;
+static pthread_mutex_t hash_stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	ptr = mmap(0, sbuf.st_size, PROT_READ, MAP_SHARED, dfd, 0);
-	if (ptr == MAP_FAILED) {
-		fprintf (stderr, "Can't read %s: %s\n",
-			datafile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
 
-	size = sbuf.st_size;
-	lseek(ifd, offset, SEEK_SET);
-	if (write(ifd, ptr, size) != size) {
-		fprintf (stderr, "Write error %s\n",
-			strerror(errno));
-		exit (EXIT_FAILURE);
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-	align = ALIGN(size, align) - size;
+static void hash_stats_add(uint32_t hash_type, uint32_t images, uint32_t cached,
+			uint64_t bytes, uint64_t ns)
+{
+	int i = hash_type == HASH_TYPE_SHA_256 ? 0 : (hash_type == HASH_TYPE_SHA_384 ? 1 : 2);
+
+	pthread_mutex_lock(&hash_stats_lock);
+	hash_stats[i].images += images;
+	hash_stats[i].cached += cached;
+	hash_stats[i].bytes += bytes;
+	hash_stats[i].ns += ns;
+	pthread_mutex_unlock(&hash_stats_lock);
+}
 
-	if (write(ifd, (char *)&zeros, align) != align) {
-		fprintf(stderr, "Write error: %s\n",
-			strerror(errno));
-		exit(EXIT_FAILURE);
+static void print_hash_stats(void)
+{
+	static const char * const names[] = { "sha256", "sha384", "sha512" };
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (!hash_stats[i].images)
+			continue;
+		fprintf(stdout, "HASH %s:\t%u images (%u cached), %" PRIu64 " bytes hashed in %.3f ms",
+			names[i], hash_stats[i].images, hash_stats[i].cached,
+			hash_stats[i].bytes, hash_stats[i].ns / 1e6);
+		if (hash_stats[i].ns)
+			fprintf(stdout, " (%.0f MB/s)",
+				hash_stats[i].bytes * 1e3 / hash_stats[i].ns);
+		fprintf(stdout, "\n");
 	}
-
-	(void) munmap((void *)ptr, sbuf.st_size);
-close:
-	(void) close (dfd);
-
 }
 
 static void set_imx_hdr_v3(imx_header_v3_t *imxhdr, uint32_t dcd_len,
@@ -196,20 +189,9 @@ static void set_imx_hdr_v3(imx_header_v3_t *imxhdr, uint32_t dcd_len,
 	fhdr_v3->version = IVT_VERSION_B0;
 }
 
-void set_image_hash(boot_img_t *img, char *filename, uint32_t hash_type)
+static void set_image_hash_type(boot_img_t *img, uint32_t hash_type)
 {
-	FILE *fp = NULL;
-	char sha_command[512];
-	char hash[2 * HASH_MAX_LEN + 1];
-
-	if (img->size == 0)
-		sprintf(sha_command, "sha%dsum /dev/null", hash_type);
-	else
-		sprintf(sha_command, "dd if=/dev/zero of=tmp_pad bs=%d count=1;\
-				dd if=\'%s\' of=tmp_pad conv=notrunc;\
-				sha%dsum tmp_pad; rm -f tmp_pad",
-			img->size, filename, hash_type);
-
+	img->hab_flags &= ~IMG_FLAG_HASH_MASK;
 	switch(hash_type) {
 	case HASH_TYPE_SHA_256:
 		img->hab_flags |= IMG_FLAG_HASH_SHA256;
@@ -223,27 +205,350 @@ void set_image_hash(boot_img_t *img, char *filename, uint32_t hash_type)
 	default:
 		fprintf(stderr, "Wrong hash type selected (%d) !!!\n\n",
 				hash_type);
-		exit(EXIT_FAILURE);
+		fail_exit();
 		break;
 	}
+}
+
+static uint32_t get_image_hash_type(boot_img_t *img)
+{
+	switch (img->hab_flags & IMG_FLAG_HASH_MASK) {
+	case IMG_FLAG_HASH_SHA256:
+		return HASH_TYPE_SHA_256;
+	case IMG_FLAG_HASH_SHA512:
+		return HASH_TYPE_SHA_512;
+	default:
+		return HASH_TYPE_SHA_384;
+	}
+}
+
+/*
+ * Hash size bytes of fd through a fixed size buffer, whatever the size of
+ * the file. The inputs too large to stay in the page cache are dropped
+ * from it behind the reads.
+ */
+static int read_file_chunks(int fd, const char *filename, off_t size, sha2_ctx_t *ctx)
+{
+	uint8_t *buf;
+	off_t pos;
+	ssize_t n;
+
+	buf = malloc(HASH_CHUNK_SIZE);
+	if (buf == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return -1;
+	}
+
+	posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+	for (pos = 0; pos < size; pos += n) {
+		n = pread(fd, buf, size - pos < HASH_CHUNK_SIZE ? size - pos : HASH_CHUNK_SIZE, pos);
+		if (n <= 0) {
+			fprintf(stderr, "Can't read %s: %s\n",
+				filename, n < 0 ? strerror(errno) : "file truncated");
+			free(buf);
+			return -1;
+		}
+		sha2_update(ctx, buf, n);
+		if (size >= STREAM_NOCACHE_SIZE)
+			posix_fadvise(fd, pos, n, POSIX_FADV_DONTNEED);
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+void set_image_hash(boot_img_t *img, char *filename, uint32_t hash_type)
+{
+	sha2_ctx_t ctx;
+	struct stat sbuf;
+	int dfd;
+
+	set_image_hash_type(img, hash_type);
 	memset(img->hash, 0, HASH_MAX_LEN);
 
-	fp = popen(sha_command, "r");
-	if (fp == NULL) {
-		fprintf(stderr, "Failed to run command hash\n" );
-		exit(EXIT_FAILURE);
+	sha2_init(&ctx, hash_type);
+
+	/*
+	 * The hash covers the image padded with zeros up to img->size,
+	 * an empty image gets the hash of an empty message.
+	 */
+	if (img->size != 0) {
+		dfd = open(filename, O_RDONLY | O_BINARY);
+		if (dfd < 0) {
+			fprintf(stderr, "Can't open %s: %s\n",
+				filename, strerror(errno));
+			fail_exit_with(FAIL_INPUT);
+		}
+
+		if (fstat(dfd, &sbuf) < 0) {
+			fprintf(stderr, "Can't stat %s: %s\n",
+				filename, strerror(errno));
+			close(dfd);
+			fail_exit_with(FAIL_INPUT);
+		}
+
+		if (read_file_chunks(dfd, filename, sbuf.st_size, &ctx) < 0) {
+			close(dfd);
+			fail_exit();
+		}
+
+		if (img->size > sbuf.st_size)
+			sha2_update_zero(&ctx, img->size - sbuf.st_size);
+
+		(void) close(dfd);
+	}
+
+	sha2_final(&ctx, img->hash);
+}
+
+/* Key of the image in the memo of a -batch, the same as in the hash cache */
+typedef struct {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t padded_len;
+	uint32_t hash_type;
+} hash_memo_key_t;
+
+typedef struct {
+	boot_img_t *img;	/* header entry receiving the hash */
+	const image_t *image;
+	int keep;		/* -update: the output holds the image already */
+	int stream;		/* hashed while it is copied to the output */
+	sha2_ctx_t ctx;		/* stream: the hash so far */
+	uint64_t fed;		/* stream: bytes hashed */
+	uint64_t ns;		/* stream: time spent hashing */
+	struct stat st;		/* the input before it was read */
+	bool cacheable;
+	int cache;
+	hash_memo_key_t key;
+	uint8_t cached[HASH_MAX_LEN];
+} hash_job_t;
+
+/* Keep the digest just computed for the next builds */
+static void hash_image_store(hash_job_t *job)
+{
+	uint32_t hash_type = get_image_hash_type(job->img);
+	const char *filename = job->image->filename;
+	struct stat after;
+
+	if (job->cache == HASH_CACHE_VERIFY && memcmp(job->cached, job->img->hash, hash_type / 8))
+		fprintf(stderr, "Warning: stale hash cache entry for %s, replaced\n",
+			filename);
+
+	/* the file must not have changed while it was read */
+	if (job->cacheable && stat(filename, &after) == 0 &&
+	    after.st_size == job->st.st_size &&
+	    after.st_mtim.tv_sec == job->st.st_mtim.tv_sec &&
+	    after.st_mtim.tv_nsec == job->st.st_mtim.tv_nsec) {
+		hash_cache_store(&job->st, job->img->size, hash_type, job->img->hash);
+		batch_memo_put(BATCH_MEMO_HASH, &job->key, sizeof(job->key),
+			       batch_memo_lasting && !hash_cache_settled(&job->st) ?
+			       NULL : job->img->hash, hash_type / 8);
+	} else if (job->cacheable) {
+		batch_memo_put(BATCH_MEMO_HASH, &job->key, sizeof(job->key), NULL, 0);
 	}
+}
+
+/*
+ * Compute the hash of the image, it covers the image padded with zeros
+ * up to img->size. An unchanged input keeps its digest from a previous
+ * build when the hash cache is enabled, and from another build of the
+ * same -batch. With stream set, an input too large for the page cache
+ * is not read here but hashed while it is copied to the output, see
+ * hash_image_finish(): it is read from the disk once.
+ */
+static void hash_image(hash_job_t *job, int stream)
+{
+	boot_img_t *img = job->img;
+	const image_t *image_stack = job->image;
+	uint32_t hash_type = get_image_hash_type(img);
+	hash_memo_key_t *key = &job->key;
+	uint64_t start;
+
+	job->cache = HASH_CACHE_MISS;
+	job->cacheable = img->size && stat(image_stack->filename, &job->st) == 0;
+	if (job->cacheable) {
+		memset(key, 0, sizeof(*key));
+		key->dev = job->st.st_dev;
+		key->ino = job->st.st_ino;
+		key->size = job->st.st_size;
+		key->mtime_sec = job->st.st_mtim.tv_sec;
+		key->mtime_nsec = job->st.st_mtim.tv_nsec;
+		key->padded_len = img->size;
+		key->hash_type = hash_type;
+		if (batch_memo_get(BATCH_MEMO_HASH, key, sizeof(*key), job->cached,
+				   sizeof(job->cached)) == (int) hash_type / 8)
+			job->cache = HASH_CACHE_HIT;
+		else
+			job->cache = hash_cache_lookup(&job->st, img->size, hash_type,
+						       job->cached);
+	}
+
+	if (job->cache == HASH_CACHE_HIT) {
+		memset(img->hash, 0, HASH_MAX_LEN);
+		memcpy(img->hash, job->cached, hash_type / 8);
+		hash_stats_add(hash_type, 1, 1, 0, 0);
+		if (job->cacheable)
+			batch_memo_put(BATCH_MEMO_HASH, key, sizeof(*key), img->hash,
+				       hash_type / 8);
+		return;
+	}
+
+	if (stream && job->cacheable && job->st.st_size >= STREAM_NOCACHE_SIZE) {
+		/*
+		 * Not hashed before the copy: a job of the same input waiting
+		 * on the slot meanwhile would wait for this one forever
+		 */
+		batch_memo_put(BATCH_MEMO_HASH, key, sizeof(*key), NULL, 0);
+		set_image_hash_type(img, hash_type);
+		memset(img->hash, 0, HASH_MAX_LEN);
+		sha2_init(&job->ctx, hash_type);
+		job->stream = 1;
+		return;
+	}
+
+	start = now_ns();
+	set_image_hash(img, image_stack->filename, hash_type);
+	hash_stats_add(hash_type, 1, 0, img->size, now_ns() - start);
+
+	hash_image_store(job);
+}
+
+/* The bytes of a streamed image, as layout_emit() copies them */
+static void hash_image_feed(void *arg, const void *buf, size_t len)
+{
+	hash_job_t *job = arg;
+	uint64_t start = now_ns();
+
+	sha2_update(&job->ctx, buf, len);
+	job->fed += len;
+	job->ns += now_ns() - start;
+}
+
+/* Complete the hash of a streamed image once it is in the output */
+static void hash_image_finish(hash_job_t *job)
+{
+	boot_img_t *img = job->img;
+	uint32_t hash_type = get_image_hash_type(img);
+	uint8_t memo[HASH_MAX_LEN];
+	uint64_t start = now_ns();
 
-	if(fgets(hash, hash_type / 4 + 1, fp) == NULL) {
-		fprintf(stderr, "Failed to hash file: %s\n", filename);
-		exit(EXIT_FAILURE);
+	if (img->size > job->fed)
+		sha2_update_zero(&job->ctx, img->size - job->fed);
+	sha2_final(&job->ctx, img->hash);
+	hash_stats_add(hash_type, 1, 0, img->size, job->ns + now_ns() - start);
+
+	/* claim the slot given up in hash_image() again, to publish the digest */
+	batch_memo_get(BATCH_MEMO_HASH, &job->key, sizeof(job->key), memo, sizeof(memo));
+
+	hash_image_store(job);
+}
+
+typedef struct {
+	hash_job_t *jobs;
+	int count;
+	int stream;		/* leave the large images to the copy */
+	hash_stat_t *stats;
+	hash_cache_conf_t cache;	/* the settings of the build */
+	int next;
+	int failed;		/* the error a worker stopped on */
+	pthread_mutex_t lock;
+} hash_pool_t;
+
+static void *hash_worker(void *arg)
+{
+	hash_pool_t *pool = arg;
+	jmp_buf env, *prev = fail_target();
+	hash_job_t *job;
+	int i, err;
+
+	/* the state of a build is per thread, this one works for the pool's */
+	hash_stats = pool->stats;
+	hash_cache_adopt(&pool->cache);
+
+	/* the error is for the thread that started the pool, once they are done */
+	if ((err = setjmp(env)) != 0) {
+		fail_set_target(prev);
+		pthread_mutex_lock(&pool->lock);
+		pool->failed = err;
+		pool->next = pool->count;
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
 	}
+	fail_set_target(&env);
 
-	for(int i = 0; i < strlen(hash)/2; i++){
-		sscanf(hash + 2*i, "%02hhx", &img->hash[i]);
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (i >= pool->count)
+			break;
+
+		job = &pool->jobs[i];
+		hash_image(job, pool->stream);
 	}
+	fail_set_target(prev);
+
+	return NULL;
+}
+
+static int hash_job_cmp(const void *a, const void *b)
+{
+	const hash_job_t *ja = a, *jb = b;
+
+	/* biggest images first, they bound the total time */
+	if (ja->img->size != jb->img->size)
+		return ja->img->size < jb->img->size ? 1 : -1;
 
-	pclose(fp);
+	return ja->image < jb->image ? -1 : 1;
+}
+
+/*
+ * Hash the images on all the CPUs. Every hash goes to its own header
+ * entry, so the output does not depend on the order the workers finish in.
+ * With stream set the large images are hashed when they are copied.
+ */
+static void hash_images_parallel(hash_job_t *jobs, int count, int stream)
+{
+	pthread_t threads[IMG_STACK_SIZE];
+	hash_pool_t pool;
+	long ncpu;
+	int nthreads, i;
+
+	qsort(jobs, count, sizeof(*jobs), hash_job_cmp);
+
+	pool.jobs = jobs;
+	pool.count = count;
+	pool.stream = stream;
+	pool.stats = hash_stats;
+	hash_cache_share(&pool.cache);
+	pool.next = 0;
+	pool.failed = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu < count ? ncpu : count;
+
+	/* the calling thread is a worker too */
+	for (i = 0; i < nthreads - 1; i++)
+		if (pthread_create(&threads[i], NULL, hash_worker, &pool) != 0)
+			break;
+	nthreads = i;
+
+	hash_worker(&pool);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&pool.lock);
+	if (pool.failed)
+		fail_exit_with(pool.failed);
 }
 
 #define append(p, s, l) do {memcpy(p, (uint8_t *)s, l); p += l; } while (0)
@@ -278,7 +583,7 @@ uint8_t *flatten_container_header(imx_header_v3_t *imx_header,
 	flat = calloc(size, sizeof(uint8_t));
 	if (!flat) {
 		fprintf(stderr, "Failed to allocate memory (%d)\n", size);
-		exit(EXIT_FAILURE);
+		fail_exit_with(FAIL_NOMEM);
 	}
 
 	ptr = flat;
@@ -310,41 +615,56 @@ uint8_t *flatten_container_header(imx_header_v3_t *imx_header,
 	return flat;
 }
 
+/*
+ * Copy the image digests into a header flattened before some of them were
+ * known, the hash is the only field that changed since.
+ */
+static void flat_header_set_hashes(imx_header_v3_t *imx_header, int containers,
+				   uint8_t *flat)
+{
+	flash_header_v3_t *fhdr;
+	uint32_t pos = 0;
+	int i, j;
+
+	for (i = 0; i < containers; i++) {
+		fhdr = &imx_header->fhdr[i];
+		for (j = 0; j < fhdr->num_images; j++)
+			memcpy(flat + pos + HEADER_IMG_ARRAY_OFFSET + j * sizeof(boot_img_t) +
+			       offsetof(boot_img_t, hash), fhdr->img[j].hash, HASH_MAX_LEN);
+		pos += ALIGN(fhdr->length, fhdr->padding);
+	}
+}
+
 uint64_t read_dcd_offset(char *filename)
 {
 	int dfd;
-	struct stat sbuf;
-	uint8_t *ptr;
-	uint64_t offset = 0;
+	uint32_t offset = 0;
 
 	dfd = open(filename, O_RDONLY|O_BINARY);
 	if (dfd < 0) {
 		fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
-		exit(EXIT_FAILURE);
+		fail_exit_with(FAIL_INPUT);
 	}
 
-	if (fstat(dfd, &sbuf) < 0) {
-		fprintf(stderr, "Can't stat %s: %s\n", filename, strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-
-	ptr = mmap(0, sbuf.st_size, PROT_READ, MAP_SHARED, dfd, 0);
-	if (ptr == MAP_FAILED) {
+	if (pread(dfd, &offset, sizeof(offset), DCD_ENTRY_ADDR_IN_SCFW) != sizeof(offset)) {
 		fprintf(stderr, "Can't read %s: %s\n", filename, strerror(errno));
-		exit(EXIT_FAILURE);
+		close(dfd);
+		fail_exit_with(FAIL_INPUT);
 	}
 
-	offset = *(uint32_t *)(ptr + DCD_ENTRY_ADDR_IN_SCFW);
-
-	(void) munmap((void *)ptr, sbuf.st_size);
 	(void) close(dfd);
 
 	return offset;
 }
 
-void set_image_array_entry(flash_header_v3_t *container, soc_type_t soc,
+/*
+ * Fill the next image array entry of the container. The image hash is
+ * only computed later, once all the images are known, the returned entry
+ * is the one to hash.
+ */
+boot_img_t *set_image_array_entry(flash_header_v3_t *container, soc_type_t soc,
 		const image_t *image_stack, uint32_t offset,
-		uint32_t size, char *tmp_filename, bool dcd_skip)
+		uint32_t size, char *tmp_filename, bool dcd_skip, uint32_t hash_type)
 {
 	uint64_t entry = image_stack->entry;
 	uint64_t core = image_stack->ext;
@@ -352,12 +672,13 @@ void set_image_array_entry(flash_header_v3_t *container, soc_type_t soc,
 	char *tmp_name = "";
 	option_type_t type = image_stack->option;
 	boot_img_t *img = &container->img[container->num_images];
+	boot_img_t *ret = img;
 
 
 	img->offset = offset;  /* Is re-adjusted later */
 	img->size = size;
 
-	set_image_hash(img, tmp_filename, IMAGE_HASH_ALGO_DEFAULT);
+	set_image_hash_type(img, hash_type);
 
 	switch(type) {
 	case SECO:
@@ -376,7 +697,7 @@ void set_image_array_entry(flash_header_v3_t *container, soc_type_t soc,
 			meta = IMAGE_A72_DEFAULT_META(custom_partition);
 		else {
 			fprintf(stderr, "Error: invalid AP core id: %" PRIi64 "\n", core);
-			exit(EXIT_FAILURE);
+			fail_exit();
 		}
 		img->hab_flags |= IMG_TYPE_EXEC;
 		img->hab_flags |= CORE_CA53 << BOOT_IMG_FLAGS_CORE_SHIFT; /* On B0, only core id = 4 is valid */
@@ -395,7 +716,7 @@ void set_image_array_entry(flash_header_v3_t *container, soc_type_t soc,
 			meta = IMAGE_M4_1_DEFAULT_META(custom_partition);
 		} else {
 			fprintf(stderr, "Error: invalid m4 core id: %" PRIi64 "\n", core);
-			exit(EXIT_FAILURE);
+			fail_exit();
 		}
 		img->hab_flags |= IMG_TYPE_EXEC;
 		img->hab_flags |= core << BOOT_IMG_FLAGS_CORE_SHIFT;
@@ -436,7 +757,7 @@ void set_image_array_entry(flash_header_v3_t *container, soc_type_t soc,
 			img = &container->img[container->num_images];
 			img->hab_flags |= IMG_TYPE_DCD_DDR;
 			img->hab_flags |= CORE_SC << BOOT_IMG_FLAGS_CORE_SHIFT;
-			set_image_hash(img, "/dev/null", IMAGE_HASH_ALGO_DEFAULT);
+			set_image_hash(img, "/dev/null", hash_type);
 			img->offset = offset + img->size;
 			img->entry = read_dcd_offset(tmp_filename);
 			img->dst = img->entry - 1;
@@ -444,12 +765,14 @@ void set_image_array_entry(flash_header_v3_t *container, soc_type_t soc,
 		break;
 	default:
 		fprintf(stderr, "unrecognized image type (%d)\n", type);
-		exit(EXIT_FAILURE);
+		fail_exit();
 	}
 
 	fprintf(stdout, "%s file_offset = 0x%x size = 0x%x\n", tmp_name, offset, size);
 
 	container->num_images++;
+
+	return ret;
 }
 
 void set_container(flash_header_v3_t *container,  uint16_t sw_version,
@@ -464,11 +787,23 @@ void set_container(flash_header_v3_t *container,  uint16_t sw_version,
 	printf("flags: 0x%x\n", container->flags);
 }
 
-int get_container_image_start_pos(image_t *image_stack, uint32_t align)
+/* The image array entries keep the offset and size of an image in 32 bits */
+static void check_image_range(const char *filename, uint64_t offset, uint64_t size)
+{
+	if (offset + size > UINT32_MAX) {
+		fprintf(stderr, "%s: image at offset 0x%" PRIx64 " size 0x%" PRIx64
+			" does not fit in the 4 GB a container can address\n",
+			filename, offset, size);
+		fail_exit();
+	}
+}
+
+uint64_t get_container_image_start_pos(image_t *image_stack, uint32_t align)
 {
 	image_t *img_sp = image_stack;
     /*8K total container header*/
-	int file_off = CONTAINER_IMAGE_ARRAY_START_OFFSET,  ofd = -1;
+	uint64_t file_off = CONTAINER_IMAGE_ARRAY_START_OFFSET;
+	int ofd = -1;
 	flash_header_v3_t header;
 
 
@@ -499,13 +834,116 @@ int get_container_image_start_pos(image_t *image_stack, uint32_t align)
 	return file_off;
 }
 
+/*
+ * -update: compare the headers in the existing output with the new ones.
+ * The update is only possible when the output has as many containers and
+ * the images keep their offset and size, then the images with the same
+ * digest are marked to be kept. Returns 0 when the output has to be
+ * rebuilt.
+ */
+static int update_check(int fd, imx_header_v3_t *imx_header, int containers,
+			uint32_t size, uint32_t file_padding, hash_job_t *jobs, int count)
+{
+	flash_header_v3_t *fhdr;
+	boot_img_t old;
+	uint8_t *flat, next[4];
+	uint32_t pos = 0;
+	int i, j, k;
+
+	flat = malloc(size);
+	if (flat == NULL) {
+		fprintf(stderr, "Failed to allocate memory (%d)\n", size);
+		fail_exit_with(FAIL_NOMEM);
+	}
+	if (pread(fd, flat, size, file_padding) != (ssize_t) size)
+		goto rebuild;
+
+	for (i = 0; i < containers; i++) {
+		fhdr = &imx_header->fhdr[i];
+
+		/* version, length and tag, then the image count */
+		if (memcmp(flat + pos, fhdr, 4) ||
+		    flat[pos + offsetof(flash_header_v3_t, num_images)] != fhdr->num_images)
+			goto rebuild;
+
+		for (j = 0; j < fhdr->num_images; j++) {
+			memcpy(&old, flat + pos + HEADER_IMG_ARRAY_OFFSET + j * sizeof(old),
+				sizeof(old));
+			if (old.offset != fhdr->img[j].offset || old.size != fhdr->img[j].size)
+				goto rebuild;
+
+			for (k = 0; k < count; k++)
+				if (jobs[k].img == &fhdr->img[j])
+					jobs[k].keep = (old.hab_flags & IMG_FLAG_HASH_MASK) ==
+							(fhdr->img[j].hab_flags & IMG_FLAG_HASH_MASK) &&
+						!memcmp(old.hash, fhdr->img[j].hash, HASH_MAX_LEN);
+		}
+
+		pos += ALIGN(fhdr->length, fhdr->padding);
+	}
+
+	/* a container left after the last one of the new build */
+	if (pread(fd, next, sizeof(next), file_padding + pos) == (ssize_t) sizeof(next) &&
+	    next[0] == imx_header->fhdr[0].version &&
+	    next[offsetof(flash_header_v3_t, tag)] == imx_header->fhdr[0].tag)
+		goto rebuild;
+
+	free(flat);
+
+	return 1;
+
+rebuild:
+	for (k = 0; k < count; k++)
+		jobs[k].keep = 0;
+	free(flat);
+
+	return 0;
+}
+
+/*
+ * -update: check that the output at fd holds the len bytes of filename at
+ * offset 0, but for the header at [hdr_off, hdr_off + hdr_len) that is
+ * written over them.
+ */
+static int update_same_file(int fd, const char *filename, off_t len,
+			off_t hdr_off, off_t hdr_len)
+{
+	uint8_t a[0x4000], b[0x4000];
+	off_t pos, lo, hi;
+	ssize_t n;
+	int ifd, same = 1;
+
+	ifd = open(filename, O_RDONLY|O_BINARY);
+	if (ifd < 0)
+		return 0;
+
+	for (pos = 0; same && pos < len; pos += n) {
+		n = len - pos < (off_t) sizeof(a) ? len - pos : (off_t) sizeof(a);
+		if (pread(ifd, a, n, pos) != n || pread(fd, b, n, pos) != n) {
+			same = 0;
+			break;
+		}
+		lo = hdr_off > pos ? hdr_off : pos;
+		hi = hdr_off + hdr_len < pos + n ? hdr_off + hdr_len : pos + n;
+		if (lo < hi)
+			memcpy(a + lo - pos, b + lo - pos, hi - lo);
+		same = !memcmp(a, b, n);
+	}
+
+	close(ifd);
+
+	return same;
+}
+
 int build_container_qx_qm_b0(soc_type_t soc, uint32_t sector_size, uint32_t ivt_offset, char *out_file,
 				bool emmc_fastboot, image_t *image_stack, bool dcd_skip, uint8_t fuse_version, uint16_t sw_version)
 {
-	int file_off, ofd = -1;
+	uint64_t file_off;
+	int ofd = -1;
 	unsigned int dcd_len = 0;
 
-	static imx_header_v3_t imx_header;
+	static __thread imx_header_v3_t imx_header;
+	hash_stat_t stats[3];
 	image_t *img_sp = image_stack;
 	struct stat sbuf;
 	char *tmp_filename = NULL;
@@ -514,12 +952,24 @@ int build_container_qx_qm_b0(soc_type_t soc, uint32_t sector_size, uint32_t ivt_
 
 	int container = -1;
 	int cont_img_count = 0; /* indexes to arrange the container */
+	boot_img_t *img_slot[IMG_STACK_SIZE]; /* header entry of each image in the stack */
+	hash_job_t jobs[IMG_STACK_SIZE];
+	int job_count = 0;
+	uint32_t hash_default = IMAGE_HASH_ALGO_DEFAULT;
+	uint32_t hash_next = 0;
+	layout_t layout;
+	int old_fd, keep, kept = 0, streamed = 0, i;
 
 	memset((char *)&imx_header, 0, sizeof(imx_header_v3_t));
+	memset(img_slot, 0, sizeof(img_slot));
+	memset(stats, 0, sizeof(stats));
+	hash_stats = stats;
+	scfw_flags = 0;
+	custom_partition = 0;
 
 	if (image_stack == NULL) {
 		fprintf(stderr, "Empty image stack ");
-		exit(EXIT_FAILURE);
+		fail_exit();
 	}
 
 	if (soc == QX)
@@ -533,7 +983,7 @@ int build_container_qx_qm_b0(soc_type_t soc, uint32_t sector_size, uint32_t ivt_
 	printf("ivt_offset:\t%d\n", ivt_offset);
 
 	file_off = get_container_image_start_pos(image_stack, sector_size);
-	printf("container image offset (aligned):%x\n", file_off);
+	printf("container image offset (aligned):%" PRIx64 "\n", file_off);
 
 	/* step through image stack and generate the header */
 	img_sp = image_stack;
@@ -546,30 +996,39 @@ int build_container_qx_qm_b0(soc_type_t soc, uint32_t sector_size, uint32_t ivt_
 		case DATA:
 		case MSG_BLOCK:
 			check_file(&sbuf, img_sp->filename);
+			check_image_range(img_sp->filename, file_off,
+					ALIGN((uint64_t)sbuf.st_size, sector_size));
 			tmp_filename = img_sp->filename;
-			set_image_array_entry(&imx_header.fhdr[container],
+			img_slot[img_sp - image_stack] =
+				set_image_array_entry(&imx_header.fhdr[container],
 						soc,
 						img_sp,
 						file_off,
-						ALIGN(sbuf.st_size, sector_size),
+						ALIGN((uint64_t)sbuf.st_size, sector_size),
 						tmp_filename,
-						dcd_skip);
+						dcd_skip,
+						hash_next ? hash_next : hash_default);
+			hash_next = 0;
 			img_sp->src = file_off;
 
-			file_off += ALIGN(sbuf.st_size, sector_size);
+			file_off += ALIGN((uint64_t)sbuf.st_size, sector_size);
 			cont_img_count++;
 			break;
 
 		case SECO:
 			check_file(&sbuf, img_sp->filename);
+			check_image_range(img_sp->filename, file_off, sbuf.st_size);
 			tmp_filename = img_sp->filename;
-			set_image_array_entry(&imx_header.fhdr[container],
+			img_slot[img_sp - image_stack] =
+				set_image_array_entry(&imx_header.fhdr[container],
 						soc,
 						img_sp,
 						file_off,
 						sbuf.st_size,
 						tmp_filename,
-						dcd_skip);
+						dcd_skip,
+						hash_next ? hash_next : hash_default);
+			hash_next = 0;
 			img_sp->src = file_off;
 
 			file_off += sbuf.st_size;
@@ -597,72 +1056,179 @@ int build_container_qx_qm_b0(soc_type_t soc, uint32_t sector_size, uint32_t ivt_
 			if (file_off > img_sp->dst)
 			{
 				fprintf(stderr, "FILEOFF address less than current file offset!!!\n");
-				exit(EXIT_FAILURE);
+				fail_exit();
 			}
 			if (img_sp->dst != ALIGN(img_sp->dst, sector_size))
 			{
 				fprintf(stderr, "FILEOFF address is not aligned to sector size!!!\n");
-				exit(EXIT_FAILURE);
+				fail_exit();
 			}
 			file_off = img_sp->dst;
 			break;
 		case PARTITION: /* keep custom partition until next executable image */
 			custom_partition = img_sp->entry; /* use a global var for default behaviour */
             break;
+		case HASH:
+			if (container < 0)
+				hash_default = img_sp->entry; /* before any container: all images */
+			else
+				hash_next = img_sp->entry; /* in a container: next image only */
+			break;
 		default:
 			fprintf(stderr, "unrecognized option in input stack (%d)\n", img_sp->option);
-			exit(EXIT_FAILURE);
+			fail_exit();
 		}
 		img_sp++;/* advance index */
 	}
 
-	/* Open output file */
-	ofd = open(out_file, O_RDWR|O_CREAT|O_TRUNC|O_BINARY, 0666);
-	if (ofd < 0) {
-		fprintf(stderr, "%s: Can't open: %s\n",
-				out_file, strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-
-	/* Append container (if specified) */
 	img_sp = image_stack;
 	do {
 		if (img_sp->option == APPEND) {
-			copy_file(ofd, img_sp->filename, 0, 0);
+			check_file(&sbuf, img_sp->filename);
 			file_padding += FIRST_CONTAINER_HEADER_LENGTH;
 		}
 		img_sp++;
 	} while (img_sp->option != NO_IMG);
 
-	/* Add padding or skip appended container */
-	lseek(ofd, file_padding, SEEK_SET);
+	if (emmc_fastboot)
+		ivt_offset = 0;/*set ivt offset to 0 if emmc */
+
+	/* step through the image stack again this time collecting the images */
+	img_sp = image_stack;
+	while (img_sp->option != NO_IMG) { /* stop once we reach null terminator */
+		if (img_sp->option == M4 || img_sp->option == AP || img_sp->option == DATA ||
+				img_sp->option == SCFW || img_sp->option == SECO || img_sp->option == MSG_BLOCK) {
+			jobs[job_count].img = img_slot[img_sp - image_stack];
+			jobs[job_count].image = img_sp;
+			jobs[job_count].keep = 0;
+			jobs[job_count].stream = 0;
+			jobs[job_count].fed = 0;
+			jobs[job_count].ns = 0;
+			job_count++;
+		}
+		img_sp++;
+	}
+
+	/*
+	 * -update compares the digests before anything is written, else the
+	 * large images are hashed as they are copied and the header, written
+	 * first with their hash left empty, is written again at the end.
+	 */
+	hash_images_parallel(jobs, job_count, !output_update);
 
 	/* Note: Image offset are not contained in the image */
 	uint8_t *tmp = flatten_container_header(&imx_header, container + 1, &size, file_padding);
-	/* Write image header */
-	if (write(ofd, tmp, size) != size) {
-		fprintf(stderr, "error writing image hdr\n");
-		exit(1);
+	fail_push(fail_free, &tmp);
+
+	old_fd = -1;
+	fail_push(fail_close, &old_fd);
+	if (output_update) {
+		old_fd = output_open_old(out_file);
+		if (old_fd < 0) {
+			fprintf(stdout, "Update:\tno %s to update, building it\n", out_file);
+			output_update = 0;
+		} else if (!update_check(old_fd, &imx_header, container + 1,
+					size, file_padding, jobs, job_count)) {
+			fprintf(stdout, "Update:\tcontainers or image offsets changed, rebuilding %s\n",
+				out_file);
+			output_update = 0;
+		}
 	}
 
-	/* Clean-up memory used by the headers */
-	free(tmp);
-
-	if (emmc_fastboot)
-		ivt_offset = 0;/*set ivt offset to 0 if emmc */
+plan:
 
-	/* step through the image stack again this time copying images to final bin */
+	/*
+	 * Plan the output: the appended containers go first and the new header
+	 * is written over theirs, the image padding is left to any image it
+	 * would run into (SECO is not sector aligned). The appended containers
+	 * end before the first image, get_container_image_start_pos() makes
+	 * room for them.
+	 */
+	layout_init(&layout);
 	img_sp = image_stack;
-	while (img_sp->option != NO_IMG) { /* stop once we reach null terminator */
-		if (img_sp->option == M4 || img_sp->option == AP || img_sp->option == DATA || img_sp->option == SCD ||
-				img_sp->option == SCFW || img_sp->option == SECO || img_sp->option == MSG_BLOCK) {
-			copy_file_aligned(ofd, img_sp->filename, img_sp->src, sector_size);
+	do {
+		if (img_sp->option == APPEND) {
+			check_file(&sbuf, img_sp->filename);
+			keep = output_update &&
+				update_same_file(old_fd, img_sp->filename, sbuf.st_size,
+						file_padding, size);
+			layout_add_file(&layout, img_sp->filename, 0, img_sp->filename,
+					0, sbuf.st_size, LAYOUT_WEAK | (keep ? LAYOUT_KEEP : 0));
 		}
 		img_sp++;
+	} while (img_sp->option != NO_IMG);
+
+	for (i = 0; i < job_count; i++) {
+		img_sp = (image_t *) jobs[i].image;
+		keep = jobs[i].keep ? LAYOUT_KEEP : 0;
+		check_file(&sbuf, img_sp->filename);
+		if (jobs[i].stream)
+			layout_add_file_feed(&layout, img_sp->filename, img_sp->src,
+					img_sp->filename, 0, sbuf.st_size, keep,
+					hash_image_feed, &jobs[i]);
+		else
+			layout_add_file(&layout, img_sp->filename, img_sp->src,
+					img_sp->filename, 0, sbuf.st_size, keep);
+		layout_add_zero(&layout, "padding", img_sp->src + sbuf.st_size,
+				ALIGN((uint64_t)sbuf.st_size, sector_size) - sbuf.st_size,
+				LAYOUT_WEAK | keep);
+		kept += !!keep;
+	}
+
+	layout_add_mem(&layout, "container header", file_padding, tmp, size, LAYOUT_OVER);
+
+	layout_check(&layout);
+
+	/* the old output must end with the new image, else it is rebuilt */
+	if (output_update && (fstat(old_fd, &sbuf) < 0 ||
+			      (uint64_t) sbuf.st_size != layout_end(&layout))) {
+		fprintf(stdout, "Update:\timage size changed, rebuilding %s\n", out_file);
+		output_update = 0;
+		for (i = 0; i < job_count; i++)
+			jobs[i].keep = 0;
+		kept = 0;
+		layout_free(&layout);
+		goto plan;
+	}
+
+	fail_pop(&old_fd, 1);
+	if (output_update)
+		fprintf(stdout, "Update:\t%d of %d images unchanged\n", kept, job_count);
+
+	/* Open output file */
+	ofd = output_open(out_file);
+	if (ofd < 0) {
+		fprintf(stderr, "%s: Can't open: %s\n",
+				out_file, strerror(errno));
+		fail_exit_with(FAIL_OUTPUT);
+	}
+
+	layout_emit(&layout, ofd);
+	layout_free(&layout);
+
+	/* the hashes of the streamed images are known now */
+	for (i = 0; i < job_count; i++) {
+		if (jobs[i].stream) {
+			hash_image_finish(&jobs[i]);
+			streamed++;
+		}
 	}
+	if (streamed) {
+		flat_header_set_hashes(&imx_header, container + 1, tmp);
+		if (pwrite(ofd, tmp, size, file_padding) != (ssize_t) size) {
+			fprintf(stderr, "%s: Write error: %s\n",
+				out_file, strerror(errno));
+			fail_exit_with(FAIL_OUTPUT);
+		}
+	}
+
+	/* Clean-up memory used by the headers */
+	fail_pop(&tmp, 1);
+
+	print_hash_stats();
 
 	/* Close output file */
-	close(ofd);
+	output_close(ofd, out_file, sector_size);
 	return 0;
 }
 
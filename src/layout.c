@@ -0,0 +1,451 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * The output image is described as a list of extents (output offset,
+ * source, length) before anything is written. The list is checked for
+ * overlaps, sorted, then written in offset order: the buffers that are
+ * next to each other go out in a single pwritev() and the zero fills are
+ * left as holes. The input files are copied last, with copy_fd_range() or
+ * through an io_uring.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "fileio.h"
+#include "layout.h"
+#include "fail.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX			1024
+#endif
+
+/* zero fills up to this size are written with the buffers around them */
+#define LAYOUT_ZERO_INLINE	0x1000
+
+static const uint8_t zero_block[LAYOUT_ZERO_INLINE];
+
+static const char *type_names[] = { "mem", "file", "zero" };
+
+__thread int layout_dump_enabled;
+
+/* An empty plan, freed by layout_free() or if the build fails */
+void layout_init(layout_t *l)
+{
+	memset(l, 0, sizeof(*l));
+	fail_push(fail_free, &l->ext);
+}
+
+void layout_free(layout_t *l)
+{
+	fail_pop(&l->ext, 1);
+	memset(l, 0, sizeof(*l));
+}
+
+static void layout_add(layout_t *l, const layout_extent_t *e)
+{
+	if (e->len == 0)
+		return;
+
+	if (l->count == l->size) {
+		l->size = l->size ? 2 * l->size : 32;
+		l->ext = realloc(l->ext, l->size * sizeof(*l->ext));
+		if (l->ext == NULL) {
+			fprintf(stderr, "Layout: out of memory\n");
+			fail_exit_with(FAIL_NOMEM);
+		}
+	}
+	l->ext[l->count++] = *e;
+}
+
+void layout_add_mem(layout_t *l, const char *name, uint64_t off,
+		const void *buf, uint64_t len, int flags)
+{
+	layout_extent_t e = { off, len, LAYOUT_MEM, flags, name, buf, NULL, 0 };
+
+	layout_add(l, &e);
+}
+
+void layout_add_file(layout_t *l, const char *name, uint64_t off,
+		const char *filename, uint64_t src_off, uint64_t len, int flags)
+{
+	layout_extent_t e = { off, len, LAYOUT_FILE, flags, name, NULL, filename, src_off };
+
+	layout_add(l, &e);
+}
+
+/*
+ * A file extent whose bytes go to feed() as they are copied, to hash an
+ * input while it is read for the output. It is copied whole and in order,
+ * after the others, and can not be covered by any other extent.
+ */
+void layout_add_file_feed(layout_t *l, const char *name, uint64_t off,
+		const char *filename, uint64_t src_off, uint64_t len, int flags,
+		copy_feed_t feed, void *feed_arg)
+{
+	layout_extent_t e = { off, len, LAYOUT_FILE, flags, name, NULL, filename, src_off,
+			      feed, feed_arg };
+
+	layout_add(l, &e);
+}
+
+void layout_add_zero(layout_t *l, const char *name, uint64_t off,
+		uint64_t len, int flags)
+{
+	layout_extent_t e = { off, len, LAYOUT_ZERO, flags, name, NULL, NULL, 0 };
+
+	layout_add(l, &e);
+}
+
+/*
+ * Plan the whole file at off followed by its padding, as copy_file() does:
+ * pad is the size to fill up to, a pad of 1 only rounds the file up to a
+ * multiple of 4 bytes. Returns the end of the file data.
+ */
+uint64_t layout_add_file_padded(layout_t *l, const char *filename,
+		uint64_t off, int pad)
+{
+	struct stat sbuf;
+	off_t size, tail;
+
+	if (stat(filename, &sbuf) < 0) {
+		fprintf(stderr, "Can't stat %s: %s\n",
+			filename, strerror(errno));
+		fail_exit_with(FAIL_INPUT);
+	}
+	size = sbuf.st_size;
+
+	layout_add_file(l, filename, off, filename, 0, size, 0);
+
+	if (size == 0)
+		return off;
+
+	tail = size % 4;
+	if ((pad - size == 1) && (tail != 0))
+		layout_add_zero(l, "padding", off + size, 4 - tail, LAYOUT_WEAK);
+	else if (pad - size > 1)
+		layout_add_zero(l, "padding", off + size, pad - size, LAYOUT_WEAK);
+
+	return off + size;
+}
+
+/* Keep the parts of e outside [lo, hi), returns how many there are */
+static int extent_cut(const layout_extent_t *e, uint64_t lo, uint64_t hi,
+		layout_extent_t out[2])
+{
+	int n = 0;
+
+	if (e->feed) {
+		fprintf(stderr, "Layout error: %s is hashed as it is copied, it can not be covered\n",
+			e->name);
+		fail_exit();
+	}
+
+	if (e->off < lo) {
+		out[n] = *e;
+		out[n++].len = lo - e->off;
+	}
+	if (e->off + e->len > hi) {
+		out[n] = *e;
+		out[n].off = hi;
+		out[n].len = e->off + e->len - hi;
+		if (e->type == LAYOUT_MEM)
+			out[n].buf += hi - e->off;
+		else if (e->type == LAYOUT_FILE)
+			out[n].src_off += hi - e->off;
+		n++;
+	}
+
+	return n;
+}
+
+static int extent_cmp(const void *a, const void *b)
+{
+	const layout_extent_t *ea = a, *eb = b;
+
+	return (ea->off > eb->off) - (ea->off < eb->off);
+}
+
+static int extent_rank(const layout_extent_t *e)
+{
+	if (e->flags & LAYOUT_OVER)
+		return 2;
+
+	return (e->flags & LAYOUT_WEAK) ? 0 : 1;
+}
+
+/*
+ * Resolve the overlaps and sort the extents by offset. Where two extents
+ * overlap, a LAYOUT_OVER one wins over the others and anything wins over
+ * a LAYOUT_WEAK one, the one added last wins when both are weak. Anything
+ * else is an error in the plan.
+ */
+void layout_check(layout_t *l)
+{
+	layout_t res, todo;
+	layout_extent_t part[2];
+	int i, j, k, n;
+
+	layout_init(&res);
+	layout_init(&todo);
+
+	for (i = 0; i < l->count; i++) {
+		todo.count = 0;
+		layout_add(&todo, &l->ext[i]);
+
+		for (j = 0; j < res.count; j++) {
+			layout_extent_t *p = &res.ext[j];
+
+			for (k = 0; k < todo.count; k++) {
+				layout_extent_t *e = &todo.ext[k];
+				uint64_t lo = e->off > p->off ? e->off : p->off;
+				uint64_t hi = e->off + e->len < p->off + p->len ?
+					e->off + e->len : p->off + p->len;
+
+				if (lo >= hi)
+					continue;
+
+				if (extent_rank(e) == extent_rank(p) && extent_rank(e)) {
+					fprintf(stderr, "Layout error: %s [0x%llx-0x%llx] overlaps %s [0x%llx-0x%llx]\n",
+						e->name, (unsigned long long) e->off,
+						(unsigned long long) (e->off + e->len),
+						p->name, (unsigned long long) p->off,
+						(unsigned long long) (p->off + p->len));
+					fail_exit();
+				}
+
+				if (extent_rank(e) >= extent_rank(p)) {
+					/* the new extent wins, p is replaced by its remains */
+					n = extent_cut(p, e->off, e->off + e->len, part);
+					res.ext[j] = res.ext[--res.count];
+					while (n--)
+						layout_add(&res, &part[n]);
+					j--;
+					break;
+				}
+
+				/* p wins, keep what is left of e */
+				n = extent_cut(e, p->off, p->off + p->len, part);
+				todo.ext[k] = todo.ext[--todo.count];
+				while (n--)
+					layout_add(&todo, &part[n]);
+				k--;
+			}
+		}
+
+		for (k = 0; k < todo.count; k++)
+			layout_add(&res, &todo.ext[k]);
+	}
+
+	qsort(res.ext, res.count, sizeof(*res.ext), extent_cmp);
+
+	/* l keeps its cleanup, for the extents of res now */
+	layout_free(&todo);
+	free(l->ext);
+	*l = res;
+	fail_pop(&res.ext, 0);
+
+	if (layout_dump_enabled)
+		layout_dump(l);
+}
+
+/* The size of the output a checked layout makes */
+uint64_t layout_end(const layout_t *l)
+{
+	uint64_t end = 0;
+	int i;
+
+	for (i = 0; i < l->count; i++)
+		if (l->ext[i].off + l->ext[i].len > end)
+			end = l->ext[i].off + l->ext[i].len;
+
+	return end;
+}
+
+void layout_dump(const layout_t *l)
+{
+	const layout_extent_t *e;
+	int i;
+
+	for (i = 0; i < l->count; i++) {
+		e = &l->ext[i];
+		fprintf(stdout, "LAYOUT:\t0x%08llx - 0x%08llx %-4s %s",
+			(unsigned long long) e->off,
+			(unsigned long long) (e->off + e->len),
+			type_names[e->type], e->name);
+		if (e->type == LAYOUT_FILE && e->src_off)
+			fprintf(stdout, " @0x%llx", (unsigned long long) e->src_off);
+		if (e->flags & LAYOUT_KEEP)
+			fprintf(stdout, " (kept)");
+		if (e->feed)
+			fprintf(stdout, " (hashed)");
+		fprintf(stdout, "\n");
+	}
+}
+
+static void layout_flush(int fd, struct iovec *iov, int *niov, uint64_t off)
+{
+	struct iovec *v = iov;
+	int cnt = *niov;
+	ssize_t n;
+
+	while (cnt > 0) {
+		n = pwritev(fd, v, cnt, off);
+		if (n <= 0) {
+			fprintf(stderr, "Write error: %s\n",
+				n < 0 ? strerror(errno) : "short write");
+			fail_exit_with(FAIL_OUTPUT);
+		}
+		off += n;
+		/* a short write, carry on after the bytes that went out */
+		while (cnt > 0 && (size_t) n >= v->iov_len) {
+			n -= v->iov_len;
+			v++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			v->iov_base = (uint8_t *) v->iov_base + n;
+			v->iov_len -= n;
+		}
+	}
+
+	*niov = 0;
+}
+
+/* The ranges of layout_copy_files() and the inputs open for them */
+typedef struct {
+	copy_range_t *r;
+	int n;
+} layout_ranges_t;
+
+static void layout_ranges_free(void *arg)
+{
+	layout_ranges_t *c = arg;
+	int i;
+
+	for (i = 0; i < c->n; i++)
+		close(c->r[i].ifd);
+	free(c->r);
+}
+
+/*
+ * Copy the file extents, through an io_uring when it is enabled so the
+ * next files are read while the previous ones are written. The bytes of
+ * the extents with a feed are passed to it once they are copied.
+ */
+static void layout_copy_files(const layout_t *l, int fd)
+{
+	layout_ranges_t c = { NULL, 0 };
+	copy_range_t *r;
+	const layout_extent_t *e;
+	int i, ret = 1;
+
+	r = calloc((size_t) l->count + 1, sizeof(*r));
+	if (r == NULL) {
+		fprintf(stderr, "Layout: out of memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+	c.r = r;
+	fail_push(layout_ranges_free, &c);
+
+	for (i = 0; i < l->count; i++) {
+		e = &l->ext[i];
+		if (e->type != LAYOUT_FILE || (e->flags & LAYOUT_KEEP))
+			continue;
+
+		if ((r[c.n].ifd = open(e->filename, O_RDONLY|O_BINARY)) < 0) {
+			fprintf(stderr, "Can't open %s: %s\n",
+				e->filename, strerror(errno));
+			fail_exit_with(FAIL_INPUT);
+		}
+		r[c.n].ioff = e->src_off;
+		r[c.n].ooff = e->off;
+		r[c.n].len = e->len;
+		r[c.n].feed = e->feed;
+		r[c.n].feed_arg = e->feed_arg;
+		c.n++;
+	}
+
+	if (uring_depth)
+		ret = uring_copy_ranges(fd, r, c.n, uring_depth);
+
+	/* the io_uring does not order the reads of a range, read it again */
+	for (i = 0; ret == 0 && i < c.n; i++)
+		if (r[i].feed && feed_fd_range(r[i].ifd, r[i].ioff, r[i].len,
+					       r[i].feed, r[i].feed_arg) < 0)
+			ret = -1;
+
+	/* io_uring not enabled or not available, one range at a time */
+	for (i = 0; ret > 0 && i < c.n; i++)
+		if (copy_fd_range_feed(fd, r[i].ooff, r[i].ifd, r[i].ioff, r[i].len,
+				       r[i].feed, r[i].feed_arg) < 0)
+			ret = -1;
+
+	if (ret < 0) {
+		fprintf(stderr, "Write error %s\n",
+			strerror(errno));
+		fail_exit_with(FAIL_OUTPUT);
+	}
+
+	fail_pop(&c, 1);
+}
+
+/*
+ * Write the extents of a checked layout to fd: the buffers and zeros in
+ * offset order, then the input files. The LAYOUT_KEEP extents are skipped,
+ * fd holds them already.
+ */
+void layout_emit(const layout_t *l, int fd)
+{
+	struct iovec iov[IOV_MAX];
+	int niov = 0;
+	uint64_t batch_off = 0, batch_end = 0;
+	const layout_extent_t *e;
+	int i;
+
+	for (i = 0; i < l->count; i++) {
+		e = &l->ext[i];
+		if (e->type == LAYOUT_FILE || (e->flags & LAYOUT_KEEP))
+			continue;
+
+		if (e->type == LAYOUT_MEM || e->len <= LAYOUT_ZERO_INLINE) {
+			if (niov && (e->off != batch_end || niov == IOV_MAX))
+				layout_flush(fd, iov, &niov, batch_off);
+			if (niov == 0)
+				batch_off = e->off;
+			iov[niov].iov_base = (void *) (e->type == LAYOUT_MEM ? e->buf : zero_block);
+			iov[niov++].iov_len = e->len;
+			batch_end = e->off + e->len;
+			continue;
+		}
+
+		if (niov)
+			layout_flush(fd, iov, &niov, batch_off);
+
+		if (write_zeros(fd, e->off, e->len, 0) < 0) {
+			fprintf(stderr, "Write error: %s\n",
+				strerror(errno));
+			fail_exit_with(FAIL_OUTPUT);
+		}
+	}
+
+	if (niov)
+		layout_flush(fd, iov, &niov, batch_off);
+
+	layout_copy_files(l, fd);
+}
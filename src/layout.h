@@ -0,0 +1,64 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Output layout plan shared by the mkimage_imx8 tools.
+ */
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <stdint.h>
+
+#include "fileio.h"
+
+#define LAYOUT_MEM		0	/* bytes from a buffer */
+#define LAYOUT_FILE		1	/* bytes from an input file */
+#define LAYOUT_ZERO		2	/* zeros, left as a hole when possible */
+
+#define LAYOUT_WEAK		0x1	/* may be covered by other extents (padding) */
+#define LAYOUT_OVER		0x2	/* written over other extents (headers) */
+#define LAYOUT_KEEP		0x4	/* already in the output (-update), not written */
+
+typedef struct {
+	uint64_t off;		/* offset in the output */
+	uint64_t len;
+	int type;
+	int flags;
+	const char *name;	/* for the messages and the dump */
+	const uint8_t *buf;	/* LAYOUT_MEM, must live until emitted */
+	const char *filename;	/* LAYOUT_FILE */
+	uint64_t src_off;	/* LAYOUT_FILE */
+	copy_feed_t feed;	/* LAYOUT_FILE, gets the bytes as copied (hash) */
+	void *feed_arg;
+} layout_extent_t;
+
+typedef struct {
+	layout_extent_t *ext;
+	int count;
+	int size;
+} layout_t;
+
+/* dump every plan once it is checked, set by -dump-layout */
+extern __thread int layout_dump_enabled;
+
+void layout_init(layout_t *l);
+void layout_free(layout_t *l);
+void layout_add_mem(layout_t *l, const char *name, uint64_t off,
+		const void *buf, uint64_t len, int flags);
+void layout_add_file(layout_t *l, const char *name, uint64_t off,
+		const char *filename, uint64_t src_off, uint64_t len, int flags);
+void layout_add_file_feed(layout_t *l, const char *name, uint64_t off,
+		const char *filename, uint64_t src_off, uint64_t len, int flags,
+		copy_feed_t feed, void *feed_arg);
+void layout_add_zero(layout_t *l, const char *name, uint64_t off,
+		uint64_t len, int flags);
+uint64_t layout_add_file_padded(layout_t *l, const char *filename,
+		uint64_t off, int pad);
+void layout_check(layout_t *l);
+uint64_t layout_end(const layout_t *l);
+void layout_dump(const layout_t *l);
+void layout_emit(const layout_t *l, int fd);
+
+#endif /* LAYOUT_H */
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * libmkimage: a build is described by the arguments of mkimage_imx8. An
+ * error of the build returns one of the MKIMAGE_E* codes once its message
+ * is printed, in place of the exit of the tool, and what the build had
+ * allocated or opened is released (see fail_push()).
+ *
+ * The inputs given in memory and the output returned are memory files,
+ * named to the build by their /proc/self/fd path, so the build reads and
+ * writes them as any other file, with no copy to a disk. The options and
+ * the state of a build are kept per thread: the builds of several threads
+ * run at once, each one from the default options. Only the parsing of the
+ * arguments is made one build at a time, getopt is not reentrant. -batch,
+ * -serve and -connect fork or serve for the tool, they are refused.
+ */
+
+#include "mkimage_common.h"
+#include "libmkimage.h"
+
+#define MKIMAGE_FD_PATH_LEN	32
+
+__thread int mkimage_embedded;
+
+/* A memory file, read and written as a file by the build */
+static int mkimage_memfd(const char *name)
+{
+	FILE *tmp;
+	int fd;
+
+#ifdef MFD_CLOEXEC
+	fd = memfd_create(name, MFD_CLOEXEC);
+	if (fd >= 0)
+		return fd;
+#endif
+	/* no memfd, an unlinked temporary file does the same */
+	tmp = tmpfile();
+	if (tmp == NULL)
+		return -1;
+	fd = dup(fileno(tmp));
+	fclose(tmp);
+
+	return fd;
+}
+
+static int mkimage_input_fd(const mkimage_input_t *in)
+{
+	const uint8_t *p = in->buf;
+	size_t left = in->len;
+	ssize_t n;
+	int fd;
+
+	fd = mkimage_memfd("mkimage_input");
+	if (fd < 0)
+		return -1;
+
+	while (left) {
+		n = write(fd, p, left);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			close(fd);
+			return -1;
+		}
+		p += n;
+		left -= n;
+	}
+
+	return fd;
+}
+
+/*
+ * Build the image described by build. The arguments naming an input of
+ * build->inputs read it from memory. With out_fd, the image is not
+ * written to a -out file, which must not be given, but to a memory file
+ * returned in *out_fd, at offset 0, for the caller to close. Returns 0,
+ * or the MKIMAGE_E* code of the error when the build failed.
+ */
+int mkimage_build(const mkimage_build_t *build, int *out_fd)
+{
+	int argc = build->argc + (out_fd ? 2 : 0);
+	char **argv;
+	char (*paths)[MKIMAGE_FD_PATH_LEN];
+	int *fds, ofd = -1, ret = MKIMAGE_EFAIL, err, i, j;
+	jmp_buf env, *prev = fail_target();
+
+	argv = calloc(argc + 1, sizeof(*argv));
+	fds = malloc((build->input_count + 1) * sizeof(*fds));
+	paths = malloc((build->input_count + 1) * sizeof(*paths));
+	if (argv == NULL || fds == NULL || paths == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		ret = MKIMAGE_ENOMEM;
+		goto out;
+	}
+	for (j = 0; j < build->input_count; j++)
+		fds[j] = -1;
+
+	for (i = 0; i < build->argc; i++) {
+		argv[i] = build->argv[i];
+		for (j = 0; i && j < build->input_count; j++) {
+			if (strcmp(argv[i], build->inputs[j].name))
+				continue;
+			if (fds[j] < 0) {
+				fds[j] = mkimage_input_fd(&build->inputs[j]);
+				if (fds[j] < 0) {
+					fprintf(stderr, "%s: Can't load: %s\n",
+						build->inputs[j].name, strerror(errno));
+					ret = MKIMAGE_EINPUT;
+					goto out;
+				}
+				snprintf(paths[j], sizeof(paths[j]), "/proc/self/fd/%d", fds[j]);
+			}
+			argv[i] = paths[j];
+			break;
+		}
+	}
+
+	if (out_fd) {
+		ofd = mkimage_memfd("mkimage_output");
+		if (ofd < 0) {
+			fprintf(stderr, "No memory file for the output: %s\n", strerror(errno));
+			ret = MKIMAGE_EOUTPUT;
+			goto out;
+		}
+		snprintf(paths[build->input_count], sizeof(paths[0]), "/proc/self/fd/%d", ofd);
+		argv[i++] = "-out";
+		argv[i++] = paths[build->input_count];
+	}
+
+	mkimage_embedded = 1;
+	if ((err = setjmp(env)) == 0) {
+		fail_set_target(&env);
+		mkimage_reset();
+		ret = mkimage_main(argc, argv) ? MKIMAGE_EFAIL : 0;
+	} else {
+		ret = -err;
+	}
+	fail_set_target(prev);
+	/* nothing of the build is kept for the next one of the thread */
+	mkimage_reset();
+	mkimage_embedded = 0;
+	fflush(stdout);
+
+out:
+	for (j = 0; fds && j < build->input_count; j++)
+		if (fds[j] >= 0)
+			close(fds[j]);
+	if (ret == 0 && out_fd) {
+		lseek(ofd, 0, SEEK_SET);
+		*out_fd = ofd;
+	} else if (ofd >= 0) {
+		close(ofd);
+	}
+	free(paths);
+	free(fds);
+	free(argv);
+
+	return ret;
+}
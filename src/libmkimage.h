@@ -0,0 +1,40 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * libmkimage: the builds of mkimage_imx8 from a program, without a process
+ * per image nor temporary files.
+ */
+
+#ifndef LIBMKIMAGE_H
+#define LIBMKIMAGE_H
+
+#include <stddef.h>
+
+/* an input in memory, in place of the file of the same name */
+typedef struct {
+	const char *name;
+	const void *buf;
+	size_t len;
+} mkimage_input_t;
+
+/* a build, described by the arguments of mkimage_imx8 */
+typedef struct {
+	int argc;
+	char **argv;		/* argv[0] is the program name */
+	const mkimage_input_t *inputs;
+	int input_count;
+} mkimage_build_t;
+
+/* the errors of mkimage_build(), the message is on stderr */
+#define MKIMAGE_EFAIL		-1	/* the build failed */
+#define MKIMAGE_EUSAGE		-2	/* invalid arguments */
+#define MKIMAGE_ENOMEM		-3	/* out of memory */
+#define MKIMAGE_EINPUT		-4	/* an input can not be read */
+#define MKIMAGE_EOUTPUT		-5	/* the output can not be written */
+#define MKIMAGE_ENOTSUP		-6	/* -batch, -serve and -connect */
+
+int mkimage_build(const mkimage_build_t *build, int *out_fd);
+
+#endif /* LIBMKIMAGE_H */
@@ -0,0 +1,15 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * mkimage_imx8 from the command line: the build of libmkimage, with the
+ * options that fork or serve, and an error exits.
+ */
+
+#include "mkimage_common.h"
+
+int main(int argc, char **argv)
+{
+	return mkimage_main(argc, argv) ? EXIT_FAILURE : 0;
+}
@@ -25,6 +25,11 @@
 #include <sys/types.h>
 #include <stdbool.h>
 
+#include "fileio.h"
+#include "layout.h"
+#include "cfgpp.h"
+#include "fail.h"
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
@@ -47,10 +52,13 @@ typedef enum option_type {
     DATA,
     PARTITION,
     FILEOFF,
-    MSG_BLOCK
+    MSG_BLOCK,
+    HASH
 } option_type_t;
 
 
+#define IMG_STACK_SIZE			32 /* max of 32 images for commandline images */
+
 typedef struct {
       option_type_t option;
       char* filename;
@@ -249,6 +257,36 @@ typedef struct {
 
 #define UNDEFINED 0xFFFFFFFF
 
+#define HASH_TYPE_SHA_256	256
+#define HASH_TYPE_SHA_384	384
+#define HASH_TYPE_SHA_512	512
+
+#define SHA2_MAX_DIGEST_LEN	64
+#define SHA2_MAX_BLOCK_LEN	128
+
+typedef struct {
+	uint32_t hash_type;	/* 256, 384 or 512 */
+	uint32_t block_len;
+	union {
+		uint32_t s256[8];
+		uint64_t s512[8];
+	} state;
+	uint64_t total;		/* bytes hashed so far */
+	uint8_t buf[SHA2_MAX_BLOCK_LEN];
+	uint32_t buf_len;
+} sha2_ctx_t;
+
+#define HASH_CACHE_MISS		0
+#define HASH_CACHE_HIT		1
+#define HASH_CACHE_VERIFY	2
+
+/* the cache settings of a build, for the threads it hashes with */
+typedef struct {
+	const char *dir;
+	int verify_percent;
+	uint64_t verify_seed;
+} hash_cache_conf_t;
+
 #if 0
 enum imximage_fld_types {
         CFG_INVALID = -1,
@@ -299,21 +337,122 @@ static table_entry_t imximage_cmds[] = {
 };
 #endif
 
+/* State of the parse of a DCD cfg file, one per table parsed */
+typedef struct {
+	dcd_v2_t *dcd_v2;
+	struct dcd_v2_cmd *last_cmd;	/* command the next entry goes in */
+	int dcd_len;			/* entries so far */
+	int lineno;
+	uint32_t version;		/* IMAGE_VERSION */
+	uint32_t ivt_offset;		/* BOOT_OFFSET */
+	uint32_t csf_size;		/* CSF */
+	int cmd_ver_first;		/* IMAGE_VERSION came first, 0 when too late */
+	cfgpp_t *pp;			/* the files read for the table */
+} dcd_parse_t;
+
 void check_file(struct stat* sbuf,char * filename);
-void copy_file (int ifd, const char *datafile, int pad, int offset);
 uint32_t get_cfg_value(char *token, char *name,  int linenr);
-void set_dcd_param_v2(dcd_v2_t *dcd_v2, uint32_t dcd_len,
-                int32_t cmd);
-void set_dcd_val_v2(dcd_v2_t *dcd_v2, char *name, int lineno,
-                                        int fld, uint32_t value, uint32_t off);
-void set_dcd_rst_v2(dcd_v2_t *dcd_v2, uint32_t dcd_len,
-                                                char *name, int lineno);
-void parse_cfg_cmd(dcd_v2_t *dcd_v2, int32_t cmd, char *token,
-                                char *name, int lineno, int fld, int dcd_len);
-void parse_cfg_fld(dcd_v2_t *dcd_v2, int32_t *cmd,
-                char *token, char *name, int lineno, int fld, int *dcd_len);
+void set_dcd_param_v2(dcd_parse_t *ctx, int32_t cmd);
+void set_dcd_val_v2(dcd_parse_t *ctx, char *name, int lineno,
+                                        int fld, uint32_t value);
+void set_dcd_rst_v2(dcd_parse_t *ctx, char *name, int lineno);
+void parse_cfg_cmd(dcd_parse_t *ctx, int32_t cmd, char *token,
+                                char *name, int lineno, int fld);
+void parse_cfg_fld(dcd_parse_t *ctx, int32_t *cmd,
+                char *token, char *name, int lineno, int fld);
+void dcd_parse_init(dcd_parse_t *ctx, dcd_v2_t *dcd_v2);
+void dcd_parse_free(dcd_parse_t *ctx);
+uint32_t dcd_parse_file(dcd_parse_t *ctx, char *name);
 uint32_t parse_cfg_file(dcd_v2_t *dcd_v2, char *name);
 
+void sha2_init(sha2_ctx_t *ctx, uint32_t hash_type);
+void sha2_update(sha2_ctx_t *ctx, const void *data, size_t len);
+void sha2_update_zero(sha2_ctx_t *ctx, uint64_t len);
+uint32_t sha2_final(sha2_ctx_t *ctx, uint8_t *digest);
+int sha2_selftest(void);
+
+/* room the digest cache takes on disk by default, -hash-cache-max */
+#define HASH_CACHE_DEFAULT_MAX	((uint64_t)64 << 20)
+
+void hash_cache_init(const char *dir, int verify, uint64_t max);
+int hash_cache_lookup(const struct stat *st, uint32_t padded_len,
+			uint32_t hash_type, uint8_t *digest);
+void hash_cache_store(const struct stat *st, uint32_t padded_len,
+			uint32_t hash_type, const uint8_t *digest);
+const char *hash_cache_dir(void);
+bool hash_cache_settled(const struct stat *st);
+void hash_cache_reset(void);
+void hash_cache_share(hash_cache_conf_t *c);
+void hash_cache_adopt(const hash_cache_conf_t *c);
+char *cache_default_dir(const char *sub);
+void cache_mkdir(char *path);
+int cache_parse_size(const char *s, uint64_t *size);
+void cache_prune(const char *dir, uint64_t max);
+void cache_touch(int fd);
+
+/* key of an image in the output cache, with the files it is made of */
+typedef struct {
+	sha2_ctx_t ctx;
+	struct out_cache_input *inputs;
+	int input_count;
+	bool settled;			/* no input was written just before */
+	char *path;			/* the entry, once the key is complete */
+} out_cache_key_t;
+
+/* room the output cache takes on disk by default, -out-cache-max */
+#define OUT_CACHE_DEFAULT_MAX	((uint64_t)4 << 30)
+
+void out_cache_init(const char *dir, uint64_t max);
+void out_cache_reset(void);
+int out_cache_begin(out_cache_key_t *k);
+void out_cache_add(out_cache_key_t *k, const void *data, size_t len);
+int out_cache_add_file(out_cache_key_t *k, const char *name);
+int out_cache_fetch(out_cache_key_t *k, const char *name, uint32_t block);
+void out_cache_store(out_cache_key_t *k, int fd);
+void out_cache_free(out_cache_key_t *k);
+
+int dcd_bin_read(const char *filename, cfgpp_t *pp, dcd_v2_t *dcd_v2,
+			uint32_t *dcd_len, const char *options, bool strict);
+int dcd_bin_write(const char *filename, const cfgpp_t *pp,
+			const dcd_v2_t *dcd_v2, uint32_t dcd_len);
+int dcd_cache_lookup(const char *cfg, cfgpp_t *pp, dcd_v2_t *dcd_v2,
+			uint32_t *dcd_len);
+void dcd_cache_store(const char *cfg, const cfgpp_t *pp, const dcd_v2_t *dcd_v2,
+			uint32_t dcd_len);
+uint32_t dcd_fold(dcd_v2_t *dcd_v2, uint32_t dcd_len);
+void dcd_fold_add(const char *list);
+int dcd_fold_list(const uint32_t **regs);
+void dcd_fold_reset(void);
+void dcd_report_cost(const char *spec);
+void dcd_report_reset(void);
+void dcd_report(const dcd_v2_t *dcd_v2, uint32_t dcd_len, const char *name);
+void regmap_expand(const char *name, FILE *out, int instances);
+
+/* memos shared by the builds of a -batch */
+#define BATCH_MEMO_HASH		0	/* digests of the images */
+#define BATCH_MEMO_DCD		1	/* tables parsed from the cfg files */
+#define BATCH_MEMO_KINDS	2
+/* a DCD entry: dcd_len, the table and the files read, each with a NUL */
+#define BATCH_DCD_MAX_SIZE	(sizeof(uint32_t) + sizeof(dcd_v2_t) + 4096)
+
+int mkimage_main(int argc, char **argv);
+void mkimage_reset(void);
+
+/* set while libmkimage runs a build of this thread, see mkimage_build() */
+extern __thread int mkimage_embedded;
+
+extern int batch_worker;
+extern int batch_memo_lasting;
+int batch_run(const char *name, int jobs, const char *prog,
+		int (*build)(int argc, char **argv));
+void batch_memo_init(void);
+int batch_memo_get(int kind, const void *key, size_t keylen, void *value, size_t size);
+void batch_memo_put(int kind, const void *key, size_t keylen, const void *value, size_t len);
+void batch_memo_drop(int kind, const void *key, size_t keylen);
+
+int serve_run(const char *path, int jobs, int (*build)(int argc, char **argv));
+int serve_connect(const char *path, const char *prog, int argc, char **argv);
+
 int build_container_qm(uint32_t sector_size, uint32_t ivt_offset, char * out_file,
                 bool emmc_fastboot, image_t* image_stack);
 
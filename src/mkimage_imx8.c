@@ -24,6 +24,7 @@
 #include <sys/types.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "mkimage_common.h"
 #include "build_info.h"
@@ -33,8 +34,6 @@
 #endif
 
 
-#define IMG_STACK_SIZE			32 /* max of 32 images for commandline images */
-
 enum imximage_fld_types {
 		CFG_INVALID = -1,
 		CFG_COMMAND,
@@ -89,94 +88,27 @@ void check_file(struct stat* sbuf,char * filename)
 	if (tmp_fd < 0) {
 			fprintf(stderr, "%s: Can't open: %s\n",
 							filename, strerror(errno));
-			exit(EXIT_FAILURE);
+			fail_exit_with(FAIL_INPUT);
 	}
 
 	if (fstat(tmp_fd, sbuf) < 0) {
 			fprintf(stderr, "%s: Can't stat: %s\n",
 							filename, strerror(errno));
-			exit(EXIT_FAILURE);
+			close(tmp_fd);
+			fail_exit_with(FAIL_INPUT);
 	}
 	close(tmp_fd);
 }
 
-void
-copy_file (int ifd, const char *datafile, int pad, int offset)
-{
-	int dfd;
-	struct stat sbuf;
-	unsigned char *ptr;
-	int tail;
-	int zero = 0;
-	uint8_t zeros[4096];
-	int size;
-
-	memset(zeros, 0, sizeof(zeros));
-
-	if ((dfd = open(datafile, O_RDONLY|O_BINARY)) < 0) {
-		fprintf (stderr, "Can't open %s: %s\n",
-			datafile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
-
-	if (fstat(dfd, &sbuf) < 0) {
-		fprintf (stderr, "Can't stat %s: %s\n",
-			datafile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
-
-	if(sbuf.st_size == 0)
-		goto close;
-
-	ptr = mmap(0, sbuf.st_size, PROT_READ, MAP_SHARED, dfd, 0);
-	if (ptr == MAP_FAILED) {
-		fprintf (stderr, "Can't read %s: %s\n",
-			datafile, strerror(errno));
-		exit (EXIT_FAILURE);
-	}
-
-	size = sbuf.st_size;
-	lseek(ifd, offset, SEEK_SET);
-	if (write(ifd, ptr, size) != size) {
-		fprintf (stderr, "Write error %s\n",
-			strerror(errno));
-		exit (EXIT_FAILURE);
-	}
-
-	tail = size % 4;
-	pad = pad - size;
-	if ((pad == 1) && (tail != 0)) {
-
-		if (write(ifd, (char *)&zero, 4-tail) != 4-tail) {
-			fprintf (stderr, "Write error on %s\n",
-				strerror(errno));
-			exit (EXIT_FAILURE);
-		}
-	} else if (pad > 1) {
-		while (pad > 0) {
-			int todo = sizeof(zeros);
-
-			if (todo > pad)
-				todo = pad;
-			if (write(ifd, (char *)&zeros, todo) != todo) {
-				fprintf(stderr, "Write error: %s\n",
-					strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-			pad -= todo;
-		}
-	}
-
-	(void) munmap((void *)ptr, sbuf.st_size);
-close:
-	(void) close (dfd);
-}
+/* -dcd-dep: make depfile of the DCD cfg file, its target is the output */
+static __thread char *dcd_dep_file;
+static __thread char *dcd_dep_target;
 
+/* -dcd_bin: the DCD file is a table compiled by -dcd-compile */
+static __thread bool dcd_bin;
 
-static uint32_t imximage_version;
-static struct dcd_v2_cmd *gd_last_cmd;
-static uint32_t imximage_ivt_offset = UNDEFINED;
-static uint32_t imximage_csf_size = UNDEFINED;
+/* -dcd-fold: rewrite the DCD table without the writes folded */
+static __thread bool dcd_fold_table;
 
 int get_table_entry_id(const table_entry_t *table,
 		const char *table_name, const char *name)
@@ -201,21 +133,20 @@ uint32_t get_cfg_value(char *token, char *name,  int linenr)
 	if (errno || (token == endptr)) {
 		fprintf(stderr, "Error: %s[%d] - Invalid hex data(%s)\n",
 			name,  linenr, token);
-		exit(EXIT_FAILURE);
+		fail_exit();
 	}
 	return value;
 }
 
 
-void set_dcd_param_v2(dcd_v2_t *dcd_v2, uint32_t dcd_len,
-		int32_t cmd)
+void set_dcd_param_v2(dcd_parse_t *ctx, int32_t cmd)
 {
-	struct dcd_v2_cmd *d = gd_last_cmd;
+	struct dcd_v2_cmd *d = ctx->last_cmd;
 	struct dcd_v2_cmd *d2;
 	int len;
 
 	if (!d)
-		d = &dcd_v2->dcd_cmd;
+		d = &ctx->dcd_v2->dcd_cmd;
 	d2 = d;
 	len = be16_to_cpu(d->write_dcd_command.length);
 	if (len > 4)
@@ -286,13 +217,14 @@ void set_dcd_param_v2(dcd_v2_t *dcd_v2, uint32_t dcd_len,
 	default:
 		break;
 	}
-	gd_last_cmd = d;
+	ctx->last_cmd = d;
 }
 
-void set_dcd_val_v2(dcd_v2_t *dcd_v2, char *name, int lineno,
-					int fld, uint32_t value, uint32_t off)
+void set_dcd_val_v2(dcd_parse_t *ctx, char *name, int lineno,
+					int fld, uint32_t value)
 {
-	struct dcd_v2_cmd *d = gd_last_cmd;
+	struct dcd_v2_cmd *d = ctx->last_cmd;
+	uint32_t off;
 	int len;
 
 	len = be16_to_cpu(d->write_dcd_command.length);
@@ -313,10 +245,10 @@ void set_dcd_val_v2(dcd_v2_t *dcd_v2, char *name, int lineno,
 	}
 }
 
-void set_dcd_rst_v2(dcd_v2_t *dcd_v2, uint32_t dcd_len,
-						char *name, int lineno)
+void set_dcd_rst_v2(dcd_parse_t *ctx, char *name, int lineno)
 {
-	struct dcd_v2_cmd *d = gd_last_cmd;
+	dcd_v2_t *dcd_v2 = ctx->dcd_v2;
+	struct dcd_v2_cmd *d = ctx->last_cmd;
 	int len;
 
 	if (!d)
@@ -333,27 +265,26 @@ void set_dcd_rst_v2(dcd_v2_t *dcd_v2, uint32_t dcd_len,
 	printf("dcd size in bytes = %d\n", len);
 }
 
-void parse_cfg_cmd(dcd_v2_t *dcd_v2, int32_t cmd, char *token,
-				char *name, int lineno, int fld, int dcd_len)
+void parse_cfg_cmd(dcd_parse_t *ctx, int32_t cmd, char *token,
+				char *name, int lineno, int fld)
 {
 	int value;
-	static int cmd_ver_first = ~0;
 
 	switch (cmd) {
 	case CMD_IMAGE_VERSION:
-		imximage_version = get_cfg_value(token, name, lineno);
-		if (cmd_ver_first == 0) {
+		ctx->version = get_cfg_value(token, name, lineno);
+		if (ctx->cmd_ver_first == 0) {
 			fprintf(stderr, "Error: %s[%d] - IMAGE_VERSION "
 				"command need be the first before other "
 				"valid command in the file\n", name, lineno);
-			exit(EXIT_FAILURE);
+			fail_exit();
 		}
-		cmd_ver_first = 1;
+		ctx->cmd_ver_first = 1;
 		break;
 	case CMD_BOOT_OFFSET:
-		imximage_ivt_offset = get_cfg_value(token, name, lineno);
-		if (cmd_ver_first != 1)
-			cmd_ver_first = 0;
+		ctx->ivt_offset = get_cfg_value(token, name, lineno);
+		if (ctx->cmd_ver_first != 1)
+			ctx->cmd_ver_first = 0;
 		break;
 	case CMD_WRITE_DATA:
 	case CMD_WRITE_CLR_BIT:
@@ -363,27 +294,27 @@ void parse_cfg_cmd(dcd_v2_t *dcd_v2, int32_t cmd, char *token,
 	case CMD_CHECK_ANY_BIT_SET:
 	case CMD_CHECK_ANY_BIT_CLR:
 		value = get_cfg_value(token, name, lineno);
-		set_dcd_param_v2(dcd_v2, dcd_len, cmd);
-		set_dcd_val_v2(dcd_v2, name, lineno, fld, value, dcd_len);
-		if (cmd_ver_first != 1)
-			cmd_ver_first = 0;
+		set_dcd_param_v2(ctx, cmd);
+		set_dcd_val_v2(ctx, name, lineno, fld, value);
+		if (ctx->cmd_ver_first != 1)
+			ctx->cmd_ver_first = 0;
 		break;
 	case CMD_CSF:
-		if (imximage_version != 2) {
+		if (ctx->version != 2) {
 			fprintf(stderr,
 				"Error: %s[%d] - CSF only supported for VERSION 2(%s)\n",
 				name, lineno, token);
-			exit(EXIT_FAILURE);
+			fail_exit();
 		}
-		imximage_csf_size = get_cfg_value(token, name, lineno);
-		if (cmd_ver_first != 1)
-			cmd_ver_first = 0;
+		ctx->csf_size = get_cfg_value(token, name, lineno);
+		if (ctx->cmd_ver_first != 1)
+			ctx->cmd_ver_first = 0;
 		break;
 	}
 }
 
-void parse_cfg_fld(dcd_v2_t *dcd_v2, int32_t *cmd,
-		char *token, char *name, int lineno, int fld, int *dcd_len)
+void parse_cfg_fld(dcd_parse_t *ctx, int32_t *cmd,
+		char *token, char *name, int lineno, int fld)
 {
 	int value;
 
@@ -394,11 +325,11 @@ void parse_cfg_fld(dcd_v2_t *dcd_v2, int32_t *cmd,
 		if (*cmd < 0) {
 			fprintf(stderr, "Error: %s[%d] - Invalid command"
 			"(%s)\n", name, lineno, token);
-			exit(EXIT_FAILURE);
+			fail_exit();
 		}
 		break;
 	case CFG_REG_SIZE:
-		parse_cfg_cmd(dcd_v2, *cmd, token, name, lineno, fld, *dcd_len);
+		parse_cfg_cmd(ctx, *cmd, token, name, lineno, fld);
 		break;
 	case CFG_REG_ADDRESS:
 	case CFG_REG_VALUE:
@@ -411,17 +342,16 @@ void parse_cfg_fld(dcd_v2_t *dcd_v2, int32_t *cmd,
 		case CMD_CHECK_ANY_BIT_SET:
 		case CMD_CHECK_ANY_BIT_CLR:
 			value = get_cfg_value(token, name, lineno);
-			set_dcd_param_v2(dcd_v2, *dcd_len, *cmd);
-			set_dcd_val_v2(dcd_v2, name, lineno, fld, value,
-					*dcd_len);
+			set_dcd_param_v2(ctx, *cmd);
+			set_dcd_val_v2(ctx, name, lineno, fld, value);
 
 			if (fld == CFG_REG_VALUE) {
-				(*dcd_len)++;
-				if (*dcd_len > MAX_HW_CFG_SIZE_V2) {
+				ctx->dcd_len++;
+				if (ctx->dcd_len > MAX_HW_CFG_SIZE_V2) {
 					fprintf(stderr, "Error: %s[%d] -"
 						"DCD table exceeds maximum size(%d)\n",
 						name, lineno, MAX_HW_CFG_SIZE_V2);
-					exit(EXIT_FAILURE);
+					fail_exit();
 				}
 			}
 			break;
@@ -434,57 +364,510 @@ void parse_cfg_fld(dcd_v2_t *dcd_v2, int32_t *cmd,
 	}
 }
 
-uint32_t parse_cfg_file(dcd_v2_t *dcd_v2, char *name)
+/* One line of the preprocessed cfg file */
+static void parse_cfg_line(void *arg, char *line, const char *file, int lineno)
 {
-	FILE *fd = NULL;
-	char *line = NULL;
+	dcd_parse_t *ctx = arg;
 	char *token, *saveptr1, *saveptr2;
-	int lineno = 0;
+	char *name = (char *)file;
 	int fld;
-	size_t len;
-	int dcd_len = 0;
 	int32_t cmd;
 
-	fd = fopen(name, "r");
-	if (fd == 0) {
-		fprintf(stderr, "Error: %s - Can't open DCD file\n", name);
-		exit(EXIT_FAILURE);
-	}
+	ctx->lineno = lineno;
 
-	/*
-	 * Very simple parsing, line starting with # are comments
-	 * and are dropped
-	 */
-	while ((getline(&line, &len, fd)) > 0) {
-		lineno++;
+	token = strtok_r(line, "\r\n", &saveptr1);
+	if (token == NULL)
+		return;
 
-		token = strtok_r(line, "\r\n", &saveptr1);
+	/* Check inside the single line */
+	for (fld = CFG_COMMAND, cmd = CMD_INVALID,
+			line = token; ; line = NULL, fld++) {
+		token = strtok_r(line, " \t", &saveptr2);
 		if (token == NULL)
-			continue;
+			break;
 
-		/* Check inside the single line */
-		for (fld = CFG_COMMAND, cmd = CMD_INVALID,
-				line = token; ; line = NULL, fld++) {
-			token = strtok_r(line, " \t", &saveptr2);
-			if (token == NULL)
-				break;
+		/* Drop all text starting with '#' as comments */
+		if (token[0] == '#')
+			break;
 
-			/* Drop all text starting with '#' as comments */
-			if (token[0] == '#')
+		parse_cfg_fld(ctx, &cmd, token, name, lineno, fld);
+	}
+}
+
+/* Write one line of the preprocessed cfg file, for -dcd-preprocess */
+static void write_cfg_line(void *arg, char *line, const char *file, int lineno)
+{
+	char *p = line;
+
+	while (*p == ' ' || *p == '\t')
+		p++;
+	if (*p)
+		fprintf(arg, "%s\n", line);
+}
+
+/* Write one line of the preprocessed cfg file as C, for -dcd-to-c */
+static void write_c_line(void *arg, char *line, const char *file, int lineno)
+{
+	static const char *checks[] = {
+		[CMD_CHECK_BITS_SET] = "(DCD_REG32(0x%08x) & 0x%08xU) == 0x%08xU",
+		[CMD_CHECK_BITS_CLR] = "(DCD_REG32(0x%08x) & 0x%08xU) == 0",
+		[CMD_CHECK_ANY_BIT_SET] = "(DCD_REG32(0x%08x) & 0x%08xU) != 0",
+		[CMD_CHECK_ANY_BIT_CLR] = "(DCD_REG32(0x%08x) & 0x%08xU) != 0x%08xU",
+	};
+	FILE *fp = arg;
+	char *name = (char *)file;
+	char *copy, *token, *saveptr;
+	char *fld[CFG_REG_VALUE + 1];
+	uint32_t addr, value;
+	int32_t cmd;
+	int n;
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+	if (*line == 0)
+		return;
+
+	copy = strdup(line);
+	if (copy == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+	fail_push(fail_free, &copy);
+
+	for (n = 0, token = strtok_r(copy, " \t\r\n", &saveptr);
+	     token && token[0] != '#' && n <= CFG_REG_VALUE;
+	     token = strtok_r(NULL, " \t\r\n", &saveptr))
+		fld[n++] = token;
+
+	if (n == 0) {
+		fail_pop(&copy, 1);
+		return;
+	}
+
+	cmd = get_table_entry_id(imximage_cmds, "imximage commands", fld[CFG_COMMAND]);
+	if (cmd < 0) {
+		/* not a command, C code of the cfg file for the SCFW */
+		fprintf(fp, "\t%s\n", line);
+		fail_pop(&copy, 1);
+		return;
+	}
+
+	switch (cmd) {
+	case CMD_WRITE_DATA:
+	case CMD_WRITE_CLR_BIT:
+	case CMD_WRITE_SET_BIT:
+	case CMD_CHECK_BITS_SET:
+	case CMD_CHECK_BITS_CLR:
+	case CMD_CHECK_ANY_BIT_SET:
+	case CMD_CHECK_ANY_BIT_CLR:
+		if (n <= CFG_REG_VALUE) {
+			fprintf(stderr, "Error: %s[%d] - %s needs a size, an address and a value\n",
+				name, lineno, fld[CFG_COMMAND]);
+			fail_exit();
+		}
+		addr = get_cfg_value(fld[CFG_REG_ADDRESS], name, lineno);
+		value = get_cfg_value(fld[CFG_REG_VALUE], name, lineno);
+		break;
+	default:
+		fprintf(fp, "\t/* %s: not a register access */\n", line);
+		fail_pop(&copy, 1);
+		return;
+	}
+
+	switch (cmd) {
+	case CMD_WRITE_DATA:
+		fprintf(fp, "\tDCD_REG32(0x%08x) = 0x%08xU;\n", addr, value);
+		break;
+	case CMD_WRITE_CLR_BIT:
+		fprintf(fp, "\tDCD_REG32(0x%08x) &= ~0x%08xU;\n", addr, value);
+		break;
+	case CMD_WRITE_SET_BIT:
+		fprintf(fp, "\tDCD_REG32(0x%08x) |= 0x%08xU;\n", addr, value);
+		break;
+	default:
+		fprintf(fp, "\tDCD_POLL(");
+		fprintf(fp, checks[cmd], addr, value, value);
+		fprintf(fp, ");\n");
+		break;
+	}
+
+	fail_pop(&copy, 1);
+}
+
+/* cfgpp_free() for fail_push() */
+static void pp_cleanup(void *pp)
+{
+	cfgpp_free(pp);
+}
+
+/*
+ * Write the cfg file name as a C function doing the same register accesses
+ * as the DCD, to run the DDR init from the SCFW. The lines that are not
+ * commands are copied as they are, the C code of an #ifdef SCFW_DCD.
+ */
+static void write_cfg_c(FILE *fp, const char *name)
+{
+	cfgpp_t *pp;
+
+	fprintf(fp, "/*\n"
+		" * Generated by mkimage_imx8 -dcd-to-c from %s, do not edit.\n"
+		" * DATA, SET_BIT and CLR_BIT are register writes, a check polls the\n"
+		" * register at most DCD_POLL_MAX times then DCD_FUNC() returns -1.\n"
+		" */\n\n", name);
+	fprintf(fp, "#include <stdint.h>\n\n"
+		"#ifndef DCD_FUNC\n"
+		"#define DCD_FUNC\tboard_ddr_config\n"
+		"#endif\n\n"
+		"#ifndef DCD_POLL_MAX\n"
+		"#define DCD_POLL_MAX\t1000000\n"
+		"#endif\n\n"
+		"#ifndef DCD_REG32\n"
+		"#define DCD_REG32(a)\t(*(volatile uint32_t *)(uintptr_t)(a))\n"
+		"#endif\n\n"
+		"#ifndef DCD_POLL\n"
+		"#define DCD_POLL(cond) \\\n"
+		"\tdo { \\\n"
+		"\t\tuint32_t polls_ = 0; \\\n"
+		"\t\twhile (!(cond)) \\\n"
+		"\t\t\tif (++polls_ == DCD_POLL_MAX) \\\n"
+		"\t\t\t\treturn -1; \\\n"
+		"\t} while (0)\n"
+		"#endif\n\n");
+	fprintf(fp, "int DCD_FUNC(void)\n{\n");
+	pp = cfgpp_new();
+	fail_push(pp_cleanup, pp);
+	cfgpp_run(pp, name, write_c_line, fp);
+	fail_pop(pp, 1);
+	fprintf(fp, "\n\treturn 0;\n}\n");
+}
+
+static void dcd_parse_cleanup(void *arg)
+{
+	dcd_parse_t *ctx = arg;
+
+	cfgpp_free(ctx->pp);
+	ctx->pp = NULL;
+}
+
+/* Start the parse of a table, freed by dcd_parse_free() or if the build fails */
+void dcd_parse_init(dcd_parse_t *ctx, dcd_v2_t *dcd_v2)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->dcd_v2 = dcd_v2;
+	ctx->ivt_offset = UNDEFINED;
+	ctx->csf_size = UNDEFINED;
+	ctx->cmd_ver_first = ~0;
+	ctx->pp = cfgpp_new();
+	fail_push(dcd_parse_cleanup, ctx);
+}
+
+void dcd_parse_free(dcd_parse_t *ctx)
+{
+	fail_pop(ctx, 1);
+}
+
+/* A file read for a table in the memo, followed by its path and a NUL */
+typedef struct {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} dcd_memo_dep_t;
+
+static void dcd_memo_stat(dcd_memo_dep_t *d, const struct stat *st)
+{
+	memset(d, 0, sizeof(*d));
+	d->dev = st->st_dev;
+	d->ino = st->st_ino;
+	d->size = st->st_size;
+	d->mtime_sec = st->st_mtim.tv_sec;
+	d->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+ * The table of the cfg file name from another build of the same -batch
+ * or -serve, with the -D and -I options of this one. A table is made
+ * again once one of the files read for it changed. Returns -1 when this
+ * build has to parse it, and give it to dcd_memo_put() then.
+ */
+static int dcd_memo_get(dcd_parse_t *ctx, const char *key, uint32_t *dcd_len)
+{
+	uint8_t *memo = malloc(BATCH_DCD_MAX_SIZE);
+	dcd_memo_dep_t d, now;
+	struct stat st;
+	const char *dep;
+	int len, n, i;
+
+	if (memo == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+	fail_push(fail_free, &memo);
+
+	for (i = 0; i < 2; i++) {
+		len = batch_memo_get(BATCH_MEMO_DCD, key, strlen(key), memo, BATCH_DCD_MAX_SIZE);
+		if (len < (int) (sizeof(uint32_t) + sizeof(dcd_v2_t)))
+			break;
+
+		n = sizeof(uint32_t) + sizeof(dcd_v2_t);
+		while (n < len) {
+			memcpy(&d, memo + n, sizeof(d));
+			dep = (char *) memo + n + sizeof(d);
+			if (stat(dep, &st) < 0)
 				break;
+			dcd_memo_stat(&now, &st);
+			if (memcmp(&d, &now, sizeof(d)))
+				break;
+			n += sizeof(d) + strlen(dep) + 1;
+		}
+		if (n < len) {
+			batch_memo_drop(BATCH_MEMO_DCD, key, strlen(key));
+			continue;
+		}
 
-			parse_cfg_fld(dcd_v2, &cmd, token, name,
-					lineno, fld, &dcd_len);
+		memcpy(dcd_len, memo, sizeof(uint32_t));
+		memcpy(ctx->dcd_v2, memo + sizeof(uint32_t), sizeof(dcd_v2_t));
+		n = sizeof(uint32_t) + sizeof(dcd_v2_t);
+		while (n < len) {
+			dep = (char *) memo + n + sizeof(d);
+			cfgpp_add_dep(ctx->pp, dep);
+			n += sizeof(d) + strlen(dep) + 1;
 		}
+		fail_pop(&memo, 1);
+		return 0;
+	}
+	fail_pop(&memo, 1);
 
+	return -1;
+}
+
+static void dcd_memo_put(dcd_parse_t *ctx, const char *key, uint32_t dcd_len)
+{
+	uint8_t *memo = malloc(BATCH_DCD_MAX_SIZE);
+	dcd_memo_dep_t d;
+	struct stat st;
+	size_t len, n;
+	const char *dep;
+	int i;
+
+	if (memo == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+
+	memcpy(memo, &dcd_len, sizeof(uint32_t));
+	memcpy(memo + sizeof(uint32_t), ctx->dcd_v2, sizeof(dcd_v2_t));
+	len = sizeof(uint32_t) + sizeof(dcd_v2_t);
+	for (i = 0; (dep = cfgpp_dep(ctx->pp, i)) != NULL; i++) {
+		n = strlen(dep) + 1;
+		/* too many files read for the memo, or one just written */
+		if (len + sizeof(d) + n > BATCH_DCD_MAX_SIZE || stat(dep, &st) < 0 ||
+		    (batch_memo_lasting && !hash_cache_settled(&st))) {
+			free(memo);
+			batch_memo_put(BATCH_MEMO_DCD, key, strlen(key), NULL, 0);
+			return;
+		}
+		dcd_memo_stat(&d, &st);
+		memcpy(memo + len, &d, sizeof(d));
+		memcpy(memo + len + sizeof(d), dep, n);
+		len += sizeof(d) + n;
+	}
+
+	batch_memo_put(BATCH_MEMO_DCD, key, strlen(key), memo, len);
+	free(memo);
+}
+
+/*
+ * Parse the cfg file name in ctx, its table goes to ctx->dcd_v2. Nothing
+ * but ctx is changed, so files can be parsed at once from several threads.
+ */
+uint32_t dcd_parse_file(dcd_parse_t *ctx, char *name)
+{
+	dcd_v2_t *dcd_v2 = ctx->dcd_v2;
+	uint32_t dcd_len;
+	char *path, *key = NULL;
+
+	/* the same file with the same options gives the same table */
+	if (!dcd_bin && (path = realpath(name, NULL)) != NULL) {
+		if (asprintf(&key, "%s\n%s", path, cfgpp_options()) < 0) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			free(path);
+			fail_exit_with(FAIL_NOMEM);
+		}
+		free(path);
+	}
+	fail_push(fail_free, &key);
+
+	if (dcd_bin) {
+		dcd_bin_read(name, ctx->pp, dcd_v2, &dcd_len, NULL, true);
+		printf("dcd size in bytes = %d (compiled)\n",
+			be16_to_cpu(dcd_v2->header.length));
+	} else if (key && dcd_memo_get(ctx, key, &dcd_len) == 0) {
+		printf("dcd size in bytes = %d (shared)\n",
+			be16_to_cpu(dcd_v2->header.length));
+	} else if (dcd_cache_lookup(name, ctx->pp, dcd_v2, &dcd_len) == 0) {
+		printf("dcd size in bytes = %d (cached)\n",
+			be16_to_cpu(dcd_v2->header.length));
+		if (key)
+			dcd_memo_put(ctx, key, dcd_len);
+	} else {
+		/*
+		 * The file goes through the preprocessor first, the lines
+		 * starting with a # that is not a directive are comments and
+		 * are dropped
+		 */
+		cfgpp_run(ctx->pp, name, parse_cfg_line, ctx);
+		set_dcd_rst_v2(ctx, name, ctx->lineno);
+		dcd_len = ctx->dcd_len;
+		dcd_cache_store(name, ctx->pp, dcd_v2, dcd_len);
+		if (key)
+			dcd_memo_put(ctx, key, dcd_len);
 	}
+	fail_pop(&key, 1);
 
-	set_dcd_rst_v2(dcd_v2, dcd_len, name, lineno);
-	fclose(fd);
+	if (dcd_fold_table)
+		dcd_len = dcd_fold(dcd_v2, dcd_len);
+
+	if (dcd_dep_file)
+		cfgpp_write_deps(dcd_dep_file, dcd_dep_target);
+
+	return dcd_len;
+}
+
+uint32_t parse_cfg_file(dcd_v2_t *dcd_v2, char *name)
+{
+	dcd_parse_t ctx;
+	uint32_t dcd_len;
+
+	dcd_parse_init(&ctx, dcd_v2);
+	dcd_len = dcd_parse_file(&ctx, name);
+	dcd_parse_free(&ctx);
 
 	return dcd_len;
 }
 
+/* Back to the defaults of every option, before a build of libmkimage */
+void mkimage_reset(void)
+{
+	dcd_dep_file = NULL;
+	dcd_dep_target = NULL;
+	dcd_bin = false;
+	dcd_fold_table = false;
+	layout_dump_enabled = 0;
+	uring_depth = 0;
+
+	cfgpp_reset();
+	dcd_fold_reset();
+	output_reset();
+	hash_cache_reset();
+	out_cache_reset();
+	dcd_report_reset();
+}
+
+/* The key of a cfg file is the files read, its lines are not needed */
+static void key_cfg_line(void *arg, char *line, const char *file, int lineno)
+{
+}
+
+static void out_key_cleanup(void *k)
+{
+	out_cache_free(k);
+}
+
+/*
+ * Start the key of the image in the output cache: the options given in
+ * layout, the entries of the image stack with the content of their files
+ * and, for a DCD, of the cfg files it includes. Returns -1 when the cache
+ * is not enabled or an input can not be read, the build reports it. The
+ * key is freed with fail_pop(k, 1), or if the build fails.
+ */
+static int out_cache_key(out_cache_key_t *k, const void *layout, size_t len,
+			const image_t *image_stack)
+{
+	const image_t *img;
+	const char *dep;
+	const uint32_t *fold;
+	uint32_t commit = MKIMAGE_COMMIT;
+	uint32_t option, folds;
+	cfgpp_t *pp;
+	int i, ret = 0;
+
+	if (out_cache_begin(k) < 0)
+		return -1;
+	fail_push(out_key_cleanup, k);
+
+	out_cache_add(k, &commit, sizeof(commit));
+	out_cache_add(k, layout, len);
+	out_cache_add(k, cfgpp_options(), strlen(cfgpp_options()) + 1);
+	folds = dcd_fold_list(&fold);
+	out_cache_add(k, &folds, sizeof(folds));
+	out_cache_add(k, fold, folds * sizeof(*fold));
+
+	for (img = image_stack; ret == 0 && img->option != NO_IMG; img++) {
+		option = img->option;
+		out_cache_add(k, &option, sizeof(option));
+		out_cache_add(k, &img->src, sizeof(img->src));
+		out_cache_add(k, &img->dst, sizeof(img->dst));
+		out_cache_add(k, &img->entry, sizeof(img->entry));
+		out_cache_add(k, &img->ext, sizeof(img->ext));
+		if (img->filename == NULL)
+			continue;
+
+		if (img->option == DCD && dcd_bin) {
+			/* refused with the same error as the build when stale */
+			dcd_v2_t *dcd_v2 = malloc(sizeof(*dcd_v2));
+			uint32_t dcd_len;
+
+			if (dcd_v2 == NULL) {
+				fprintf(stderr, "Failed to allocate memory\n");
+				fail_exit_with(FAIL_NOMEM);
+			}
+			fail_push(fail_free, &dcd_v2);
+			pp = cfgpp_new();
+			fail_push(pp_cleanup, pp);
+			dcd_bin_read(img->filename, pp, dcd_v2, &dcd_len, NULL, true);
+			fail_pop(pp, 1);
+			fail_pop(&dcd_v2, 1);
+			ret = out_cache_add_file(k, img->filename);
+		} else if (img->option == DCD) {
+			pp = cfgpp_new();
+			fail_push(pp_cleanup, pp);
+			cfgpp_run(pp, img->filename, key_cfg_line, NULL);
+			for (i = 0; ret == 0 && (dep = cfgpp_dep(pp, i)) != NULL; i++)
+				ret = out_cache_add_file(k, dep);
+			fail_pop(pp, 1);
+		} else {
+			ret = out_cache_add_file(k, img->filename);
+		}
+	}
+
+	if (ret < 0)
+		fail_pop(k, 1);
+
+	return ret;
+}
+
+/*
+ * getopt keeps its state in globals, the builds of several threads of
+ * libmkimage parse their options one at a time
+ */
+static pthread_mutex_t getopt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void getopt_unlock(void *lock)
+{
+	pthread_mutex_unlock(lock);
+}
+
+/* The options that fork, serve or connect are for the tool, not for a library */
+static void check_not_embedded(const char *opt)
+{
+	if (mkimage_embedded) {
+		fprintf(stderr, "%s is not available in libmkimage\n", opt);
+		fail_exit_with(FAIL_NOTSUP);
+	}
+}
+
 /*
  * Read commandline parameters and construct the header in order
  *
@@ -493,10 +876,20 @@ uint32_t parse_cfg_file(dcd_v2_t *dcd_v2, char *name)
  * parameters passed in
  *
  */
-int main(int argc, char **argv)
+int mkimage_main(int argc, char **argv)
 {
 	int c;
 	char *ofname = NULL;
+	char *dcd_preprocess = NULL;
+	char *dcd_compile = NULL;
+	char *dcd_report_file = NULL;
+	char *dcd_to_c = NULL;
+	char *regmap = NULL;
+	int regmap_instances = 2;
+	char *batch = NULL;
+	int batch_jobs = 0;
+	char *serve = NULL;
+	int serve_jobs = 0;
 	bool output = false;
 	bool dcd_skip = false;
 	bool emmc_fastboot = false;
@@ -513,6 +906,30 @@ int main(int argc, char **argv)
 	uint8_t  fuse_version = 0;
 	uint16_t sw_version   = 0;
 
+	/* the options that change the image, for the key of the output cache */
+	struct {
+		uint32_t soc, rev, sector_size, ivt_offset;
+		uint32_t emmc_fastboot, dcd_skip, dcd_bin, dcd_fold;
+		uint32_t fuse_version, sw_version;
+	} layout;
+	out_cache_key_t out_key;
+	int kept_fd;
+
+	/* digest cache, opt-in from the command line or the environment */
+	char *hash_cache_env = getenv("MKIMAGE_HASH_CACHE");
+	int hash_cache = (hash_cache_env && strcmp(hash_cache_env, "0")) ? 1 : -1;
+	int hash_cache_verify = 0;
+	char *hash_cache_max_env = getenv("MKIMAGE_HASH_CACHE_MAX");
+	char *hash_cache_max_arg = NULL;
+	uint64_t hash_cache_max = HASH_CACHE_DEFAULT_MAX;
+
+	/* image cache, opt-in the same way */
+	char *out_cache_env = getenv("MKIMAGE_OUT_CACHE");
+	int out_cache = (out_cache_env && strcmp(out_cache_env, "0")) ? 1 : -1;
+	char *out_cache_max_env = getenv("MKIMAGE_OUT_CACHE_MAX");
+	char *out_cache_max_arg = NULL;
+	uint64_t out_cache_max = OUT_CACHE_DEFAULT_MAX;
+
 	static struct option long_options[] =
 	{
 		{"scfw", required_argument, NULL, 'f'},
@@ -536,9 +953,49 @@ int main(int argc, char **argv)
 		{"msg_blk", required_argument, NULL, 'M'},
 		{"fuse_version", required_argument, NULL, 'u'},
 		{"sw_version", required_argument, NULL, 'v'},
+		{"selftest-hash", no_argument, NULL, 'H'},
+		{"hash-cache", no_argument, NULL, 'K'},
+		{"no-hash-cache", no_argument, NULL, 'k'},
+		{"hash-cache-verify", required_argument, NULL, 'V'},
+		{"hash-cache-max", required_argument, NULL, 'q'},
+		{"out-cache", no_argument, NULL, 'Z'},
+		{"no-out-cache", no_argument, NULL, 'j'},
+		{"out-cache-max", required_argument, NULL, 'J'},
+		{"hash", required_argument, NULL, 'h'},
+		{"dump-layout", no_argument, NULL, 'L'},
+		{"io-uring", required_argument, NULL, 'Q'},
+		{"out-offset", required_argument, NULL, 'S'},
+		{"update", no_argument, NULL, 'U'},
+		{"D", required_argument, NULL, 'E'},
+		{"I", required_argument, NULL, 'I'},
+		{"dcd-dep", required_argument, NULL, 'Y'},
+		{"dcd-preprocess", required_argument, NULL, 'y'},
+		{"dcd_bin", required_argument, NULL, 'b'},
+		{"dcd-compile", required_argument, NULL, 'B'},
+		{"dcd-fold", required_argument, NULL, 'F'},
+		{"dcd-report", required_argument, NULL, 'R'},
+		{"dcd-cost", required_argument, NULL, 'C'},
+		{"dcd-to-c", required_argument, NULL, 'T'},
+		{"expand-regmap", required_argument, NULL, 'X'},
+		{"batch", required_argument, NULL, 'W'},
+		{"serve", required_argument, NULL, 'N'},
+		{"connect", required_argument, NULL, 'n'},
 		{NULL, 0, NULL, 0}
 	};
 
+	/* a build for the server, the arguments after the socket are sent */
+	if (argc > 2 && (!strcmp(argv[1], "-connect") || !strcmp(argv[1], "--connect"))) {
+		check_not_embedded("-connect");
+		return serve_connect(argv[2], argv[0], argc - 3, argv + 3);
+	}
+
+
+	/* the fields an option does not set are part of the cache key */
+	memset(param_stack, 0, sizeof(param_stack));
+
+	pthread_mutex_lock(&getopt_lock);
+	fail_push(getopt_unlock, &getopt_lock);
+	optind = 0;
 
 	/* scan in parameters in order */
 	while(1)
@@ -577,7 +1034,7 @@ int main(int argc, char **argv)
 					soc = QM;
 				else{
 					fprintf(stdout, "unrecognized SOC: %s \n",optarg);
-					exit(EXIT_FAILURE);
+					fail_exit_with(FAIL_USAGE);
 				}
 				fprintf(stdout, "SOC: %s \n",optarg);
 				break;
@@ -590,7 +1047,7 @@ int main(int argc, char **argv)
 						sector_size = 0x400;
 					} else {
 						fprintf(stdout, "unrecognized REVISION: %s \n",optarg);
-						exit(EXIT_FAILURE);
+						fail_exit_with(FAIL_USAGE);
 					}
 					fprintf(stdout, "REVISION: %s \n",optarg);
 				}
@@ -612,7 +1069,7 @@ int main(int argc, char **argv)
 						dcd_skip = true;
 					} else {
 						fprintf(stderr, "\n-dcd option requires argument skip\n\n");
-						exit(EXIT_FAILURE);
+						fail_exit_with(FAIL_USAGE);
 					}
 				} else {
 					param_stack[p_idx].option = DCD;
@@ -629,12 +1086,12 @@ int main(int argc, char **argv)
 						param_stack[p_idx].entry = (uint32_t) strtoll(argv[optind++], NULL, 0);
 					else {
 						fprintf(stderr, "\n-data option require TWO arguments: filename, load address in hex\n\n");
-						exit(EXIT_FAILURE);
+						fail_exit_with(FAIL_USAGE);
 					}
 					p_idx++;
 				} else {
 					fprintf(stderr, "\n-data option is only used with -rev B0.\n\n");
-					exit(EXIT_FAILURE);
+					fail_exit_with(FAIL_USAGE);
 				}
 				break;
 			case 'm':
@@ -648,7 +1105,7 @@ int main(int argc, char **argv)
 					fprintf(stdout, " addr: 0x%08" PRIx64 "\n", param_stack[p_idx++].entry);
 				} else {
 					fprintf(stderr, "\n-m4 option require THREE arguments: filename, core: 0/1, start address in hex\n\n");
-					exit(EXIT_FAILURE);
+					fail_exit_with(FAIL_USAGE);
 				}
 				break;
 			case 'a':
@@ -664,7 +1121,7 @@ int main(int argc, char **argv)
 						param_stack[p_idx].ext = CORE_CA72;
 					else {
 						fprintf(stderr, "ERROR: AP Core not found %s\n", argv[optind+2]);
-						exit(EXIT_FAILURE);
+						fail_exit_with(FAIL_USAGE);
 					}
 					fprintf(stdout, "\tcore: %s", argv[optind++]);
 
@@ -673,7 +1130,7 @@ int main(int argc, char **argv)
 					fprintf(stdout, " addr: 0x%08" PRIx64 "\n", param_stack[p_idx++].entry);
 				} else {
 					fprintf(stderr, "\n-ap option require THREE arguments: filename, a35/a53/a72, start address in hex\n\n");
-					exit(EXIT_FAILURE);
+					fail_exit_with(FAIL_USAGE);
 				}
 				break;
 			case 'l':
@@ -683,7 +1140,10 @@ int main(int argc, char **argv)
 				break;
 			case 'o':
 				fprintf(stdout, "Output:\t%s\n", optarg);
-				ofname = optarg;
+				if (output)
+					output_add_target(optarg);
+				else
+					ofname = optarg;
 				output = true;
 				break;
 			case 'x':
@@ -723,7 +1183,7 @@ int main(int argc, char **argv)
 						emmc_fastboot = true;/* emmc boot */
 				} else {
 					fprintf(stdout, "\n-dev option, Valid boot devices are:\r\n sd\r\nflexspi\r\nnand\n\n");
-					exit(EXIT_FAILURE);
+					fail_exit_with(FAIL_USAGE);
 				}
 				break;
 			case 'c':
@@ -732,11 +1192,145 @@ int main(int argc, char **argv)
 					break;
 			case ':':
 				fprintf(stderr, "option %c missing arguments\n", optopt);
-				exit(EXIT_FAILURE);
+				fail_exit_with(FAIL_USAGE);
 				break;
 			case 't':
+				fail_pop(&getopt_lock, 1);
 				fprintf(stdout, "%08x\n", MKIMAGE_COMMIT);
-				exit(0);
+				return 0;
+				break;
+			case 'H':
+				fail_pop(&getopt_lock, 1);
+				return sha2_selftest() ? EXIT_FAILURE : 0;
+				break;
+			case 'K':
+				hash_cache = 1;
+				break;
+			case 'k':
+				hash_cache = 0;
+				break;
+			case 'V':
+				hash_cache_verify = (int) strtol(optarg, NULL, 0);
+				break;
+			case 'q':
+				hash_cache_max_arg = optarg;
+				break;
+			case 'Z':
+				out_cache = 1;
+				break;
+			case 'j':
+				out_cache = 0;
+				break;
+			case 'J':
+				out_cache_max_arg = optarg;
+				break;
+			case 'h':
+				fprintf(stdout, "HASH:\t%s\n", optarg);
+				param_stack[p_idx].option = HASH;
+				if (!strcmp(optarg, "sha256"))
+					param_stack[p_idx++].entry = HASH_TYPE_SHA_256;
+				else if (!strcmp(optarg, "sha384"))
+					param_stack[p_idx++].entry = HASH_TYPE_SHA_384;
+				else if (!strcmp(optarg, "sha512"))
+					param_stack[p_idx++].entry = HASH_TYPE_SHA_512;
+				else {
+					fprintf(stderr, "ERROR: hash not supported %s, valid values are sha256, sha384 and sha512\n", optarg);
+					fail_exit_with(FAIL_USAGE);
+				}
+				break;
+			case 'L':
+				layout_dump_enabled = 1;
+				break;
+			case 'Q':
+				uring_depth = (unsigned int) strtoul(optarg, NULL, 0);
+				break;
+			case 'S':
+				fprintf(stdout, "Output offset:\t%s\n", optarg);
+				output_offset = (off_t) strtoll(optarg, NULL, 0);
+				break;
+			case 'U':
+				output_update = 1;
+				break;
+			case 'E':
+				cfgpp_define(optarg);
+				break;
+			case 'I':
+				cfgpp_include_dir(optarg);
+				break;
+			case 'Y':
+				dcd_dep_file = optarg;
+				break;
+			case 'y':
+				dcd_preprocess = optarg;
+				break;
+			case 'b':
+				fprintf(stdout, "DCD:\t%s\n", optarg);
+				if (rev == B0) {
+					fprintf(stderr, "\n-dcd_bin option is not used with -rev B0.\n\n");
+					fail_exit_with(FAIL_USAGE);
+				}
+				dcd_bin = true;
+				param_stack[p_idx].option = DCD;
+				param_stack[p_idx].filename = optarg;
+				p_idx++;
+				break;
+			case 'B':
+				dcd_compile = optarg;
+				break;
+			case 'F':
+				dcd_fold_add(optarg);
+				dcd_fold_table = true;
+				break;
+			case 'R':
+				dcd_report_file = optarg;
+				break;
+			case 'C':
+				dcd_report_cost(optarg);
+				break;
+			case 'T':
+				dcd_to_c = optarg;
+				break;
+			case 'X':
+				regmap = optarg;
+				if (optind < argc && *argv[optind] != '-')
+					regmap_instances = strtol(argv[optind++], NULL, 0);
+				if (regmap_instances < 1) {
+					fprintf(stderr, "-expand-regmap: invalid number of instances\n");
+					fail_exit_with(FAIL_USAGE);
+				}
+				break;
+			case 'W':
+				check_not_embedded("-batch");
+				if (batch_worker) {
+					fprintf(stderr, "-batch can not be used in a build of -batch or -serve\n");
+					fail_exit_with(FAIL_USAGE);
+				}
+				batch = optarg;
+				if (optind < argc && *argv[optind] != '-')
+					batch_jobs = strtol(argv[optind++], NULL, 0);
+				if (batch_jobs < 0) {
+					fprintf(stderr, "-batch: invalid number of jobs\n");
+					fail_exit_with(FAIL_USAGE);
+				}
+				break;
+			case 'N':
+				check_not_embedded("-serve");
+				if (batch_worker) {
+					fprintf(stderr, "-serve can not be used in a build of -batch or -serve\n");
+					fail_exit_with(FAIL_USAGE);
+				}
+				serve = optarg;
+				if (optind < argc && *argv[optind] != '-')
+					serve_jobs = strtol(argv[optind++], NULL, 0);
+				if (serve_jobs < 0) {
+					fprintf(stderr, "-serve: invalid number of jobs\n");
+					fail_exit_with(FAIL_USAGE);
+				}
+				break;
+			case 'n':
+				check_not_embedded("-connect");
+				fprintf(stderr, "-connect must be the first option\n");
+				fail_exit_with(FAIL_USAGE);
 				break;
 			case 'P':
 				fprintf(stdout, "FILEOFF:\t%s\n", optarg);
@@ -756,7 +1350,7 @@ int main(int argc, char **argv)
 						param_stack[p_idx].ext = SC_R_ROM_0;
 					else {
 						fprintf(stderr, "ERROR: MSG type not found %s\n", argv[optind+2]);
-						exit(EXIT_FAILURE);
+						fail_exit_with(FAIL_USAGE);
 					}
 					fprintf(stdout, "\ttype: %s", argv[optind++]);
 
@@ -765,7 +1359,7 @@ int main(int argc, char **argv)
 					fprintf(stdout, " addr: 0x%08" PRIx64 "\n", param_stack[p_idx++].entry);
 				} else {
 					fprintf(stderr, "\nmsg block option require THREE arguments: filename, debug/fuse/field, start address in hex\n\n");
-					exit(EXIT_FAILURE);
+					fail_exit_with(FAIL_USAGE);
 				}
 				break;
 			case 'u':
@@ -779,8 +1373,134 @@ int main(int argc, char **argv)
 				/* invalid option */
 				fprintf(stderr, "option '%c' is invalid: ignored\n",
 					optopt);
-				exit(EXIT_FAILURE);
+				fail_exit_with(FAIL_USAGE);
+		}
+	}
+	fail_pop(&getopt_lock, 1);
+
+	/*
+	 * run the builds of a manifest, the options given with it apply to
+	 * all of them
+	 */
+	if (batch) {
+		if (hash_cache >= 0)
+			setenv("MKIMAGE_HASH_CACHE", hash_cache ? "1" : "0", 1);
+		if (out_cache >= 0)
+			setenv("MKIMAGE_OUT_CACHE", out_cache ? "1" : "0", 1);
+		if (out_cache_max_arg)
+			setenv("MKIMAGE_OUT_CACHE_MAX", out_cache_max_arg, 1);
+		if (hash_cache_max_arg)
+			setenv("MKIMAGE_HASH_CACHE_MAX", hash_cache_max_arg, 1);
+		return batch_run(batch, batch_jobs, argv[0], mkimage_main) ? EXIT_FAILURE : 0;
+	}
+
+	/* serve the builds sent to the socket, with the options given here */
+	if (serve) {
+		if (hash_cache >= 0)
+			setenv("MKIMAGE_HASH_CACHE", hash_cache ? "1" : "0", 1);
+		if (out_cache >= 0)
+			setenv("MKIMAGE_OUT_CACHE", out_cache ? "1" : "0", 1);
+		if (out_cache_max_arg)
+			setenv("MKIMAGE_OUT_CACHE_MAX", out_cache_max_arg, 1);
+		if (hash_cache_max_arg)
+			setenv("MKIMAGE_HASH_CACHE_MAX", hash_cache_max_arg, 1);
+		serve_run(serve, serve_jobs, mkimage_main);
+		return EXIT_FAILURE;
+	}
+
+	dcd_dep_target = ofname;
+
+	/*
+	 * only write the preprocessed cfg file, in place of $(CC) -E, or the
+	 * cfg file as C
+	 */
+	if (dcd_preprocess || dcd_to_c) {
+		FILE *fp;
+
+		if (!output) {
+			fprintf(stderr, "%s requires an output file (-out)\n",
+				dcd_preprocess ? "-dcd-preprocess" : "-dcd-to-c");
+			fail_exit_with(FAIL_USAGE);
+		}
+		fp = fopen(ofname, "w");
+		if (fp == NULL) {
+			fprintf(stderr, "%s: Can't open: %s\n", ofname, strerror(errno));
+			fail_exit_with(FAIL_OUTPUT);
+		}
+		fail_push(fail_fclose, &fp);
+		if (dcd_preprocess) {
+			cfgpp_t *pp = cfgpp_new();
+
+			fail_push(pp_cleanup, pp);
+			cfgpp_run(pp, dcd_preprocess, write_cfg_line, fp);
+			fail_pop(pp, 1);
+		} else {
+			write_cfg_c(fp, dcd_to_c);
+		}
+		fail_pop(&fp, 0);
+		if (fclose(fp) != 0) {
+			fprintf(stderr, "%s: Write error: %s\n", ofname, strerror(errno));
+			fail_exit_with(FAIL_OUTPUT);
+		}
+		if (dcd_dep_file)
+			cfgpp_write_deps(dcd_dep_file, dcd_dep_target);
+		return 0;
+	}
+
+	/* only expand a register map header, to -out or the standard output */
+	if (regmap) {
+		FILE *fp = stdout;
+
+		if (output) {
+			fp = fopen(ofname, "w");
+			if (fp == NULL) {
+				fprintf(stderr, "%s: Can't open: %s\n", ofname, strerror(errno));
+				fail_exit_with(FAIL_OUTPUT);
+			}
+			fail_push(fail_fclose, &fp);
+		}
+		regmap_expand(regmap, fp, regmap_instances);
+		if (output)
+			fail_pop(&fp, 0);
+		/* the standard output stays open, for the builds that follow */
+		if ((output ? fclose(fp) : fflush(fp)) != 0) {
+			fprintf(stderr, "%s: Write error: %s\n", output ? ofname : "stdout",
+				strerror(errno));
+			fail_exit_with(FAIL_OUTPUT);
 		}
+		return 0;
+	}
+
+	/* only parse the cfg file and report what the ROM will run */
+	if (dcd_report_file) {
+		dcd_v2_t dcd_v2;
+		uint32_t dcd_len;
+
+		memset(&dcd_v2, 0, sizeof(dcd_v2));
+		dcd_len = parse_cfg_file(&dcd_v2, dcd_report_file);
+		dcd_report(&dcd_v2, dcd_len, dcd_report_file);
+		return 0;
+	}
+
+	/* only parse the cfg file and save the table, for -dcd_bin */
+	if (dcd_compile) {
+		dcd_parse_t ctx;
+		dcd_v2_t dcd_v2;
+		uint32_t dcd_len;
+
+		if (!output) {
+			fprintf(stderr, "-dcd-compile requires an output file (-out)\n");
+			fail_exit_with(FAIL_USAGE);
+		}
+		memset(&dcd_v2, 0, sizeof(dcd_v2));
+		dcd_parse_init(&ctx, &dcd_v2);
+		dcd_len = dcd_parse_file(&ctx, dcd_compile);
+		if (dcd_bin_write(ofname, ctx.pp, &dcd_v2, dcd_len) < 0) {
+			fprintf(stderr, "%s: Write error: %s\n", ofname, strerror(errno));
+			fail_exit_with(FAIL_OUTPUT);
+		}
+		dcd_parse_free(&ctx);
+		return 0;
 	}
 
 	fprintf(stdout, "CONTAINER FUSE VERSION:\t0x%02x\n", fuse_version);
@@ -790,18 +1510,68 @@ int main(int argc, char **argv)
 
 	if(soc == NONE){
 		fprintf(stderr, " No SOC defined");
-		exit(EXIT_FAILURE);
+		fail_exit_with(FAIL_USAGE);
 	}
 
 	if(container < 0)
 	{ /* check to make sure there is at least 1 container defined */
 		fprintf(stderr, " No Container defined");
-		exit(EXIT_FAILURE);
+		fail_exit_with(FAIL_USAGE);
 	}
 
 	if (!output) {
 		fprintf(stderr, "mandatory args scfw and output file name missing! abort\n");
-		exit(EXIT_FAILURE);
+		fail_exit_with(FAIL_USAGE);
+	}
+
+	if (output_update && rev != B0) {
+		fprintf(stdout, "-update is only supported with -rev B0, rebuilding %s\n", ofname);
+		output_update = 0;
+	}
+
+	if (hash_cache > 0 || (hash_cache < 0 && hash_cache_verify > 0)) {
+		if (hash_cache_max_arg == NULL)
+			hash_cache_max_arg = hash_cache_max_env;
+		if (hash_cache_max_arg &&
+		    cache_parse_size(hash_cache_max_arg, &hash_cache_max) < 0) {
+			fprintf(stderr, "-hash-cache-max: invalid size %s\n", hash_cache_max_arg);
+			fail_exit_with(FAIL_USAGE);
+		}
+		hash_cache_init(NULL, hash_cache_verify, hash_cache_max);
+	}
+
+	if (out_cache > 0) {
+		if (out_cache_max_arg == NULL)
+			out_cache_max_arg = out_cache_max_env;
+		if (out_cache_max_arg && cache_parse_size(out_cache_max_arg, &out_cache_max) < 0) {
+			fprintf(stderr, "-out-cache-max: invalid size %s\n", out_cache_max_arg);
+			fail_exit_with(FAIL_USAGE);
+		}
+		out_cache_init(NULL, out_cache_max);
+	}
+
+	/* the same options and inputs give the same image, it is not built again */
+	memset(&layout, 0, sizeof(layout));
+	layout.soc = soc;
+	layout.rev = rev;
+	layout.sector_size = sector_size;
+	layout.ivt_offset = ivt_offset;
+	layout.emmc_fastboot = emmc_fastboot;
+	layout.dcd_skip = dcd_skip;
+	layout.dcd_bin = dcd_bin;
+	layout.dcd_fold = dcd_fold_table;
+	layout.fuse_version = fuse_version;
+	layout.sw_version = sw_version;
+	if (out_cache_key(&out_key, &layout, sizeof(layout), param_stack) == 0) {
+		if (out_cache_fetch(&out_key, ofname, sector_size) == 0) {
+			fail_pop(&out_key, 1);
+			if (dcd_dep_file)
+				cfgpp_write_deps(dcd_dep_file, dcd_dep_target);
+			fprintf(stdout, "DONE.\n");
+			fprintf(stdout, "Note: Please copy image to offset: IVT_OFFSET + IMAGE_OFFSET\n");
+			return 0;
+		}
+		output_keep = 1;
 	}
 
 	/* Now begin assembling the image acording to each SOC container */
@@ -831,9 +1601,17 @@ int main(int argc, char **argv)
 			break;
 		default:
 			fprintf(stderr, " unrecognized SOC defined");
-			exit(EXIT_FAILURE);
+			fail_exit_with(FAIL_USAGE);
 	}
 
+	if (output_keep) {
+		kept_fd = output_kept();
+		out_cache_store(&out_key, kept_fd);
+		if (kept_fd >= 0)
+			close(kept_fd);
+		fail_pop(&out_key, 1);
+		output_keep = 0;
+	}
 
 	fprintf(stdout, "DONE.\n");
 	fprintf(stdout, "Note: Please copy image to offset: IVT_OFFSET + IMAGE_OFFSET\n");
@@ -0,0 +1,262 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * On-disk cache of the built images, for -out-cache. An image is keyed by
+ * the SHA-256 of the options that change its layout and of the content of
+ * every file it is made of, the cfg files a DCD includes among them: the
+ * same key always gives the same image. On a hit the cached image is
+ * copied to the output, with its extents shared on a file system with
+ * reflinks, and nothing is built. One file per image, named by its key,
+ * written to a temporary name and renamed as in the digest cache. Once
+ * the images take more than -out-cache-max, the least recently used ones
+ * are removed.
+ */
+
+#include "mkimage_common.h"
+
+#include <limits.h>
+#include <pthread.h>
+
+#define OUT_CACHE_MAGIC		"mkimage_imx8 out 1"
+#define OUT_CACHE_DIGEST_LEN	(HASH_TYPE_SHA_256 / 8)
+#define OUT_CACHE_READ_SIZE	(1 << 16)
+
+struct out_cache_input {
+	char *name;
+	struct stat st;
+};
+
+static __thread char *cache_dir;
+static __thread uint64_t cache_max;
+
+/*
+ * Enable the cache in dir, or in $XDG_CACHE_HOME/mkimage_imx8/out when
+ * NULL, the images in it taking max bytes at most.
+ */
+void out_cache_init(const char *dir, uint64_t max)
+{
+	free(cache_dir);
+	cache_dir = dir ? strdup(dir) : cache_default_dir("/out");
+	cache_max = max;
+
+	if (cache_dir == NULL) {
+		fprintf(stderr, "Warning: no directory for the output cache, not used\n");
+		return;
+	}
+
+	cache_mkdir(cache_dir);
+
+	/* a lower max applies at once */
+	cache_prune(cache_dir, cache_max);
+}
+
+/* Disable the cache, for the next build */
+void out_cache_reset(void)
+{
+	free(cache_dir);
+	cache_dir = NULL;
+	cache_max = 0;
+}
+
+/* Start the key of an image, returns -1 when the cache is not enabled */
+int out_cache_begin(out_cache_key_t *k)
+{
+	memset(k, 0, sizeof(*k));
+	if (cache_dir == NULL)
+		return -1;
+
+	sha2_init(&k->ctx, HASH_TYPE_SHA_256);
+	sha2_update(&k->ctx, OUT_CACHE_MAGIC, sizeof(OUT_CACHE_MAGIC));
+	k->settled = true;
+
+	return 0;
+}
+
+void out_cache_add(out_cache_key_t *k, const void *data, size_t len)
+{
+	sha2_update(&k->ctx, data, len);
+}
+
+/* SHA-256 of the content of the file open on fd, from the digest cache if it is there */
+static int out_cache_digest(int fd, const struct stat *st, uint8_t *digest)
+{
+	sha2_ctx_t ctx;
+	uint8_t *buf;
+	ssize_t n;
+
+	/* the digest of an image padded to its own size is its content's */
+	if (st->st_size <= UINT32_MAX &&
+	    hash_cache_lookup(st, st->st_size, HASH_TYPE_SHA_256, digest) == HASH_CACHE_HIT)
+		return 0;
+
+	buf = malloc(OUT_CACHE_READ_SIZE);
+	if (buf == NULL)
+		return -1;
+
+	sha2_init(&ctx, HASH_TYPE_SHA_256);
+	while ((n = read(fd, buf, OUT_CACHE_READ_SIZE)) > 0)
+		sha2_update(&ctx, buf, n);
+	free(buf);
+	if (n < 0)
+		return -1;
+	sha2_final(&ctx, digest);
+
+	if (st->st_size <= UINT32_MAX)
+		hash_cache_store(st, st->st_size, HASH_TYPE_SHA_256, digest);
+
+	return 0;
+}
+
+/*
+ * Add the content of the file name to the key. Returns -1 when it can not
+ * be read, the image is then built and the build reports it.
+ */
+int out_cache_add_file(out_cache_key_t *k, const char *name)
+{
+	uint8_t digest[OUT_CACHE_DIGEST_LEN];
+	struct out_cache_input *in;
+	struct stat st;
+	uint64_t size;
+	int fd, ret;
+
+	fd = open(name, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return -1;
+	}
+	ret = out_cache_digest(fd, &st, digest);
+	close(fd);
+	if (ret < 0)
+		return -1;
+
+	size = st.st_size;
+	sha2_update(&k->ctx, &size, sizeof(size));
+	sha2_update(&k->ctx, digest, sizeof(digest));
+
+	/* checked again before the image is stored */
+	in = realloc(k->inputs, (k->input_count + 1) * sizeof(*in));
+	if (in == NULL)
+		return -1;
+	k->inputs = in;
+	in += k->input_count;
+	in->name = strdup(name);
+	in->st = st;
+	if (in->name == NULL)
+		return -1;
+	k->input_count++;
+
+	if (!hash_cache_settled(&st))
+		k->settled = false;
+
+	return 0;
+}
+
+/*
+ * Complete the key and look the image up. On a hit it is written to the
+ * output name as the build would, block is the sector size, and 0 is
+ * returned. Returns -1 on a miss.
+ */
+int out_cache_fetch(out_cache_key_t *k, const char *name, uint32_t block)
+{
+	uint8_t digest[OUT_CACHE_DIGEST_LEN];
+	char hex[2 * OUT_CACHE_DIGEST_LEN + 1];
+	struct stat st, ost;
+	int cfd, ofd, i;
+
+	sha2_final(&k->ctx, digest);
+	for (i = 0; i < OUT_CACHE_DIGEST_LEN; i++)
+		sprintf(hex + 2 * i, "%02x", digest[i]);
+	if (asprintf(&k->path, "%s/%s", cache_dir, hex) < 0) {
+		k->path = NULL;
+		return -1;
+	}
+
+	cfd = open(k->path, O_RDONLY | O_BINARY);
+	if (cfd < 0)
+		return -1;
+	if (fstat(cfd, &st) < 0) {
+		close(cfd);
+		return -1;
+	}
+	cache_touch(cfd);
+
+	ofd = output_open(name);
+	if (ofd < 0) {
+		fprintf(stderr, "%s: Can't open: %s\n", name, strerror(errno));
+		close(cfd);
+		fail_exit_with(FAIL_OUTPUT);
+	}
+
+	/* with -update the output is not truncated when opened */
+	if (copy_fd_range(ofd, 0, cfd, 0, st.st_size, 0) < 0 ||
+	    fstat(ofd, &ost) < 0 ||
+	    (S_ISREG(ost.st_mode) && ftruncate(ofd, st.st_size) < 0)) {
+		fprintf(stderr, "%s: Write error: %s\n", name, strerror(errno));
+		close(cfd);
+		fail_exit_with(FAIL_OUTPUT);
+	}
+	close(cfd);
+
+	fprintf(stdout, "CACHED:\t%s\n", hex);
+	output_close(ofd, name, block);
+
+	return 0;
+}
+
+/*
+ * Store the image just built, open on fd, under the key k looked up in
+ * out_cache_fetch(). It is not when an input was written while it was
+ * built or in the last seconds, the key may not be its content anymore.
+ */
+void out_cache_store(out_cache_key_t *k, int fd)
+{
+	char tmp[PATH_MAX + 32];
+	struct stat st;
+	int i, tfd, ret;
+
+	if (k->path == NULL || !k->settled || fd < 0 || fstat(fd, &st) < 0 ||
+	    (uint64_t) st.st_size > cache_max)
+		return;
+
+	for (i = 0; i < k->input_count; i++) {
+		const struct stat *was = &k->inputs[i].st;
+		struct stat now;
+
+		if (stat(k->inputs[i].name, &now) < 0 ||
+		    now.st_dev != was->st_dev || now.st_ino != was->st_ino ||
+		    now.st_size != was->st_size ||
+		    now.st_mtim.tv_sec != was->st_mtim.tv_sec ||
+		    now.st_mtim.tv_nsec != was->st_mtim.tv_nsec)
+			return;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.%lx", k->path, getpid(),
+		(unsigned long)pthread_self());
+	tfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (tfd < 0)
+		return;
+
+	ret = copy_fd_range(tfd, 0, fd, 0, st.st_size, 0) < 0 ||
+		ftruncate(tfd, st.st_size) < 0 ? -1 : 0;
+	if (close(tfd) < 0 || ret < 0 || rename(tmp, k->path) < 0) {
+		unlink(tmp);
+		return;
+	}
+
+	cache_prune(cache_dir, cache_max);
+}
+
+void out_cache_free(out_cache_key_t *k)
+{
+	int i;
+
+	for (i = 0; i < k->input_count; i++)
+		free(k->inputs[i].name);
+	free(k->inputs);
+	free(k->path);
+	memset(k, 0, sizeof(*k));
+}
@@ -0,0 +1,447 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Write the image straight to the boot device. The image is built in an
+ * unlinked staging file on disk, then compared block by block with what is
+ * on the device at the given offset and only the blocks that differ are
+ * written, with O_DIRECT when the device allows it. Rewriting a boot area
+ * where only one image changed costs a read of it and a few writes.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "fileio.h"
+#include "fail.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+/* blocks compared at once */
+#define OUTPUT_CHUNK_SIZE	(1 << 20)
+
+/* progress of each output printed every this many bytes of the image */
+#define OUTPUT_PROGRESS_SIZE	(64 << 20)
+
+#define OUTPUT_MAX_TARGETS	31
+
+__thread off_t output_offset = -1;
+__thread int output_update;
+
+/* the outputs after the first one */
+static __thread const char *output_targets[OUTPUT_MAX_TARGETS];
+static __thread int output_target_count;
+
+static __thread int output_staged;
+
+/* the fd of output_open(), closed if the build fails before output_close() */
+static __thread int output_fd = -1;
+
+/* the image, kept open by output_close() when output_keep is set */
+__thread int output_keep;
+static __thread int output_kept_fd = -1;
+
+typedef struct {
+	const char *name;
+	int sfd;		/* staged image */
+	unsigned int block;
+	off_t offset;		/* output_offset of the build */
+	int multi;		/* more than one target */
+	int ret;
+} output_target_t;
+
+/*
+ * An unlinked file to stage the image in, in $TMPDIR or /var/tmp: not in
+ * memory, as /tmp often is, a data image can take gigabytes.
+ */
+static int output_stage_open(void)
+{
+	const char *dirs[] = { getenv("TMPDIR"), "/var/tmp", "/tmp" };
+	char *path;
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+		if (dirs[i] == NULL || dirs[i][0] == 0)
+			continue;
+#ifdef O_TMPFILE
+		fd = open(dirs[i], O_TMPFILE|O_RDWR|O_CLOEXEC, 0600);
+		if (fd >= 0)
+			return fd;
+#endif
+		if (asprintf(&path, "%s/mkimage_imx8.XXXXXX", dirs[i]) < 0)
+			return -1;
+		fd = mkostemp(path, O_CLOEXEC);
+		if (fd >= 0)
+			unlink(path);
+		free(path);
+		if (fd >= 0)
+			return fd;
+	}
+
+	return -1;
+}
+
+/*
+ * Open the output file. A block device, or any file when an output offset
+ * is set or there are several outputs, is not written directly: the image
+ * goes to a staging file that output_close() copies over. Returns the fd
+ * to build the image in, closed by output_close() or if the build fails.
+ */
+int output_open(const char *name)
+{
+	struct stat sbuf;
+
+	output_staged = output_offset >= 0 || output_target_count > 0 ||
+		(stat(name, &sbuf) == 0 && S_ISBLK(sbuf.st_mode));
+	if (!output_staged)
+		output_fd = open(name, O_RDWR|O_CREAT|O_BINARY|(output_update ? 0 : O_TRUNC), 0666);
+	else
+		output_fd = output_stage_open();
+
+	if (output_fd >= 0)
+		fail_push(fail_close, &output_fd);
+
+	return output_fd;
+}
+
+/*
+ * Open the existing output read only for -update to compare the new image
+ * with. Returns -1 when it can not be updated in place: it does not exist,
+ * or it is staged, where the blocks that do not change are skipped anyway.
+ */
+int output_open_old(const char *name)
+{
+	struct stat sbuf;
+
+	if (output_offset >= 0 || output_target_count > 0 ||
+	    stat(name, &sbuf) < 0 || !S_ISREG(sbuf.st_mode))
+		return -1;
+
+	return open(name, O_RDONLY|O_BINARY);
+}
+
+/* Add an output written with the same image as the first one, -out given again */
+void output_add_target(const char *name)
+{
+	if (output_target_count == OUTPUT_MAX_TARGETS) {
+		fprintf(stderr, "Too many outputs, at most %d\n", OUTPUT_MAX_TARGETS + 1);
+		fail_exit_with(FAIL_USAGE);
+	}
+	output_targets[output_target_count++] = name;
+}
+
+/* Open the target, with O_DIRECT if *direct is set and it is supported */
+static int output_open_direct(const char *name, int *direct)
+{
+	int fd = -1;
+
+	if (*direct)
+		fd = open(name, O_RDWR|O_CREAT|O_BINARY|O_DIRECT, 0666);
+	if (fd < 0) {
+		/* file systems such as tmpfs do not support O_DIRECT */
+		*direct = 0;
+		fd = open(name, O_RDWR|O_CREAT|O_BINARY, 0666);
+	}
+	if (fd < 0)
+		fprintf(stderr, "%s: Can't open: %s\n",
+			name, strerror(errno));
+
+	return fd;
+}
+
+/* Open the target again without O_DIRECT, after an EINVAL */
+static int output_reopen(const char *name, int fd, int *direct)
+{
+	close(fd);
+	*direct = 0;
+
+	return output_open_direct(name, direct);
+}
+
+/* The logical block size of a block device, 0 when unknown */
+static unsigned int output_dev_block(int fd, const struct stat *st)
+{
+#ifdef BLKSSZGET
+	int lbs;
+
+	if (S_ISBLK(st->st_mode) && ioctl(fd, BLKSSZGET, &lbs) == 0 && lbs > 0)
+		return lbs;
+#endif
+	return 0;
+}
+
+/*
+ * Copy the staged image to a target, block by block. The target blocks
+ * are read, the ones that already hold the data are skipped. A partial
+ * last block keeps what follows the image on the device. Errors are
+ * reported here, each target fails on its own: returns 0 or -1.
+ */
+static int output_sync(output_target_t *t)
+{
+	struct stat sbuf, dst;
+	off_t len, pos, off, n, base;
+	unsigned int written = 0, blocks = 0, block = t->block, lbs;
+	uint8_t *dev = NULL, *img = NULL;
+	int fd, direct = 1, ret = -1;
+	size_t i, chunk, run;
+	const char *err = NULL;
+
+	/* without -out-offset the file is the image, it does not keep a tail */
+	base = t->offset < 0 ? 0 : t->offset;
+
+	fd = output_open_direct(t->name, &direct);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &dst) < 0) {
+		err = "Can't stat";
+		goto out;
+	}
+
+	/*
+	 * O_DIRECT writes whole logical blocks, 4K on some devices: the runs
+	 * are made of them when the offset allows it, the writes go through
+	 * the page cache otherwise.
+	 */
+	lbs = output_dev_block(fd, &dst);
+	if (lbs > block) {
+		if (lbs <= 4096 && OUTPUT_CHUNK_SIZE % lbs == 0 && base % lbs == 0) {
+			block = lbs;
+		} else if (direct) {
+			fd = output_reopen(t->name, fd, &direct);
+			if (fd < 0)
+				goto out;
+		}
+	}
+
+	if (fstat(t->sfd, &sbuf) < 0) {
+		fprintf(stderr, "Can't stat the staged image: %s\n",
+			strerror(errno));
+		goto out;
+	}
+	len = sbuf.st_size;
+
+	/* O_DIRECT needs buffers aligned to the logical block size */
+	if (posix_memalign((void **)&dev, 4096, OUTPUT_CHUNK_SIZE) ||
+	    posix_memalign((void **)&img, 4096, OUTPUT_CHUNK_SIZE)) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		goto out;
+	}
+
+	for (pos = 0; pos < len; pos += chunk) {
+		chunk = len - pos < OUTPUT_CHUNK_SIZE ? len - pos : OUTPUT_CHUNK_SIZE;
+		chunk = (chunk + block - 1) / block * block;
+		off = base + pos;
+
+		n = pread(fd, dev, chunk, off);
+		if (n < 0 && errno == EINVAL && direct) {
+			/* the device blocks are larger than the sector size */
+			fd = output_reopen(t->name, fd, &direct);
+			if (fd < 0)
+				goto out;
+			n = pread(fd, dev, chunk, off);
+		}
+		if (n < 0) {
+			err = "Read error";
+			goto out;
+		}
+		/* past the end of a regular file */
+		memset(dev + n, 0, chunk - n);
+
+		/* the bytes after the image keep the device content */
+		memcpy(img, dev, chunk);
+		n = len - pos < (off_t) chunk ? len - pos : (off_t) chunk;
+		if (pread(t->sfd, img, n, pos) != n) {
+			fprintf(stderr, "Can't read the staged image: %s\n",
+				strerror(errno));
+			goto out;
+		}
+
+		/* write the runs of blocks that differ */
+		for (i = 0; i < chunk; i += run) {
+			blocks++;
+			if (!memcmp(dev + i, img + i, block)) {
+				run = block;
+				continue;
+			}
+			for (run = block; i + run < chunk &&
+			     memcmp(dev + i + run, img + i + run, block); run += block)
+				blocks++;
+			n = pwrite(fd, img + i, run, off + i);
+			if (n < 0 && errno == EINVAL && direct) {
+				/* a file system with larger blocks for O_DIRECT */
+				fd = output_reopen(t->name, fd, &direct);
+				if (fd < 0)
+					goto out;
+				n = pwrite(fd, img + i, run, off + i);
+			}
+			if (n != (off_t) run) {
+				err = "Write error";
+				goto out;
+			}
+			written += run / block;
+		}
+
+		/* a large image takes a while, each output tells where it is */
+		if ((pos + chunk) / OUTPUT_PROGRESS_SIZE != pos / OUTPUT_PROGRESS_SIZE &&
+		    pos + (off_t) chunk < len)
+			fprintf(stdout, "Output:\t%s: %llu of %llu MB, %u blocks written\n",
+				t->name, (unsigned long long) (pos + chunk) >> 20,
+				(unsigned long long) len >> 20, written);
+	}
+
+	/*
+	 * A regular file only grows up to the end of the image at an offset,
+	 * it ends with the image otherwise.
+	 */
+	if (S_ISREG(dst.st_mode) &&
+	    (t->offset < 0 || dst.st_size < base + len) &&
+	    ftruncate(fd, base + len) < 0) {
+		err = "Can't truncate";
+		goto out;
+	}
+
+	if (fsync(fd) < 0) {
+		err = "Sync error";
+		goto out;
+	}
+
+	if (t->multi)
+		fprintf(stdout, "Output:\t%s: %u of %u blocks of 0x%x written at 0x%llx%s\n",
+			t->name, written, blocks, block, (unsigned long long) base,
+			direct ? "" : " (no O_DIRECT)");
+	else
+		fprintf(stdout, "Output:\t%u of %u blocks of 0x%x written at 0x%llx%s\n",
+			written, blocks, block, (unsigned long long) base,
+			direct ? "" : " (no O_DIRECT)");
+	ret = 0;
+
+out:
+	if (err)
+		fprintf(stderr, "%s: %s: %s\n", t->name, err, strerror(errno));
+	free(dev);
+	free(img);
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+static void *output_worker(void *arg)
+{
+	output_target_t *t = arg;
+
+	t->ret = output_sync(t);
+
+	return NULL;
+}
+
+/*
+ * Copy the staged image to every target, one thread each: the image is
+ * read from the page cache and a slow device only delays its own thread.
+ * Each one prints its progress as it goes, then a summary.
+ */
+static void output_fan_out(int sfd, const char *name, unsigned int block)
+{
+	output_target_t t[OUTPUT_MAX_TARGETS + 1];
+	pthread_t threads[OUTPUT_MAX_TARGETS + 1];
+	int started[OUTPUT_MAX_TARGETS + 1];
+	int i, n = output_target_count + 1, failed = 0;
+
+	if (block == 0 || OUTPUT_CHUNK_SIZE % block) {
+		fprintf(stderr, "Invalid output block size 0x%x\n", block);
+		fail_exit_with(FAIL_USAGE);
+	}
+	if (output_offset > 0 && output_offset % block) {
+		fprintf(stderr, "Output offset 0x%llx is not aligned to the sector size 0x%x\n",
+			(unsigned long long) output_offset, block);
+		fail_exit_with(FAIL_USAGE);
+	}
+
+	for (i = 0; i < n; i++) {
+		t[i].name = i ? output_targets[i - 1] : name;
+		t[i].sfd = sfd;
+		t[i].block = block;
+		t[i].offset = output_offset;
+		t[i].multi = n > 1;
+		t[i].ret = -1;
+	}
+
+	if (n == 1) {
+		failed = output_sync(&t[0]) < 0;
+	} else {
+		for (i = 0; i < n; i++) {
+			started[i] = pthread_create(&threads[i], NULL, output_worker, &t[i]) == 0;
+			if (!started[i])
+				output_worker(&t[i]); /* no thread, this one goes on its own */
+		}
+		for (i = 0; i < n; i++)
+			if (started[i])
+				pthread_join(threads[i], NULL);
+		for (i = 0; i < n; i++)
+			failed += t[i].ret < 0;
+	}
+
+	if (failed) {
+		fprintf(stderr, "%d of %d outputs failed\n", failed, n);
+		fail_exit_with(FAIL_OUTPUT);
+	}
+}
+
+/* Back to a single output written directly, for the next build */
+void output_reset(void)
+{
+	output_offset = -1;
+	output_update = 0;
+	output_target_count = 0;
+	output_staged = 0;
+	output_keep = 0;
+	if (output_kept_fd >= 0)
+		close(output_kept_fd);
+	output_kept_fd = -1;
+}
+
+/* Finish the output opened with output_open(), block is the sector size */
+void output_close(int fd, const char *name, unsigned int block)
+{
+	if (output_keep)
+		output_kept_fd = dup(fd);
+
+	if (output_staged)
+		output_fan_out(fd, name, block);
+
+	fail_pop(&output_fd, 1);
+}
+
+/*
+ * The image of the last output_close() with output_keep set, at offset 0
+ * and for the caller to close, -1 when none was kept.
+ */
+int output_kept(void)
+{
+	int fd = output_kept_fd;
+
+	output_kept_fd = -1;
+
+	return fd;
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Register map expander, for -expand-regmap, in place of
+ * iMX8QM/expand_c_define.sh. A register map header of the SCFW defines the
+ * base address of the instances of a block
+ *   #define DDRC_BASE_ADDR(X) 0x5c000000 + ((X * 0x100000))
+ * and its registers from it
+ *   #define DDRC_MSTR(X)            REG32(DDRC_BASE_ADDR(X) + 0x00)
+ * The header is copied and every register is followed by its address in
+ * each instance, for the DCD cfg files
+ *   #define DDRC_MSTR_0             0x5c000000
+ *   #define DDRC_MSTR_1             0x5c100000
+ * The lines are matched as the script did, the addresses are evaluated as
+ * an #if of the cfg files is (see cfgpp_eval()).
+ */
+
+#include "mkimage_common.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+
+static int is_ident_char(int c)
+{
+	return isalnum(c) || c == '_';
+}
+
+static char *regmap_strndup(const char *s, size_t n)
+{
+	char *p = strndup(s, n);
+
+	if (p == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+
+	return p;
+}
+
+/* The text after "#define" and the spaces after it, NULL for another line */
+static const char *regmap_define(const char *line)
+{
+	if (strncmp(line, "#define", 7))
+		return NULL;
+	line += 7;
+	while (*line == ' ')
+		line++;
+
+	return line;
+}
+
+/*
+ * A line "#define NAME_BASE_ADDR(X) expr" sets *base to "NAME_BASE_ADDR(X)"
+ * and *expr to expr. Returns 0 for any other line.
+ */
+static int regmap_base(const char *line, char **base, char **expr)
+{
+	const char *p = regmap_define(line);
+	const char *end;
+
+	if (p == NULL)
+		return 0;
+	for (end = p; *end && *end != ' '; end++)
+		if (!strncmp(end, "_BASE_ADDR(X)", 13) &&
+		    (end[13] == ' ' || end[13] == 0))
+			break;
+	if (*end != '_')
+		return 0;
+
+	end += 13;
+	*base = regmap_strndup(p, end - p);
+	while (*end == ' ')
+		end++;
+	*expr = regmap_strndup(end, strlen(end));
+
+	return 1;
+}
+
+/*
+ * A line "#define REG(X)  REG32(expr)", once the base is replaced by its
+ * expression, sets *name to "REG" and *expr to expr. Returns 0 for any
+ * other line.
+ */
+static int regmap_reg(const char *line, char **name, char **expr)
+{
+	const char *p = regmap_define(line);
+	const char *end, *e;
+	size_t len = strlen(line);
+
+	if (p == NULL || len == 0 || line[len - 1] != ')')
+		return 0;
+	end = strchr(p, '(');
+	if (end == NULL || strncmp(end, "(X)", 3))
+		return 0;
+	for (e = end + 3; *e == ' ' || *e == '\t'; e++)
+		;
+	if (strncmp(e, "REG32(", 6) || line + len - 1 < e + 6)
+		return 0;
+	e += 6;
+
+	*name = regmap_strndup(p, end - p);
+	*expr = regmap_strndup(e, line + len - 1 - e);
+
+	return 1;
+}
+
+/* line with the first base replaced by expr, NULL when there is none */
+static char *regmap_subst(const char *line, const char *base, const char *expr)
+{
+	const char *p = strstr(line, base);
+	size_t n, blen = strlen(base), elen = strlen(expr);
+	char *s;
+
+	if (p == NULL)
+		return NULL;
+
+	n = p - line;
+	s = malloc(strlen(line) - blen + elen + 1);
+	if (s == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+	memcpy(s, line, n);
+	memcpy(s + n, expr, elen);
+	strcpy(s + n + elen, p + blen);
+
+	return s;
+}
+
+/* expr of the register in instance inst: every X in it becomes inst */
+static uint64_t regmap_addr(const char *expr, int inst, const char *file, int lineno)
+{
+	char *s, *q, num[16];
+	const char *p, *t;
+	int n = snprintf(num, sizeof(num), "%d", inst);
+	uint64_t v;
+
+	s = malloc(strlen(expr) * n + 1);
+	if (s == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+
+	for (p = expr, q = s; *p; ) {
+		if (!is_ident_char(*p)) {
+			*q++ = *p++;
+			continue;
+		}
+		for (t = p; is_ident_char(*t); t++)
+			;
+		if (t - p == 1 && *p == 'X') {
+			memcpy(q, num, n);
+			q += n;
+		} else {
+			memcpy(q, p, t - p);
+			q += t - p;
+		}
+		p = t;
+	}
+	*q = 0;
+
+	fail_push(fail_free, &s);
+	v = cfgpp_eval(s, file, lineno);
+	fail_pop(&s, 1);
+
+	return v;
+}
+
+/*
+ * Expand the register map header name to out, with the addresses of the
+ * instances 0 to instances - 1 of every register
+ */
+void regmap_expand(const char *name, FILE *out, int instances)
+{
+	char *line = NULL, *base = NULL, *base_expr = NULL;
+	char *s, *reg = NULL, *expr = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int lineno = 0, inst, pad;
+	FILE *fp;
+
+	fp = fopen(name, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: Can't open: %s\n", name, strerror(errno));
+		fail_exit_with(FAIL_INPUT);
+	}
+	fail_push(fail_fclose, &fp);
+	fail_push(fail_free, &line);
+	fail_push(fail_free, &base);
+	fail_push(fail_free, &base_expr);
+
+	while ((len = getline(&line, &size, fp)) > 0) {
+		lineno++;
+		fputs(line, out);
+		if (line[len - 1] == '\n')
+			line[--len] = 0;
+
+		/* the registers follow the base */
+		if (base == NULL) {
+			regmap_base(line, &base, &base_expr);
+			continue;
+		}
+
+		s = regmap_subst(line, base, base_expr);
+		if (s == NULL)
+			continue;
+		fail_push(fail_free, &s);
+		if (regmap_reg(s, &reg, &expr)) {
+			fail_push(fail_free, &reg);
+			fail_push(fail_free, &expr);
+			for (inst = 0; inst < instances; inst++) {
+				/* "#define %-23s 0x%x" of REG_inst, as the script */
+				pad = 23 - (int) strlen(reg) - snprintf(NULL, 0, "_%d", inst);
+				fprintf(out, "#define %s_%d%*s 0x%" PRIx64 "\n", reg, inst,
+					pad > 0 ? pad : 0, "",
+					regmap_addr(expr, inst, name, lineno));
+			}
+			fail_pop(&expr, 1);
+			fail_pop(&reg, 1);
+		}
+		fail_pop(&s, 1);
+	}
+	fail_pop(&fp, 1);
+
+	if (base == NULL)
+		fprintf(stderr, "%s: no #define of a *_BASE_ADDR(X), nothing expanded\n", name);
+
+	fail_pop(&base_expr, 1);
+	fail_pop(&base, 1);
+	fail_pop(&line, 1);
+}
@@ -0,0 +1,428 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Build server, for -serve and -connect. The server waits for builds on a
+ * Unix socket and runs each one in a worker forked from it, up to jobs at
+ * once, so a build starts with no exec and with the hash kernels already
+ * picked. The workers share the memo of -batch, kept for the life of the
+ * server: the digests of the images, keyed by inode, size and mtime, and
+ * the DCD tables, made again when a file read for them changes.
+ *
+ * A client sends its working directory and the arguments of the build,
+ * with its standard output and error: the worker writes the messages of
+ * the build straight to them, then sends back the exit status. Only the
+ * user the server runs as is served, a build runs with its rights.
+ *
+ *   request: uint32_t len, then len bytes: cwd\0argv[0]\0...argv[argc-1]\0
+ *            with the two fds in SCM_RIGHTS
+ *   reply:   int32_t status
+ */
+
+#define _GNU_SOURCE
+#include "mkimage_common.h"
+
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define SERVE_MAX_REQUEST	(256 << 10)
+#define SERVE_MAX_ARGS		256
+
+static volatile sig_atomic_t serve_running;
+
+static void serve_reap(int sig)
+{
+	int saved = errno;
+
+	(void) sig;
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		serve_running--;
+	errno = saved;
+}
+
+static int serve_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+static int serve_read(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int serve_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Read the request of the client on cfd: its length with the fds of its
+ * output, then the strings. Returns the number of arguments, -1 when the
+ * request is not valid.
+ */
+static int serve_recv(int cfd, char **req, char **args, int *fds)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t len;
+	char *p, *end;
+	int argc = 0;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do {
+		n = recvmsg(cfd, &msg, MSG_WAITALL);
+	} while (n < 0 && errno == EINTR);
+	if (n != sizeof(len))
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+		return -1;
+	memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+	if (len == 0 || len > SERVE_MAX_REQUEST)
+		return -1;
+	*req = malloc(len);
+	if (*req == NULL || serve_read(cfd, *req, len) < 0 || (*req)[len - 1])
+		return -1;
+
+	/* the working directory, then the arguments */
+	end = *req + len;
+	for (p = *req + strlen(*req) + 1; p < end; p += strlen(p) + 1) {
+		if (argc == SERVE_MAX_ARGS)
+			return -1;
+		args[argc++] = p;
+	}
+	args[argc] = NULL;
+
+	return argc;
+}
+
+/*
+ * Make the socket path free for the server: a socket left by a server that
+ * is gone is removed, one that still answers or any other file is not.
+ * Returns -1 with the reason printed when it is in use.
+ */
+static int serve_claim(const char *path, const struct sockaddr_un *addr)
+{
+	struct stat st;
+	int fd, in_use;
+
+	if (lstat(path, &st) < 0)
+		return 0;
+	if (!S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "%s: Exists and is not a socket\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Error: socket: %s\n", strerror(errno));
+		return -1;
+	}
+	in_use = connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) == 0 ||
+		errno != ECONNREFUSED;
+	close(fd);
+	if (in_use) {
+		fprintf(stderr, "%s: Already served by a running server\n", path);
+		return -1;
+	}
+
+	unlink(path);
+
+	return 0;
+}
+
+/* Only the user of the server may send it builds */
+static int serve_allowed(int cfd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+	    len != sizeof(cred)) {
+		fprintf(stderr, "Error: SO_PEERCRED: %s\n", strerror(errno));
+		return 0;
+	}
+	if (cred.uid != geteuid()) {
+		fprintf(stderr, "Refused a build of uid %u, pid %d\n",
+			(unsigned int) cred.uid, (int) cred.pid);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Run the build sent on cfd, in a worker */
+static void serve_request(int cfd, int (*build)(int argc, char **argv))
+{
+	char *args[SERVE_MAX_ARGS + 1];
+	char *req = NULL;
+	int fds[2] = { -1, -1 };
+	int32_t status = EXIT_FAILURE;
+	jmp_buf env;
+	int argc;
+
+	argc = serve_recv(cfd, &req, args, fds);
+	if (argc < 1) {
+		serve_write(cfd, &status, sizeof(status));
+		exit(EXIT_FAILURE);
+	}
+
+	dup2(fds[0], STDOUT_FILENO);
+	dup2(fds[1], STDERR_FILENO);
+	close(fds[0]);
+	close(fds[1]);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if (chdir(req) < 0) {
+		fprintf(stderr, "%s: Can't change to it: %s\n", req, strerror(errno));
+		serve_write(cfd, &status, sizeof(status));
+		exit(EXIT_FAILURE);
+	}
+
+	batch_worker = 1;
+	optind = 0;
+	/* a failed build still answers the client */
+	if (setjmp(env) == 0) {
+		fail_set_target(&env);
+		status = build(argc, args);
+	}
+	fail_set_target(NULL);
+
+	fflush(stdout);
+	fflush(stderr);
+	serve_write(cfd, &status, sizeof(status));
+	exit(0);
+}
+
+/*
+ * Serve the builds sent to the socket path, jobs at once, every one
+ * through build(), mkimage_main(). Returns only on an error.
+ */
+int serve_run(const char *path, int jobs, int (*build)(int argc, char **argv))
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	sigset_t block, orig;
+	struct pollfd pfd;
+	int lfd, cfd;
+	pid_t pid;
+
+	if (serve_addr(&addr, path) < 0)
+		fail_exit();
+
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (serve_claim(path, &addr) < 0)
+		fail_exit();
+
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lfd < 0) {
+		fprintf(stderr, "Error: socket: %s\n", strerror(errno));
+		fail_exit();
+	}
+	if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(lfd, SOMAXCONN) < 0) {
+		fprintf(stderr, "%s: Can't listen: %s\n", path, strerror(errno));
+		close(lfd);
+		fail_exit();
+	}
+
+	batch_memo_lasting = 1;
+	batch_memo_init();
+
+	/* the workers are reaped at once, a memo waiter checks their pid */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_reap;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGCHLD, &sa, NULL);
+	sigemptyset(&block);
+	sigaddset(&block, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &block, &orig);
+
+	fprintf(stdout, "SERVE:\t%s, %d jobs\n", path, jobs);
+	fflush(stdout);
+
+	while (1) {
+		if (serve_running >= jobs) {
+			sigsuspend(&orig);
+			continue;
+		}
+
+		pfd.fd = lfd;
+		pfd.events = POLLIN;
+		if (ppoll(&pfd, 1, NULL, &orig) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error: poll: %s\n", strerror(errno));
+			break;
+		}
+
+		cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (cfd < 0)
+			continue;
+		if (!serve_allowed(cfd)) {
+			close(cfd);
+			continue;
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+		pid = fork();
+		if (pid == 0) {
+			close(lfd);
+			signal(SIGCHLD, SIG_DFL);
+			signal(SIGPIPE, SIG_IGN);
+			sigprocmask(SIG_SETMASK, &orig, NULL);
+			serve_request(cfd, build);
+		}
+		if (pid < 0)
+			fprintf(stderr, "Error: fork: %s\n", strerror(errno));
+		else
+			serve_running++;
+		close(cfd);
+	}
+
+	close(lfd);
+	unlink(path);
+
+	return -1;
+}
+
+/*
+ * Send the build of the arguments to the server on the socket path, as
+ * the ones of the command line prog, the messages of the build go to the
+ * standard output and error. Returns the exit status of the build.
+ */
+int serve_connect(const char *path, const char *prog, int argc, char **argv)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+	struct sockaddr_un addr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char cwd[PATH_MAX];
+	char *req, *p;
+	uint32_t len;
+	int32_t status;
+	int fd, i;
+
+	if (serve_addr(&addr, path) < 0)
+		fail_exit();
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		fprintf(stderr, "Error: getcwd: %s\n", strerror(errno));
+		fail_exit();
+	}
+
+	len = strlen(cwd) + 1 + strlen(prog) + 1;
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if (len > SERVE_MAX_REQUEST || argc + 1 > SERVE_MAX_ARGS) {
+		fprintf(stderr, "-connect: too many arguments\n");
+		fail_exit();
+	}
+	req = malloc(len);
+	if (req == NULL) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		fail_exit_with(FAIL_NOMEM);
+	}
+	p = stpcpy(req, cwd) + 1;
+	p = stpcpy(p, prog) + 1;
+	for (i = 0; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "%s: Can't connect: %s\n", path, strerror(errno));
+		fail_exit();
+	}
+
+	/* the fds of the output go with the length */
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	fflush(stdout);
+	fflush(stderr);
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(len) ||
+	    serve_write(fd, req, len) < 0 ||
+	    serve_read(fd, &status, sizeof(status)) < 0) {
+		fprintf(stderr, "%s: No answer from the server\n", path);
+		status = EXIT_FAILURE;
+	}
+
+	close(fd);
+	free(req);
+
+	return status;
+}
@@ -0,0 +1,866 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * SHA-256/384/512 as specified in FIPS 180-4, used to fill the
+ * image hashes of the B0 container headers.
+ *
+ * The block functions are selected at startup from the CPU features:
+ * SHA-NI, AVX-512 or AVX2 on x86-64, the ARMv8 crypto extensions on arm64
+ * and the portable C code everywhere else. Every accelerated kernel is
+ * checked against the C code before it is used, and when several can be
+ * used the fastest one on this host is picked from a short timing.
+ */
+
+#include "mkimage_common.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2	(1 << 6)
+#endif
+#ifndef HWCAP_SHA512
+#define HWCAP_SHA512	(1 << 21)
+#endif
+#endif
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define ROR64(x, n)	(((x) >> (n)) | ((x) << (64 - (n))))
+
+#define CH(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ull, 0x7137449123ef65cdull, 0xb5c0fbcfec4d3b2full, 0xe9b5dba58189dbbcull,
+	0x3956c25bf348b538ull, 0x59f111f1b605d019ull, 0x923f82a4af194f9bull, 0xab1c5ed5da6d8118ull,
+	0xd807aa98a3030242ull, 0x12835b0145706fbeull, 0x243185be4ee4b28cull, 0x550c7dc3d5ffb4e2ull,
+	0x72be5d74f27b896full, 0x80deb1fe3b1696b1ull, 0x9bdc06a725c71235ull, 0xc19bf174cf692694ull,
+	0xe49b69c19ef14ad2ull, 0xefbe4786384f25e3ull, 0x0fc19dc68b8cd5b5ull, 0x240ca1cc77ac9c65ull,
+	0x2de92c6f592b0275ull, 0x4a7484aa6ea6e483ull, 0x5cb0a9dcbd41fbd4ull, 0x76f988da831153b5ull,
+	0x983e5152ee66dfabull, 0xa831c66d2db43210ull, 0xb00327c898fb213full, 0xbf597fc7beef0ee4ull,
+	0xc6e00bf33da88fc2ull, 0xd5a79147930aa725ull, 0x06ca6351e003826full, 0x142929670a0e6e70ull,
+	0x27b70a8546d22ffcull, 0x2e1b21385c26c926ull, 0x4d2c6dfc5ac42aedull, 0x53380d139d95b3dfull,
+	0x650a73548baf63deull, 0x766a0abb3c77b2a8ull, 0x81c2c92e47edaee6ull, 0x92722c851482353bull,
+	0xa2bfe8a14cf10364ull, 0xa81a664bbc423001ull, 0xc24b8b70d0f89791ull, 0xc76c51a30654be30ull,
+	0xd192e819d6ef5218ull, 0xd69906245565a910ull, 0xf40e35855771202aull, 0x106aa07032bbd1b8ull,
+	0x19a4c116b8d2d0c8ull, 0x1e376c085141ab53ull, 0x2748774cdf8eeb99ull, 0x34b0bcb5e19b48a8ull,
+	0x391c0cb3c5c95a63ull, 0x4ed8aa4ae3418acbull, 0x5b9cca4f7763e373ull, 0x682e6ff3d6b2b8a3ull,
+	0x748f82ee5defb2fcull, 0x78a5636f43172f60ull, 0x84c87814a1f0ab72ull, 0x8cc702081a6439ecull,
+	0x90befffa23631e28ull, 0xa4506cebde82bde9ull, 0xbef9a3f7b2c67915ull, 0xc67178f2e372532bull,
+	0xca273eceea26619cull, 0xd186b8c721c0c207ull, 0xeada7dd6cde0eb1eull, 0xf57d4f7fee6ed178ull,
+	0x06f067aa72176fbaull, 0x0a637dc5a2c898a6ull, 0x113f9804bef90daeull, 0x1b710b35131c471bull,
+	0x28db77f523047d84ull, 0x32caab7b40c72493ull, 0x3c9ebe0a15c9bebcull, 0x431d67c49c100d4cull,
+	0x4cc5d4becb3e42b6ull, 0x597f299cfc657e2aull, 0x5fcb6fab3ad6faecull, 0x6c44198c4a475817ull,
+};
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint64_t sha384_iv[8] = {
+	0xcbbb9d5dc1059ed8ull, 0x629a292a367cd507ull, 0x9159015a3070dd17ull, 0x152fecd8f70e5939ull,
+	0x67332667ffc00b31ull, 0x8eb44a8768581511ull, 0xdb0c2e0d64f98fa7ull, 0x47b5481dbefa4fa4ull,
+};
+
+static const uint64_t sha512_iv[8] = {
+	0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull, 0x3c6ef372fe94f82bull, 0xa54ff53a5f1d36f1ull,
+	0x510e527fade682d1ull, 0x9b05688c2b3e6c1full, 0x1f83d9abfb41bd6bull, 0x5be0cd19137e2179ull,
+};
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint64_t load_be64(const uint8_t *p)
+{
+	return ((uint64_t)load_be32(p) << 32) | load_be32(p + 4);
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline void store_be64(uint8_t *p, uint64_t v)
+{
+	store_be32(p, v >> 32);
+	store_be32(p + 4, (uint32_t)v);
+}
+
+static inline __attribute__((always_inline))
+void sha256_blocks_generic(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	while (blocks--) {
+		for (i = 0; i < 16; i++)
+			w[i] = load_be32(data + 4 * i);
+		for (; i < 64; i++) {
+			uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+		for (i = 0; i < 64; i++) {
+			t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+				CH(e, f, g) + sha256_k[i] + w[i];
+			t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + MAJ(a, b, c);
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+
+		data += 64;
+	}
+}
+
+static inline __attribute__((always_inline))
+void sha512_blocks_generic(uint64_t *state, const uint8_t *data, size_t blocks)
+{
+	uint64_t w[80];
+	uint64_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	while (blocks--) {
+		for (i = 0; i < 16; i++)
+			w[i] = load_be64(data + 8 * i);
+		for (; i < 80; i++) {
+			uint64_t s0 = ROR64(w[i - 15], 1) ^ ROR64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+			uint64_t s1 = ROR64(w[i - 2], 19) ^ ROR64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+		for (i = 0; i < 80; i++) {
+			t1 = h + (ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41)) +
+				CH(e, f, g) + sha512_k[i] + w[i];
+			t2 = (ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39)) + MAJ(a, b, c);
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+
+		data += 128;
+	}
+}
+
+static void sha256_blocks_c(void *state, const uint8_t *data, size_t blocks)
+{
+	sha256_blocks_generic(state, data, blocks);
+}
+
+static void sha512_blocks_c(void *state, const uint8_t *data, size_t blocks)
+{
+	sha512_blocks_generic(state, data, blocks);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(void *st, const uint8_t *data, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+	uint32_t *state = st;
+	__m128i state0, state1, tmp, w, msg[4];
+	__m128i abef_save, cdgh_save;
+	int i;
+
+	/* Rearrange the state to the ABEF/CDGH layout of sha256rnds2 */
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);
+	state1 = _mm_shuffle_epi32(state1, 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while (blocks--) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		/* 16 groups of 4 rounds, msg[] keeps the last 16 schedule words */
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), mask);
+			} else {
+				tmp = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4));
+				msg[i & 3] = _mm_sha256msg2_epu32(tmp, msg[(i + 3) & 3]);
+			}
+
+			w = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, w);
+			w = _mm_shuffle_epi32(w, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, w);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+/*
+ * SHA-512 has no instructions of its own on x86-64. The message
+ * schedule of four consecutive blocks is expanded at once, one block
+ * per 64-bit lane, and the rounds then run on the scalar unit with the
+ * BMI2 rotates. AVX2 has no 64-bit rotate, AVX-512VL adds vprorq.
+ */
+static inline __attribute__((always_inline))
+void sha512_rounds_wk(uint64_t *state, const uint64_t wk[80][4], int n)
+{
+	uint64_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 80; i++) {
+		t1 = h + (ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41)) +
+			CH(e, f, g) + wk[i][n];
+		t2 = (ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39)) + MAJ(a, b, c);
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+#define VROR64_AVX2(x, n)	_mm256_or_si256(_mm256_srli_epi64(x, n), _mm256_slli_epi64(x, 64 - (n)))
+#define VROR64_AVX512(x, n)	_mm256_ror_epi64(x, n)
+
+#define SHA512_X4_KERNEL(name, isa, VROR)						\
+__attribute__((target(isa)))								\
+static void name(void *st, const uint8_t *data, size_t blocks)				\
+{											\
+	const __m256i bswap = _mm256_set_epi64x(0x08090a0b0c0d0e0full, 0x0001020304050607ull,\
+						0x08090a0b0c0d0e0full, 0x0001020304050607ull);\
+	uint64_t wk[80][4] __attribute__((aligned(32)));				\
+	__m256i w[16], x, w15, w2, s0, s1;						\
+	int i, n;									\
+											\
+	for (; blocks >= 4; blocks -= 4, data += 4 * 128) {				\
+		for (i = 0; i < 16; i++) {						\
+			uint64_t t[4];							\
+											\
+			for (n = 0; n < 4; n++)						\
+				memcpy(&t[n], data + 128 * n + 8 * i, 8);		\
+			w[i] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)t), bswap);\
+		}									\
+											\
+		for (i = 0; i < 80; i++) {						\
+			x = w[i & 15];							\
+			if (i >= 16) {							\
+				w15 = w[(i - 15) & 15];					\
+				w2 = w[(i - 2) & 15];					\
+				s0 = _mm256_xor_si256(_mm256_xor_si256(VROR(w15, 1), VROR(w15, 8)),\
+						      _mm256_srli_epi64(w15, 7));	\
+				s1 = _mm256_xor_si256(_mm256_xor_si256(VROR(w2, 19), VROR(w2, 61)),\
+						      _mm256_srli_epi64(w2, 6));	\
+				x = _mm256_add_epi64(_mm256_add_epi64(x, s0),		\
+						     _mm256_add_epi64(w[(i - 7) & 15], s1));\
+				w[i & 15] = x;						\
+			}								\
+			x = _mm256_add_epi64(x, _mm256_set1_epi64x(sha512_k[i]));	\
+			_mm256_store_si256((__m256i *)wk[i], x);			\
+		}									\
+											\
+		for (n = 0; n < 4; n++)							\
+			sha512_rounds_wk(st, wk, n);					\
+	}										\
+											\
+	sha512_blocks_generic(st, data, blocks);					\
+}
+
+SHA512_X4_KERNEL(sha512_blocks_avx2, "avx2,bmi2", VROR64_AVX2)
+SHA512_X4_KERNEL(sha512_blocks_avx512, "avx512f,avx512vl,avx2,bmi2", VROR64_AVX512)
+
+static int cpu_has_shani(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+}
+
+static int cpu_has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2");
+}
+
+static int cpu_has_avx512(void)
+{
+	__builtin_cpu_init();
+	return cpu_has_avx2() && __builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("avx512vl");
+}
+#endif
+
+#if defined(__aarch64__)
+__attribute__((target("+crypto")))
+static void sha256_blocks_ce(void *st, const uint8_t *data, size_t blocks)
+{
+	uint32_t *state = st;
+	uint32x4_t state0, state1, abcd_save, efgh_save, tmp, w, msg[4];
+	int i;
+
+	state0 = vld1q_u32(&state[0]);
+	state1 = vld1q_u32(&state[4]);
+
+	while (blocks--) {
+		abcd_save = state0;
+		efgh_save = state1;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+			else
+				msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]),
+						msg[(i + 2) & 3], msg[(i + 3) & 3]);
+
+			w = vaddq_u32(msg[i & 3], vld1q_u32(&sha256_k[4 * i]));
+			tmp = state0;
+			state0 = vsha256hq_u32(state0, state1, w);
+			state1 = vsha256h2q_u32(state1, tmp, w);
+		}
+
+		state0 = vaddq_u32(state0, abcd_save);
+		state1 = vaddq_u32(state1, efgh_save);
+
+		data += 64;
+	}
+
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+}
+
+/*
+ * Two rounds per step, the five state registers rotate their roles
+ * with a period of five steps (same scheme as the Linux arm64 code).
+ */
+static const int sha512_ce_roles[5][5] = {
+	{ 0, 1, 2, 3, 4 },
+	{ 3, 0, 4, 2, 1 },
+	{ 2, 3, 1, 4, 0 },
+	{ 4, 2, 0, 1, 3 },
+	{ 1, 4, 3, 0, 2 },
+};
+
+__attribute__((target("+sha3")))
+static void sha512_blocks_ce(void *st, const uint8_t *data, size_t blocks)
+{
+	uint64_t *state = st;
+	uint64x2_t v[5], save[4], msg[8], kw, t6, t7, m;
+	int r, i;
+
+	for (i = 0; i < 4; i++)
+		save[i] = vld1q_u64(&state[2 * i]);
+
+	while (blocks--) {
+		for (i = 0; i < 4; i++)
+			v[i] = save[i];
+		for (i = 0; i < 8; i++)
+			msg[i] = vreinterpretq_u64_u8(vrev64q_u8(vld1q_u8(data + 16 * i)));
+
+		for (r = 0; r < 40; r++) {
+			const int *ro = sha512_ce_roles[r % 5];
+			uint64x2_t *in0 = &msg[r % 8];
+
+			kw = vaddq_u64(vld1q_u64(&sha512_k[2 * r]), *in0);
+			kw = vextq_u64(kw, kw, 1);
+			t6 = vextq_u64(v[ro[2]], v[ro[3]], 1);
+			t7 = vextq_u64(v[ro[1]], v[ro[2]], 1);
+			v[ro[3]] = vaddq_u64(v[ro[3]], kw);
+			if (r < 32) {
+				m = vextq_u64(msg[(r + 4) % 8], msg[(r + 5) % 8], 1);
+				*in0 = vsha512su0q_u64(*in0, msg[(r + 1) % 8]);
+			}
+			v[ro[3]] = vsha512hq_u64(v[ro[3]], t6, t7);
+			if (r < 32)
+				*in0 = vsha512su1q_u64(*in0, msg[(r + 7) % 8], m);
+			v[ro[4]] = vaddq_u64(v[ro[1]], v[ro[3]]);
+			v[ro[3]] = vsha512h2q_u64(v[ro[3]], v[ro[1]], v[ro[0]]);
+		}
+
+		for (i = 0; i < 4; i++)
+			save[i] = vaddq_u64(save[i], v[i]);
+
+		data += 128;
+	}
+
+	for (i = 0; i < 4; i++)
+		vst1q_u64(&state[2 * i], save[i]);
+}
+
+static int cpu_has_sha2_ce(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_SHA2);
+}
+
+static int cpu_has_sha512_ce(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_SHA512);
+}
+#endif
+
+typedef struct {
+	const char *name;
+	uint32_t block_len;	/* 64 for SHA-256, 128 for SHA-384/512 */
+	void (*blocks)(void *state, const uint8_t *data, size_t blocks);
+	int (*supported)(void);
+} sha2_kernel_t;
+
+/*
+ * The portable C kernels are the last entry of each size. The order does
+ * not pick the kernel, the usable ones are timed (see sha2_select()).
+ */
+static const sha2_kernel_t sha2_kernels[] = {
+#if defined(__x86_64__)
+	{ "shani",	64,	sha256_blocks_shani,	cpu_has_shani },
+	{ "avx512",	128,	sha512_blocks_avx512,	cpu_has_avx512 },
+	{ "avx2",	128,	sha512_blocks_avx2,	cpu_has_avx2 },
+#elif defined(__aarch64__)
+	{ "armv8-ce",	64,	sha256_blocks_ce,	cpu_has_sha2_ce },
+	{ "armv8-ce",	128,	sha512_blocks_ce,	cpu_has_sha512_ce },
+#endif
+	{ "c",		64,	sha256_blocks_c,	NULL },
+	{ "c",		128,	sha512_blocks_c,	NULL },
+};
+
+#define SHA2_NUM_KERNELS	(sizeof(sha2_kernels) / sizeof(sha2_kernels[0]))
+
+/* the timing that picks a kernel, a couple of ms on its first use */
+#define SHA2_TIME_LEN		(32 << 10)
+#define SHA2_TIME_RUNS		3
+
+static const sha2_kernel_t *sha256_kernel;
+static const sha2_kernel_t *sha512_kernel;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+static pthread_once_t sha512_once = PTHREAD_ONCE_INIT;
+
+/* Run a kernel over a fixed pattern and compare it with the C kernel */
+static int sha2_kernel_check(const sha2_kernel_t *k, const sha2_kernel_t *ref)
+{
+	uint8_t data[7 * SHA2_MAX_BLOCK_LEN];
+	uint64_t s1[8], s2[8];
+	size_t i;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 7 + 3;
+
+	memset(s1, 0, sizeof(s1));
+	memset(s2, 0, sizeof(s2));
+	if (k->block_len == 64) {
+		memcpy(s1, sha256_iv, sizeof(sha256_iv));
+		memcpy(s2, sha256_iv, sizeof(sha256_iv));
+	} else {
+		memcpy(s1, sha512_iv, sizeof(sha512_iv));
+		memcpy(s2, sha512_iv, sizeof(sha512_iv));
+	}
+
+	k->blocks(s1, data, sizeof(data) / k->block_len);
+	ref->blocks(s2, data, sizeof(data) / k->block_len);
+
+	return !memcmp(s1, s2, sizeof(s1));
+}
+
+static const sha2_kernel_t *sha2_find_ref(uint32_t block_len)
+{
+	int i;
+
+	for (i = SHA2_NUM_KERNELS - 1; i >= 0; i--)
+		if (sha2_kernels[i].block_len == block_len && !sha2_kernels[i].supported)
+			return &sha2_kernels[i];
+
+	return NULL;
+}
+
+/* The best of a few runs of k over len bytes of data, in ns */
+static uint64_t sha2_time(const sha2_kernel_t *k, const uint8_t *data, size_t len)
+{
+	struct timespec t0, t1;
+	uint64_t state[8], ns, best = UINT64_MAX;
+	int i;
+
+	memcpy(state, sha512_iv, sizeof(state));
+	for (i = 0; i < SHA2_TIME_RUNS; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		k->blocks(state, data, len / k->block_len);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ns = (t1.tv_sec - t0.tv_sec) * 1000000000ull + t1.tv_nsec - t0.tv_nsec;
+		if (ns < best)
+			best = ns;
+	}
+
+	return best;
+}
+
+/*
+ * The kernel for block_len: the fastest of the ones this CPU supports and
+ * that pass their self check. A wider vector unit is not always faster
+ * (AVX-512 may lower the clock), so they are timed rather than ranked.
+ */
+static const sha2_kernel_t *sha2_select(uint32_t block_len)
+{
+	const sha2_kernel_t *ref = sha2_find_ref(block_len);
+	const sha2_kernel_t *usable[SHA2_NUM_KERNELS];
+	const sha2_kernel_t *k, *best;
+	uint64_t ns, best_ns = UINT64_MAX;
+	uint8_t *data;
+	int i, n = 0;
+
+	for (k = sha2_kernels; k < sha2_kernels + SHA2_NUM_KERNELS; k++) {
+		if (k->block_len != block_len || !k->supported)
+			continue;
+		if (!k->supported())
+			continue;
+		if (sha2_kernel_check(k, ref)) {
+			usable[n++] = k;
+			continue;
+		}
+		fprintf(stderr, "Warning: %s SHA kernel failed its self check, not used\n",
+			k->name);
+	}
+
+	if (n == 0)
+		return ref;
+	usable[n++] = ref;
+
+	data = malloc(SHA2_TIME_LEN);
+	if (data == NULL)
+		return usable[0];
+	for (i = 0; i < SHA2_TIME_LEN; i++)
+		data[i] = i * 131 + (i >> 12);
+
+	best = usable[0];
+	for (i = 0; i < n; i++) {
+		ns = sha2_time(usable[i], data, SHA2_TIME_LEN);
+		if (ns < best_ns) {
+			best_ns = ns;
+			best = usable[i];
+		}
+	}
+	free(data);
+
+	return best;
+}
+
+static void sha256_dispatch_init(void)
+{
+	sha256_kernel = sha2_select(64);
+}
+
+static void sha512_dispatch_init(void)
+{
+	sha512_kernel = sha2_select(128);
+}
+
+/*
+ * Pick the kernels of block_len the first time one is needed, not when
+ * the program or libmkimage is loaded: most runs never hash with both.
+ */
+static void sha2_dispatch(uint32_t block_len)
+{
+	if (block_len == 64)
+		pthread_once(&sha256_once, sha256_dispatch_init);
+	else
+		pthread_once(&sha512_once, sha512_dispatch_init);
+}
+
+static void sha2_blocks(sha2_ctx_t *ctx, const uint8_t *data, size_t blocks)
+{
+	if (ctx->hash_type == 256)
+		sha256_kernel->blocks(ctx->state.s256, data, blocks);
+	else
+		sha512_kernel->blocks(ctx->state.s512, data, blocks);
+}
+
+void sha2_init(sha2_ctx_t *ctx, uint32_t hash_type)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->hash_type = hash_type;
+
+	switch (hash_type) {
+	case 256:
+		memcpy(ctx->state.s256, sha256_iv, sizeof(sha256_iv));
+		ctx->block_len = 64;
+		break;
+	case 384:
+		memcpy(ctx->state.s512, sha384_iv, sizeof(sha384_iv));
+		ctx->block_len = 128;
+		break;
+	case 512:
+		memcpy(ctx->state.s512, sha512_iv, sizeof(sha512_iv));
+		ctx->block_len = 128;
+		break;
+	default:
+		fprintf(stderr, "Wrong hash type selected (%d) !!!\n\n",
+				hash_type);
+		fail_exit();
+	}
+
+	sha2_dispatch(ctx->block_len);
+}
+
+void sha2_update(sha2_ctx_t *ctx, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t todo;
+
+	ctx->total += len;
+
+	if (ctx->buf_len) {
+		todo = ctx->block_len - ctx->buf_len;
+		if (todo > len)
+			todo = len;
+		memcpy(ctx->buf + ctx->buf_len, p, todo);
+		ctx->buf_len += todo;
+		p += todo;
+		len -= todo;
+		if (ctx->buf_len < ctx->block_len)
+			return;
+		sha2_blocks(ctx, ctx->buf, 1);
+		ctx->buf_len = 0;
+	}
+
+	if (len >= ctx->block_len) {
+		todo = len / ctx->block_len;
+		sha2_blocks(ctx, p, todo);
+		p += todo * ctx->block_len;
+		len -= todo * ctx->block_len;
+	}
+
+	memcpy(ctx->buf, p, len);
+	ctx->buf_len = len;
+}
+
+/* Feed len zero bytes, used for the alignment padding of the images */
+void sha2_update_zero(sha2_ctx_t *ctx, uint64_t len)
+{
+	static const uint8_t zeros[0x1000];
+
+	while (len) {
+		size_t todo = len > sizeof(zeros) ? sizeof(zeros) : len;
+
+		sha2_update(ctx, zeros, todo);
+		len -= todo;
+	}
+}
+
+uint32_t sha2_final(sha2_ctx_t *ctx, uint8_t *digest)
+{
+	uint32_t len_off = ctx->block_len - (ctx->block_len == 64 ? 8 : 16);
+	uint32_t digest_len = ctx->hash_type / 8;
+	uint32_t i;
+
+	ctx->buf[ctx->buf_len++] = 0x80;
+	if (ctx->buf_len > len_off) {
+		memset(ctx->buf + ctx->buf_len, 0, ctx->block_len - ctx->buf_len);
+		sha2_blocks(ctx, ctx->buf, 1);
+		ctx->buf_len = 0;
+	}
+	memset(ctx->buf + ctx->buf_len, 0, ctx->block_len - ctx->buf_len);
+
+	/* Message length in bits, big endian, in the last 8 (or 16) bytes */
+	if (ctx->block_len == 128)
+		store_be64(ctx->buf + len_off, ctx->total >> 61);
+	store_be64(ctx->buf + ctx->block_len - 8, ctx->total << 3);
+	sha2_blocks(ctx, ctx->buf, 1);
+
+	for (i = 0; i < digest_len; i += (ctx->hash_type == 256 ? 4 : 8)) {
+		if (ctx->hash_type == 256)
+			store_be32(digest + i, ctx->state.s256[i / 4]);
+		else
+			store_be64(digest + i, ctx->state.s512[i / 8]);
+	}
+
+	return digest_len;
+}
+
+static double sha2_bench(const sha2_kernel_t *k, const uint8_t *data, size_t len)
+{
+	struct timespec t0, t1;
+	uint64_t state[8];
+	double sec;
+	int rounds = 0;
+
+	memcpy(state, sha512_iv, sizeof(state));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		k->blocks(state, data, len / k->block_len);
+		rounds++;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	} while (sec < 0.5);
+
+	return (double)len * rounds / sec / 1e9;
+}
+
+/* The examples of FIPS 180-2, the known answers of the selftest */
+static const struct {
+	uint32_t hash_type;
+	const char *msg;
+	const char *digest;
+} sha2_kat[] = {
+	{ HASH_TYPE_SHA_256, "",
+	  "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+	{ HASH_TYPE_SHA_256, "abc",
+	  "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+	{ HASH_TYPE_SHA_256, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+	  "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+	{ HASH_TYPE_SHA_384, "",
+	  "38b060a751ac96384cd9327eb1b1e36a21fdb71114be07434c0cc7bf63f6e1da"
+	  "274edebfe76f65fbd51ad2f14898b95b" },
+	{ HASH_TYPE_SHA_384, "abc",
+	  "cb00753f45a35e8bb5a03d699ac65007272c32ab0eded1631a8b605a43ff5bed"
+	  "8086072ba1e7cc2358baeca134c825a7" },
+	{ HASH_TYPE_SHA_384, "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+	  "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+	  "09330c33f71147e83d192fc782cd1b4753111b173b3b05d22fa08086e3b0f712"
+	  "fcc7c71a557e2db966c3e9fa91746039" },
+	{ HASH_TYPE_SHA_512, "",
+	  "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
+	  "47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e" },
+	{ HASH_TYPE_SHA_512, "abc",
+	  "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+	  "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f" },
+	{ HASH_TYPE_SHA_512, "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+	  "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+	  "8e959b75dae313da8cf4f72814fc143f8f7779c6eb9f7fa17299aeadb6889018"
+	  "501d289e4900f7e4331b99dec4b5433ac7d329eeb6dd26545e96e55b874be909" },
+};
+
+/*
+ * Hash the known answer messages with the selected kernels, each one fed
+ * in two parts split at every offset. Returns the number of failures.
+ */
+static int sha2_kat_check(void)
+{
+	uint8_t digest[SHA2_MAX_DIGEST_LEN];
+	char hex[2 * SHA2_MAX_DIGEST_LEN + 1];
+	sha2_ctx_t ctx;
+	size_t i, j, len, split;
+	int failed = 0;
+
+	for (i = 0; i < sizeof(sha2_kat) / sizeof(sha2_kat[0]); i++) {
+		len = strlen(sha2_kat[i].msg);
+		for (split = 0; split <= len; split++) {
+			sha2_init(&ctx, sha2_kat[i].hash_type);
+			sha2_update(&ctx, sha2_kat[i].msg, split);
+			sha2_update(&ctx, sha2_kat[i].msg + split, len - split);
+			sha2_final(&ctx, digest);
+			for (j = 0; j < sha2_kat[i].hash_type / 8; j++)
+				sprintf(hex + 2 * j, "%02x", digest[j]);
+			if (strcmp(hex, sha2_kat[i].digest))
+				break;
+		}
+		if (split <= len) {
+			fprintf(stdout, "sha%-9u FIPS 180-2 example %zu FAILED\n",
+				sha2_kat[i].hash_type, i);
+			failed++;
+		}
+	}
+
+	if (!failed)
+		fprintf(stdout, "%-12s FIPS 180-2 examples passed\n", "sha256/384/512");
+
+	return failed;
+}
+
+/*
+ * Check the known answers, then check and time every SHA kernel usable on
+ * this CPU, and print the throughput in GB/s. Returns the number of checks
+ * that failed.
+ */
+int sha2_selftest(void)
+{
+	const size_t len = 16 << 20;
+	const sha2_kernel_t *k;
+	uint8_t *data;
+	int failed = sha2_kat_check();
+	size_t i;
+
+	data = malloc(len);
+	if (!data) {
+		fprintf(stderr, "Failed to allocate memory (%zu)\n", len);
+		fail_exit_with(FAIL_NOMEM);
+	}
+	for (i = 0; i < len; i++)
+		data[i] = i * 131 + (i >> 12);
+
+	/* the known answers picked the kernels of both sizes */
+	for (k = sha2_kernels; k < sha2_kernels + SHA2_NUM_KERNELS; k++) {
+		const char *algo = k->block_len == 64 ? "sha256" : "sha384/512";
+		bool selected = (k == sha256_kernel || k == sha512_kernel);
+
+		if (k->supported && !k->supported()) {
+			fprintf(stdout, "%-12s %-10s not supported by this CPU\n", algo, k->name);
+			continue;
+		}
+
+		if (!sha2_kernel_check(k, sha2_find_ref(k->block_len))) {
+			fprintf(stdout, "%-12s %-10s FAILED\n", algo, k->name);
+			failed++;
+			continue;
+		}
+
+		fprintf(stdout, "%-12s %-10s %6.2f GB/s%s\n", algo, k->name,
+			sha2_bench(k, data, len), selected ? "  (selected)" : "");
+	}
+
+	free(data);
+
+	return failed;
+}
@@ -0,0 +1,398 @@
+/*
+ * Copyright 2018 NXP
+ *
+ * SPDX-License-Identifier:     GPL-2.0+
+ *
+ * Copy file ranges through an io_uring: a fixed number of buffers (the
+ * queue depth) cycle between reads from the input and writes to the
+ * output, so the next chunks, and the next image, are read while the
+ * current ones are written. The buffers are registered with the kernel
+ * when the memlock limit allows it. The holes of the inputs are kept.
+ * Without them the plain IORING_OP_READ and WRITE are needed, which the
+ * kernels before 5.6 do not have: the copy is then left to the caller.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "fileio.h"
+
+__thread unsigned int uring_depth;
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+#define URING_CHUNK_SIZE	(1 << 20)
+
+enum { SLOT_FREE, SLOT_READ, SLOT_WRITE };
+
+typedef struct {
+	int state;
+	int ifd;
+	off_t ioff;		/* start of the chunk in the input */
+	off_t ooff;		/* start of the chunk in the output */
+	size_t len;
+	size_t done;		/* bytes of the current read or write done */
+	uint8_t *buf;
+} uring_slot_t;
+
+typedef struct {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned int to_submit;
+	unsigned int inflight;	/* submitted, not completed */
+	int fixed;		/* the buffers are registered */
+} uring_t;
+
+/* Position in the list of ranges, the next chunk to read starts there */
+typedef struct {
+	const copy_range_t *r;
+	int count;
+	int i;
+	off_t pos;		/* offset in the input of range i */
+	off_t data_end;		/* end of the data segment at pos */
+} range_iter_t;
+
+static int uring_init(uring_t *u, unsigned int entries)
+{
+	struct io_uring_params p;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return -1;
+
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len)
+			u->sq_len = u->cq_len;
+		u->cq_len = u->sq_len;
+	}
+
+	u->sq_ptr = mmap(0, u->sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED)
+		goto err_close;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(0, u->cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED)
+			goto err_sq;
+	}
+
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(0, u->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto err_cq;
+
+	u->sq_head = (unsigned int *)((char *)u->sq_ptr + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned int *)((char *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+
+	return 0;
+
+err_cq:
+	if (u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_len);
+err_sq:
+	munmap(u->sq_ptr, u->sq_len);
+err_close:
+	close(u->fd);
+	return -1;
+}
+
+static void uring_exit(uring_t *u)
+{
+	munmap(u->sqes, u->sqes_len);
+	if (u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_len);
+	munmap(u->sq_ptr, u->sq_len);
+	close(u->fd);
+}
+
+static void uring_queue(uring_t *u, uring_slot_t *s, int index, int ofd)
+{
+	unsigned int tail = *u->sq_tail;
+	unsigned int i = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[i];
+	int rd = s->state == SLOT_READ;
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (u->fixed) {
+		sqe->opcode = rd ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		sqe->buf_index = index;
+	} else {
+		sqe->opcode = rd ? IORING_OP_READ : IORING_OP_WRITE;
+	}
+	sqe->fd = rd ? s->ifd : ofd;
+	sqe->off = (rd ? s->ioff : s->ooff) + s->done;
+	sqe->addr = (uintptr_t)(s->buf + s->done);
+	sqe->len = s->len - s->done;
+	sqe->user_data = index;
+
+	u->sq_array[i] = i;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+}
+
+/* The kernel has IORING_OP_READ and IORING_OP_WRITE, 5.6 and later */
+static int uring_has_rw(uring_t *u)
+{
+	struct io_uring_probe *p;
+	unsigned int nops = IORING_OP_WRITE + 1;
+	int ok;
+
+	p = calloc(1, sizeof(*p) + nops * sizeof(p->ops[0]));
+	if (p == NULL)
+		return 0;
+
+	/* no probe before 5.6 either */
+	ok = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, p, nops) == 0 &&
+		p->last_op >= IORING_OP_WRITE &&
+		(p->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+		(p->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	free(p);
+
+	return ok;
+}
+
+/*
+ * Wait for the reads and writes still in flight, their buffers can not be
+ * freed before. What was queued and not submitted is never run.
+ */
+static void uring_drain(uring_t *u)
+{
+	unsigned int head;
+	int err = errno;
+
+	while (u->inflight) {
+		if (syscall(__NR_io_uring_enter, u->fd, 0, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR)
+			break;
+
+		head = *u->cq_head;
+		while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			head++;
+			u->inflight--;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	errno = err;
+}
+
+/* Find the next chunk of data, the holes on the way are written as zeros */
+static int range_next(range_iter_t *it, int ofd, uring_slot_t *s)
+{
+	const copy_range_t *r;
+	off_t data, end;
+
+	while (it->i < it->count) {
+		r = &it->r[it->i];
+		end = r->ioff + r->len;
+
+		if (it->pos >= it->data_end) {
+			if (it->pos >= end) {
+				if (++it->i < it->count)
+					it->pos = it->data_end = it->r[it->i].ioff;
+				continue;
+			}
+
+			data = it->pos;
+			it->data_end = end;
+#ifdef SEEK_HOLE
+			data = lseek(r->ifd, it->pos, SEEK_DATA);
+			if (data < 0 || data > end)
+				data = end; /* ENXIO: only a hole up to the end of file */
+			it->data_end = lseek(r->ifd, data, SEEK_HOLE);
+			if (it->data_end < 0 || it->data_end > end)
+				it->data_end = end;
+#endif
+			/* writes are in flight, the file size can not be trusted */
+			if (data > it->pos &&
+			    write_zeros(ofd, r->ooff + it->pos - r->ioff,
+					data - it->pos, COPY_FD_SHARED) < 0)
+				return -1;
+			it->pos = data;
+			continue;
+		}
+
+		s->ifd = r->ifd;
+		s->ioff = it->pos;
+		s->ooff = r->ooff + it->pos - r->ioff;
+		s->len = it->data_end - it->pos;
+		if (s->len > URING_CHUNK_SIZE)
+			s->len = URING_CHUNK_SIZE;
+		s->done = 0;
+		it->pos += s->len;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the ranges to ofd with a queue of depth chunks. Returns 0 on
+ * success, 1 when io_uring can not be used here (the caller copies the
+ * ranges another way), -1 with errno set on a read or write error.
+ */
+int uring_copy_ranges(int ofd, const copy_range_t *r, int count, unsigned int depth)
+{
+	uring_t u;
+	uring_slot_t *slots;
+	struct iovec *iov;
+	range_iter_t it;
+	struct io_uring_cqe *cqe;
+	unsigned int head, busy = 0, i;
+	uint8_t *bufs;
+	int ret = -1, n, more = 1, started = 0;
+
+	if (count == 0)
+		return 0;
+	if (depth == 0)
+		return 1;
+
+	if (uring_init(&u, 2 * depth) < 0)
+		return 1;
+
+	it.r = r;
+	it.count = count;
+	it.i = 0;
+	it.pos = it.data_end = r->ioff;
+
+	slots = calloc(depth, sizeof(*slots));
+	iov = calloc(depth, sizeof(*iov));
+	if (slots == NULL || iov == NULL ||
+	    posix_memalign((void **)&bufs, 4096, (size_t)depth * URING_CHUNK_SIZE)) {
+		free(slots);
+		free(iov);
+		uring_exit(&u);
+		return 1;
+	}
+
+	for (i = 0; i < depth; i++) {
+		slots[i].buf = bufs + (size_t)i * URING_CHUNK_SIZE;
+		iov[i].iov_base = slots[i].buf;
+		iov[i].iov_len = URING_CHUNK_SIZE;
+	}
+
+	/* plain reads and writes when RLIMIT_MEMLOCK is too low to pin them */
+	u.fixed = syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_BUFFERS,
+			iov, depth) == 0;
+	if (!u.fixed && !uring_has_rw(&u)) {
+		ret = 1;
+		goto out;
+	}
+
+	while (more || busy) {
+		for (i = 0; more && i < depth; i++) {
+			if (slots[i].state != SLOT_FREE)
+				continue;
+			n = range_next(&it, ofd, &slots[i]);
+			if (n < 0)
+				goto out;
+			if (n == 0) {
+				more = 0;
+				break;
+			}
+			slots[i].state = SLOT_READ;
+			uring_queue(&u, &slots[i], i, ofd);
+			busy++;
+		}
+
+		if (busy == 0)
+			break;
+
+		n = syscall(__NR_io_uring_enter, u.fd, u.to_submit, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			goto out;
+		}
+		if (n > (int)u.to_submit)
+			n = u.to_submit;
+		u.to_submit -= n;
+		u.inflight += n;
+
+		head = *u.cq_head;
+		while (head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &u.cqes[head & *u.cq_mask];
+			uring_slot_t *s = &slots[cqe->user_data];
+
+			head++;
+			u.inflight--;
+			if (cqe->res <= 0) {
+				/* an opcode or a file the kernel can not do it with */
+				if (cqe->res == -EINVAL && !started)
+					ret = 1;
+				errno = cqe->res < 0 ? -cqe->res : EIO;
+				__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+				goto out;
+			}
+
+			started = 1;
+			s->done += cqe->res;
+			if (s->done == s->len) {
+				if (s->state == SLOT_READ) {
+					s->state = SLOT_WRITE;
+					s->done = 0;
+				} else {
+					s->state = SLOT_FREE;
+					busy--;
+				}
+			}
+			/* the rest of a short read or write, or the write */
+			if (s->state != SLOT_FREE)
+				uring_queue(&u, s, s - slots, ofd);
+		}
+		__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	ret = 0;
+out:
+	uring_drain(&u);
+	uring_exit(&u);
+	free(bufs);
+	free(iov);
+	free(slots);
+
+	return ret;
+}
+
+#else
+
+int uring_copy_ranges(int ofd, const copy_range_t *r, int count, unsigned int depth)
+{
+	return count ? 1 : 0;
+}
+
+#endif